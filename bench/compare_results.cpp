@@ -0,0 +1,249 @@
+#include "results.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// compares two commits' results from train_regression, and flags a metric
+// as a regression if it's worse by more than the threshold and the
+// difference is significant, by welch's t-test at the confidence given (held
+// to holm's correction for testing every metric at once):
+//
+//     ./build/compare_results [--results path] [--confidence 0.95] [--threshold 1] [baseline [candidate]]
+//
+// the candidate is the latest commit in the store and the baseline the one
+// before it, unless they're given. every run of a commit on the candidate's
+// host is pooled, runs on other hosts are left out. a metric with fewer than
+// two samples on either side can't be tested, so it's flagged on the
+// threshold alone (peak_rss_kb, if each commit was only run the once), and
+// one the baseline has that the candidate doesn't is a regression, as it
+// means the candidate stopped measuring it. exits with 1 if anything
+// regressed, so it can fail a build.
+
+// what's better, more or less. rates and reached_accuracy are more,
+// everything else is a time, a count of steps or an amount of memory
+static bool higher_is_better(const std::string &metric)
+{
+	const std::string suffix = "_per_second";
+	return metric == "reached_accuracy" ||
+	       (metric.size() >= suffix.size() && metric.compare(metric.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+struct commit_results
+{
+	unsigned runs = 0;
+	std::string network;
+	std::map<std::string, std::vector<double>> values;
+};
+
+static commit_results gather(const std::vector<run_record> &runs, const std::string &commit, const std::string &host)
+{
+	commit_results results;
+
+	for (const run_record &run : runs)
+	{
+		if (run.commit != commit || run.host != host)
+			continue;
+
+		results.runs++;
+		results.network = run.network;
+
+		for (const auto &[name, samples] : run.values)
+			results.values[name].insert(results.values[name].end(), samples.begin(), samples.end());
+	}
+
+	return results;
+}
+
+int main(const int argc, const char *argv[])
+{
+	std::string path = default_results_path();
+	double confidence = 0.95;
+	double threshold = 1.0;
+	std::vector<std::string> commits;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--results") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if (strcmp(argv[i], "--confidence") == 0 && i + 1 < argc)
+			confidence = atof(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if (argv[i][0] != '-' && commits.size() < 2)
+			commits.push_back(argv[i]);
+		else
+		{
+			printf("usage: %s [--results path] [--confidence 0.95] [--threshold percent] [baseline [candidate]]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (confidence <= 0.0 || confidence >= 1.0)
+	{
+		printf("the confidence has to be between 0 and 1\n");
+		return 2;
+	}
+
+	std::vector<run_record> runs;
+	if (!load_runs(path, runs) || runs.empty())
+	{
+		printf("no results in %s, run train_regression first\n", path.c_str());
+		return 2;
+	}
+
+	// the latest commit, and the latest one before it that isn't the same
+	if (commits.size() < 2)
+	{
+		const std::string candidate = runs.back().commit;
+		std::string baseline = commits.empty() ? "" : commits[0];
+
+		if (baseline.empty())
+		{
+			for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+				if (run->commit != candidate)
+				{
+					baseline = run->commit;
+					break;
+				}
+		}
+
+		if (baseline.empty() || baseline == candidate)
+		{
+			printf("only %s is in %s, there's nothing to compare it with\n", candidate.c_str(), path.c_str());
+			return 2;
+		}
+
+		commits = { baseline, candidate };
+	}
+
+	// whichever host the candidate was last run on
+	std::string host;
+	for (auto run = runs.rbegin(); run != runs.rend() && host.empty(); ++run)
+		if (run->commit == commits[1])
+			host = run->host;
+
+	const commit_results baseline = gather(runs, commits[0], host);
+	const commit_results candidate = gather(runs, commits[1], host);
+
+	if (baseline.runs == 0 || candidate.runs == 0)
+	{
+		printf("no runs of %s on %s\n", (baseline.runs == 0 ? commits[0] : commits[1]).c_str(), host.c_str());
+		return 2;
+	}
+
+	printf("%s\n", host.c_str());
+	printf("baseline %s (%u runs), candidate %s (%u runs), %g%% intervals\n",
+	       commits[0].c_str(), baseline.runs, commits[1].c_str(), candidate.runs, 100.0 * confidence);
+
+	if (baseline.network != candidate.network)
+		printf("the network changed, from %s to %s\n", baseline.network.c_str(), candidate.network.c_str());
+
+	printf("\n%-24s %-25s %-25s %s\n", "metric", "baseline", "candidate", "change");
+
+	std::set<std::string> metrics;
+	for (const auto &[name, samples] : baseline.values)
+		metrics.insert(name);
+	for (const auto &[name, samples] : candidate.values)
+		metrics.insert(name);
+
+	struct row
+	{
+		std::string metric;
+		std::string text;
+		double change;		// percent, candidate against baseline
+		double p;			// 0 if there were too few samples to test
+	};
+
+	std::vector<row> rows;
+	unsigned regressions = 0, improvements = 0;
+
+	for (const std::string &metric : metrics)
+	{
+		const auto b = baseline.values.find(metric), c = candidate.values.find(metric);
+		if (b == baseline.values.end())
+		{
+			printf("%-24s only in %s\n", metric.c_str(), commits[1].c_str());
+			continue;
+		}
+		if (c == candidate.values.end())
+		{
+			printf("%-24s %-70s regression\n", metric.c_str(), ("only in " + commits[0]).c_str());
+			regressions++;
+			continue;
+		}
+
+		const summary before = summarise(b->second), after = summarise(c->second);
+
+		// as a percentage of the baseline
+		const double scale = before.mean != 0.0 ? 100.0 / before.mean : 0.0;
+
+		char text[256];
+		row r{ metric, "", 0.0, 0.0 };
+
+		if (before.count < 2 || after.count < 2)
+		{
+			r.change = (after.mean - before.mean) * scale;
+			snprintf(text, sizeof(text), "%14.6g +- %-8.4g %14.6g +- %-8.4g %+6.1f%% [too few to test]",
+			         before.mean, mean_interval(before, confidence), after.mean, mean_interval(after, confidence), r.change);
+		}
+		else
+		{
+			const difference d = welch(before, after, confidence);
+			r.change = d.value * scale;
+			r.p = d.p;
+			snprintf(text, sizeof(text), "%14.6g +- %-8.4g %14.6g +- %-8.4g %+6.1f%% [%+.1f%%, %+.1f%%]",
+			         before.mean, mean_interval(before, confidence), after.mean, mean_interval(after, confidence),
+			         r.change, d.low * scale, d.high * scale);
+		}
+
+		r.text = text;
+		rows.push_back(r);
+	}
+
+	// with a couple of dozen metrics some would come up significant by chance
+	// alone every time, so the p-values are held to holm's correction: the
+	// smallest against alpha / m, the next against alpha / (m - 1) and so on,
+	// up to the first that isn't small enough
+	std::vector<const row *> by_p;
+	for (const row &r : rows)
+		by_p.push_back(&r);
+	std::sort(by_p.begin(), by_p.end(), [](const row *a, const row *b) { return a->p < b->p; });
+
+	std::set<const row *> significant;
+	for (std::size_t k = 0; k < by_p.size(); k++)
+	{
+		if (by_p[k]->p > (1.0 - confidence) / (by_p.size() - k))
+			break;
+		significant.insert(by_p[k]);
+	}
+
+	for (const row &r : rows)
+	{
+		// how much better it got, which for a time is how much it went down
+		const double better = higher_is_better(r.metric) ? r.change : -r.change;
+
+		const char *verdict = "";
+		if (significant.count(&r) && better < -threshold)
+		{
+			verdict = "regression";
+			regressions++;
+		}
+		else if (significant.count(&r) && better > threshold)
+		{
+			verdict = "improvement";
+			improvements++;
+		}
+
+		printf("%-24s %-70s %s\n", r.metric.c_str(), r.text.c_str(), verdict);
+	}
+
+	printf("\n%u regression(s), %u improvement(s)\n", regressions, improvements);
+	return regressions == 0 ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+#include "cnn/cnn.hpp"
+#include "cnn/parallel.hpp"
+#include "cnn/autotune.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+// how numa_trainer scales from one core to all of them. every worker trains on
+// its own WORKER_BATCH samples, so the step does more work with more threads
+// and perfect scaling is flat step times and samples/sec going up in line
+// with the thread count.
+//
+// --tune tunes the kernels and the thread count for this network instead, and
+// saves them to the tuning cache.
+
+constexpr unsigned WORKER_BATCH = 64;
+constexpr unsigned NUM_SAMPLES = 4096;
+constexpr unsigned NUM_CLASSES = 10;
+constexpr unsigned IMAGE_SIZE = 28;
+constexpr unsigned STEPS = 50;
+
+using InputShape = shape_t<IMAGE_SIZE, IMAGE_SIZE>;
+using OutputShape = shape_t<NUM_CLASSES>;
+
+using MyNetwork = nn::network_t<
+	InputShape,
+	nn::layers::fully_connected<300>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<100>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<NUM_CLASSES>::type,
+	nn::layers::softmax>;
+
+using Cost = nn::cost_functions::softmax_cross_entropy;
+
+struct program
+{
+	vector_of<NUM_SAMPLES, InputShape> images;
+	vector_of<NUM_SAMPLES, OutputShape> expectation;
+
+	nn::params_t<MyNetwork> params;
+
+	int run(int argc, const char *argv[]);
+};
+
+static int tune()
+{
+	const auto result = nn::autotune<Cost, WORKER_BATCH, MyNetwork>();
+
+	for (const auto &k : result.kernels)
+		printf("vec_mat %u x %u: block %u, %.0f ns (%.0f ns with the default)\n", k.rows, k.cols, k.block, k.time, k.default_time);
+
+	if (result.threads != 0)
+		printf("threads: %u, %.0f samples/sec\n", result.threads, result.samples_per_second);
+
+	if (!nn::tuning::save())
+	{
+		printf("couldn't write %s\n", nn::tuning::default_path().c_str());
+		return 1;
+	}
+
+	printf("saved to %s\n", nn::tuning::default_path().c_str());
+	return 0;
+}
+
+int program::run(const int argc, const char *argv[])
+{
+	nn::tuning::load();
+
+	if (argc > 1 && strcmp(argv[1], "--tune") == 0)
+		return tune();
+
+	// mnist shaped noise, it's only the speed we're after
+	std::minstd_rand generator(1);
+	std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+
+	for (unsigned n = 0; n < NUM_SAMPLES; n++)
+	{
+		for (auto &row : images[n])
+			for (float &v : row)
+				v = pixel(generator);
+		nn::util::expectation_from_label(n % NUM_CLASSES, expectation[n]);
+	}
+
+	const nn::numa_topology topology = nn::numa_topology::detect();
+	const unsigned cpu_count = topology.cpu_count();
+
+	printf("%u numa node(s), %u cpu(s)\n", static_cast<unsigned>(topology.nodes.size()), cpu_count);
+	printf("threads   nodes   ms/step   samples/sec   speedup\n");
+
+	double base_rate = 0.0;
+
+	for (unsigned threads = 1; ; threads = std::min(threads * 2, cpu_count))
+	{
+		nn::randomise_params<MyNetwork>(params);
+
+		nn::numa_trainer<Cost, WORKER_BATCH, MyNetwork> trainer(threads, false, topology);
+
+		unsigned step = 0;
+
+		const auto fill_shard = [&](const unsigned w, auto &input, auto &shard_expectation)
+		{
+			for (unsigned n = 0; n < WORKER_BATCH; n++)
+			{
+				const unsigned index = ((step * trainer.worker_count() + w) * WORKER_BATCH + n) % NUM_SAMPLES;
+				input[n] = images[index];
+				shard_expectation[n] = expectation[index];
+			}
+		};
+
+		const auto update = [&](auto &gradient)
+		{
+			gradient *= 0.1f;
+			params -= gradient;
+		};
+
+		// warm up, first touches and all that
+		trainer.step(params, fill_shard, update);
+
+		const auto start = std::chrono::steady_clock::now();
+
+		for (step = 0; step < STEPS; step++)
+			trainer.step(params, fill_shard, update);
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		const double rate = STEPS * WORKER_BATCH * threads / seconds;
+
+		if (threads == 1)
+			base_rate = rate;
+
+		printf("%7u   %5u   %7.2f   %11.0f   %6.2fx\n", threads, trainer.node_count(), 1000.0 * seconds / STEPS, rate, rate / base_rate);
+
+		if (threads == cpu_count)
+			break;
+	}
+
+	return 0;
+}
+
+int main(const int argc, const char *argv[])
+{
+	auto p = std::make_unique<program>();
+	return p->run(argc, argv);
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// the results store train_regression writes to and compare_results reads: a
+// text file that every run of the benchmark appends a block to,
+//
+//     run 1a2b3c4 1760000000
+//     host Intel(R) Xeon(R) Platinum 8375C CPU @ 2.90GHz
+//     network 784-300-300-100-100-10-10:266610
+//     value samples_per_second 41235.2
+//     value samples_per_second 40987.1
+//     value peak_rss_kb 51234
+//
+// with a value line per repetition, so running the benchmark again for the
+// same commit just gives that commit more samples. it's plain text so that
+// it can be kept in a repo, merged, or grepped.
+
+// -----------------------------------------------------------------------------
+
+struct run_record
+{
+	std::string commit;
+	long long time = 0;
+	std::string host;
+	std::string network;
+
+	// every sample of every metric, in the order they were taken
+	std::map<std::string, std::vector<double>> values;
+};
+
+// $NN_BENCH_RESULTS, or bench_results.txt in the working directory
+inline std::string default_results_path()
+{
+	const char *path = getenv("NN_BENCH_RESULTS");
+	return path && *path ? path : "bench_results.txt";
+}
+
+inline bool append_run(const std::string &path, const run_record &run)
+{
+	FILE *file = fopen(path.c_str(), "a");
+	if (!file)
+		return false;
+
+	fprintf(file, "run %s %lld\n", run.commit.c_str(), run.time);
+	fprintf(file, "host %s\n", run.host.c_str());
+	fprintf(file, "network %s\n", run.network.c_str());
+
+	for (const auto &[name, samples] : run.values)
+		for (const double v : samples)
+			fprintf(file, "value %s %.9g\n", name.c_str(), v);
+
+	return fclose(file) == 0;
+}
+
+// every run in the store, oldest first. false if there's no store
+inline bool load_runs(const std::string &path, std::vector<run_record> &runs)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+
+	const auto rest_of = [](const char *text)
+	{
+		std::string value = text;
+		value.erase(value.find_last_not_of(" \t\r\n") + 1);
+		return value;
+	};
+
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[512];
+		long long time;
+		double value;
+
+		if (sscanf(line, "run %511s %lld", name, &time) == 2)
+		{
+			runs.push_back(run_record{ name, time, "", "", {} });
+		}
+		else if (runs.empty())
+		{
+			// nothing to hang it on
+		}
+		else if (strncmp(line, "host ", 5) == 0)
+		{
+			runs.back().host = rest_of(line + 5);
+		}
+		else if (strncmp(line, "network ", 8) == 0)
+		{
+			runs.back().network = rest_of(line + 8);
+		}
+		else if (sscanf(line, "value %511s %lf", name, &value) == 2)
+		{
+			runs.back().values[name].push_back(value);
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+struct summary
+{
+	unsigned count = 0;
+	double mean = 0.0;
+	double deviation = 0.0;		// the sample standard deviation
+};
+
+inline summary summarise(const std::vector<double> &values)
+{
+	summary s;
+	s.count = static_cast<unsigned>(values.size());
+
+	if (s.count == 0)
+		return s;
+
+	for (const double v : values)
+		s.mean += v;
+	s.mean /= s.count;
+
+	if (s.count > 1)
+	{
+		for (const double v : values)
+			s.deviation += (v - s.mean) * (v - s.mean);
+		s.deviation = std::sqrt(s.deviation / (s.count - 1));
+	}
+
+	return s;
+}
+
+// the regularised incomplete beta function I_x(a, b), by its continued
+// fraction (lentz's method), which is all the t distribution needs
+inline double _incomplete_beta(const double a, const double b, const double x)
+{
+	if (x <= 0.0)
+		return 0.0;
+	if (x >= 1.0)
+		return 1.0;
+
+	// the continued fraction converges quickly either side of this, so the
+	// other side is done by symmetry
+	if (x > (a + 1.0) / (a + b + 2.0))
+		return 1.0 - _incomplete_beta(b, a, 1.0 - x);
+
+	const double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1.0 - x)) / a;
+
+	const double tiny = 1e-300;
+	double f = 1.0, c = 1.0, d = 0.0;
+
+	for (unsigned i = 0; i <= 400; i++)
+	{
+		const unsigned m = i / 2;
+
+		double numerator;
+		if (i == 0)
+			numerator = 1.0;
+		else if (i % 2 == 0)
+			numerator = (m * (b - m) * x) / ((a + 2.0 * m - 1.0) * (a + 2.0 * m));
+		else
+			numerator = -((a + m) * (a + b + m) * x) / ((a + 2.0 * m) * (a + 2.0 * m + 1.0));
+
+		d = 1.0 + numerator * d;
+		d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+
+		c = 1.0 + numerator / c;
+		c = std::fabs(c) < tiny ? tiny : c;
+
+		const double step = c * d;
+		f *= step;
+
+		if (std::fabs(1.0 - step) < 1e-12)
+			break;
+	}
+
+	return front * (f - 1.0);
+}
+
+// P(T <= t) for student's t with df degrees of freedom
+inline double student_t_cdf(const double t, const double df)
+{
+	const double tail = 0.5 * _incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+	return t > 0.0 ? 1.0 - tail : tail;
+}
+
+// the t with P(T <= t) = p, by bisection, which is plenty quick for a table
+inline double student_t_quantile(const double p, const double df)
+{
+	double low = -1e3, high = 1e3;
+	for (unsigned i = 0; i < 200; i++)
+	{
+		const double middle = 0.5 * (low + high);
+		(student_t_cdf(middle, df) < p ? low : high) = middle;
+	}
+	return 0.5 * (low + high);
+}
+
+// the half width of a confidence interval for the mean
+inline double mean_interval(const summary &s, const double confidence)
+{
+	if (s.count < 2)
+		return 0.0;
+
+	const double t = student_t_quantile(0.5 + confidence / 2.0, s.count - 1);
+	return t * s.deviation / std::sqrt(static_cast<double>(s.count));
+}
+
+// candidate's mean - baseline's, with a confidence interval for it and the
+// two-sided p-value for it not being 0 (welch's t-test, which doesn't assume
+// the two have the same spread)
+struct difference
+{
+	double value;
+	double low, high;
+	double p;
+};
+
+inline difference welch(const summary &baseline, const summary &candidate, const double confidence)
+{
+	difference result;
+	result.value = candidate.mean - baseline.mean;
+
+	const double a = baseline.deviation * baseline.deviation / baseline.count;
+	const double b = candidate.deviation * candidate.deviation / candidate.count;
+	const double error = std::sqrt(a + b);
+
+	// no spread at all (a count, or something deterministic), so whatever
+	// difference there is is a real one
+	if (error == 0.0)
+	{
+		result.low = result.high = result.value;
+		result.p = result.value == 0.0 ? 1.0 : 0.0;
+		return result;
+	}
+
+	// welch-satterthwaite
+	const double df = (a + b) * (a + b) / (a * a / (baseline.count - 1) + b * b / (candidate.count - 1));
+
+	const double t = student_t_quantile(0.5 + confidence / 2.0, df);
+	result.low = result.value - t * error;
+	result.high = result.value + t * error;
+
+	result.p = 2.0 * (1.0 - student_t_cdf(std::fabs(result.value) / error, df));
+	return result;
+}
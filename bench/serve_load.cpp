@@ -0,0 +1,215 @@
+#include "cnn/cnn.hpp"
+#include "cnn/serve.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// load generator for the inference server, over its unix socket front end.
+// every client keeps DEPTH requests in flight for a while, and the
+// throughput and latency the clients saw are printed next to the batch sizes
+// the server ended up running, with and without waiting to fill batches.
+// then the same again while new params are loaded into the server over and
+// over, which shouldn't make any difference to the latency.
+
+constexpr unsigned MAX_BATCH = 64;
+constexpr unsigned DEPTH = 4;
+constexpr unsigned NUM_CLASSES = 10;
+constexpr unsigned IMAGE_SIZE = 28;
+
+using InputShape = shape_t<IMAGE_SIZE, IMAGE_SIZE>;
+
+using MyNetwork = nn::network_t<
+	InputShape,
+	nn::layers::fully_connected<300>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<100>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<NUM_CLASSES>::type,
+	nn::layers::softmax>;
+
+using Server = nn::inference_server<MyNetwork, MAX_BATCH>;
+using Client = nn::inference_client<MyNetwork>;
+
+struct result
+{
+	double requests_per_second;
+	double p50, p99;
+	nn::server_stats server;
+};
+
+// clients each keeping DEPTH requests going against server for seconds
+result measure(Server &server, const std::string &path, const unsigned clients, const double seconds)
+{
+	nn::socket_front_end<Server> front_end(server, path);
+
+	nn::latency_histogram latency;
+	std::atomic<std::uint64_t> completed{ 0 };
+	std::atomic<bool> done{ false };
+
+	std::vector<std::thread> threads;
+	for (unsigned c = 0; c < clients; c++)
+	{
+		threads.emplace_back([&, c]
+		{
+			using clock = std::chrono::steady_clock;
+
+			Client client(path);
+
+			std::minstd_rand generator(c + 1);
+			std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+
+			auto input = std::make_unique<Client::input_type>();
+			for (auto &row : *input)
+				for (float &v : row)
+					v = pixel(generator);
+
+			Client::output_type output;
+			clock::time_point sent[DEPTH];
+
+			for (std::uint32_t tag = 0; tag < DEPTH; tag++)
+			{
+				sent[tag] = clock::now();
+				client.send(tag, *input);
+			}
+
+			std::uint32_t tag;
+			while (client.receive(tag, output))
+			{
+				latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - sent[tag]).count()));
+				completed++;
+
+				if (done)
+					break;
+
+				sent[tag] = clock::now();
+				client.send(tag, *input);
+			}
+
+			// the rest are still coming, wait for them so the server isn't
+			// writing to a closed socket
+			for (unsigned outstanding = DEPTH - 1; outstanding > 0 && client.receive(tag, output); outstanding--)
+				;
+		});
+	}
+
+	// let everyone connect and get going before measuring
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	latency.reset();
+	completed = 0;
+	server.reset_stats();
+
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	result r;
+	r.requests_per_second = completed / elapsed;
+	r.p50 = latency.percentile(0.50) / 1000.0;
+	r.p99 = latency.percentile(0.99) / 1000.0;
+	r.server = server.stats();
+
+	done = true;
+	for (auto &t : threads)
+		t.join();
+
+	return r;
+}
+
+void print(const unsigned max_wait, const unsigned clients, const result &r)
+{
+	printf("%6u us   %7u   %12.0f   %7.0f us   %7.0f us   %10.1f   %7.0f us   %7.0f us\n",
+		max_wait, clients, r.requests_per_second, r.p50, r.p99,
+		r.server.mean_batch_size, r.server.p50_latency, r.server.p99_latency);
+}
+
+struct program
+{
+	nn::params_t<MyNetwork> params, other_params;
+
+	int run(int argc, const char *argv[]);
+};
+
+int program::run(const int argc, const char *argv[])
+{
+	const double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+	const std::string path = "/tmp/nn-serve-load-" + std::to_string(getpid());
+
+	nn::randomise_params<MyNetwork>(params);
+
+	Server::options options;
+	options.workers = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+	printf("max wait   clients   requests/sec   client p50   client p99   batch size   server p50   server p99\n");
+
+	for (const unsigned max_wait : { 0u, 200u, 1000u })
+	{
+		for (const unsigned clients : { 1u, 4u, 16u, 64u })
+		{
+			options.max_wait = std::chrono::microseconds(max_wait);
+
+			Server server(params, options);
+			print(max_wait, clients, measure(server, path + ".sock", clients, seconds));
+		}
+	}
+
+	// two sets of params saved, to be mapped in turn
+	nn::randomise_params<MyNetwork>(other_params, 2);
+
+	const std::string files[] = { path + "-a.dat", path + "-b.dat" };
+	nn::util::save(files[0].c_str(), params);
+	nn::util::save(files[1].c_str(), other_params);
+
+	printf("\nhot swapping params, 16 clients, 200 us max wait\n");
+
+	options.max_wait = std::chrono::microseconds(200);
+
+	for (const unsigned interval : { 0u, 100u, 10u })
+	{
+		nn::versioned_params<MyNetwork> versions(params);
+		Server server(versions, options);
+
+		std::atomic<bool> done{ false };
+		unsigned swaps = 0;
+
+		std::thread loader([&]
+		{
+			while (interval != 0 && !done)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+				if (versions.load(files[swaps % 2].c_str()))
+					swaps++;
+			}
+		});
+
+		const result r = measure(server, path + ".sock", 16, seconds);
+
+		done = true;
+		loader.join();
+
+		if (interval == 0)
+			printf("  no swaps:              ");
+		else
+			printf("  every %3u ms, %4u swaps", interval, swaps);
+
+		printf("   %8.0f requests/sec   p50 %5.0f us   p99 %5.0f us   %zu versions not yet freed\n",
+			r.requests_per_second, r.p50, r.p99, versions.reclaim());
+	}
+
+	for (const std::string &file : files)
+		remove(file.c_str());
+
+	return 0;
+}
+
+int main(const int argc, const char *argv[])
+{
+	auto p = std::make_unique<program>();
+	return p->run(argc, argv);
+}
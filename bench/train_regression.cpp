@@ -0,0 +1,401 @@
+#include "cnn/cnn.hpp"
+#include "cnn/arena.hpp"
+#include "cnn/metrics.hpp"
+#include "cnn/tuning.hpp"
+#include "results.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// the end to end training benchmark that performance changes are measured
+// with. it trains an mnist sized network on mnist shaped data made up on the
+// spot (so it needs nothing from mnist/data) the same way every time, a few
+// times over, and adds what it measured to the results store (see
+// results.hpp) under the commit it's given:
+//
+//     ./build/train_regression --commit $(git rev-parse --short HEAD)
+//     ./build/compare_results
+//
+// samples_per_second               training steps only, evaluation isn't counted
+// time_to_accuracy                 seconds of training to TARGET_ACCURACY on the test set
+// steps_to_accuracy                the same in steps, which doesn't change unless the numbers do
+// reached_accuracy                 1 if it got to TARGET_ACCURACY, 0 if not, in which case
+//                                  the two above are STEPS + 1 and all the training time
+// peak_rss_kb                      the process's peak resident memory, once per run
+// layer<i>_forward_us, _backward_us  per batch, the median of separately timed steps
+//
+// --repeats n (default REPEATS) for more samples, --results path for another
+// store than $NN_BENCH_RESULTS or bench_results.txt, --no-save to only print.
+
+constexpr unsigned NUM_TRAINING_SAMPLES = 12'000;
+constexpr unsigned NUM_TEST_SAMPLES = 2'000;
+constexpr unsigned BATCH_SIZE = 100;
+constexpr unsigned TEST_CHUNK_SIZE = 250;
+constexpr unsigned NUM_CLASSES = 10;
+constexpr unsigned IMAGE_SIZE = 28;
+constexpr unsigned STEPS = 400;
+constexpr unsigned EVAL_EVERY = 20;
+constexpr unsigned PROFILE_STEPS = 50;
+constexpr unsigned REPEATS = 5;
+constexpr float TARGET_ACCURACY = 0.9f;
+constexpr float LEARNING_RATE = 0.05f;
+constexpr float MOMENTUM = 0.9f;
+
+using InputShape = shape_t<IMAGE_SIZE, IMAGE_SIZE>;
+using OutputShape = shape_t<NUM_CLASSES>;
+
+using MyNetwork = nn::network_t<
+	InputShape,
+	nn::layers::fully_connected<300>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<100>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<NUM_CLASSES>::type,
+	nn::layers::softmax>;
+
+using Cost = nn::cost_functions::softmax_cross_entropy;
+
+constexpr unsigned LAYER_COUNT = nn::layer_count_v<MyNetwork>;
+
+// -----------------------------------------------------------------------------
+
+// the most memory the process has had resident, in kilobytes
+static double peak_rss_kb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0.0;
+	return counters.PeakWorkingSetSize / 1024.0;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+#if defined(__APPLE__)
+	// bytes rather than kilobytes
+	return usage.ru_maxrss / 1024.0;
+#else
+	return static_cast<double>(usage.ru_maxrss);
+#endif
+#endif
+}
+
+// microseconds per batch in each layer, every profiled step
+struct layer_times
+{
+	double forward[LAYER_COUNT][PROFILE_STEPS];
+	double backward[LAYER_COUNT][PROFILE_STEPS] = {};
+};
+
+// the middle step's time, so that a step that got interrupted doesn't count
+static double median(const double (&times)[PROFILE_STEPS])
+{
+	double sorted[PROFILE_STEPS];
+	std::copy(std::begin(times), std::end(times), sorted);
+	std::nth_element(sorted, sorted + PROFILE_STEPS / 2, sorted + PROFILE_STEPS);
+	return sorted[PROFILE_STEPS / 2];
+}
+
+// these objects are not containers with pointers to the heap, they ARE the data, and they're big.
+// wrapping it in a structure to keep it off the stack and to keep it out of global.
+struct program
+{
+	vector_of<NUM_TRAINING_SAMPLES, InputShape> training_images;
+	vector_of<NUM_TRAINING_SAMPLES, OutputShape> training_expectation;
+
+	vector_of<NUM_TEST_SAMPLES, InputShape> test_images;
+	vector_of<NUM_TEST_SAMPLES, OutputShape> test_expectation;
+
+	nn::params_t<MyNetwork> params, velocity;
+
+	nn::arena scratch{ nn::step_arena_size_v<BATCH_SIZE, MyNetwork> };
+
+	void make_data();
+
+	template <unsigned... Is>
+	void time_forward(nn::workspace_t<BATCH_SIZE, MyNetwork> &work, layer_times &times, unsigned step, std::integer_sequence<unsigned, Is...>);
+
+	std::unique_ptr<layer_times> profile();
+
+	void repeat(run_record &run);
+
+	int run(int argc, const char *argv[]);
+};
+
+// ten made up digits: a few soft blobs each, drawn somewhere near the middle
+// with a bit of a wobble and some noise on top. different enough for a small
+// network to learn in a few epochs, and not so easy that it's learnt in one
+// step, so that time_to_accuracy means something.
+void program::make_data()
+{
+	nn::philox random(1);
+
+	constexpr unsigned BLOBS = 4;
+	float centres[NUM_CLASSES][BLOBS][2];
+
+	for (auto &digit : centres)
+		for (auto &blob : digit)
+			for (float &c : blob)
+				c = 7.0f + random.below(15);
+
+	const auto draw = [&](const unsigned label, matrix<IMAGE_SIZE, IMAGE_SIZE> &image)
+	{
+		const float di = static_cast<float>(random.below(7)) - 3.0f;
+		const float dj = static_cast<float>(random.below(7)) - 3.0f;
+
+		random.fill_uniform(image, 0.0f, 0.4f);
+
+		for (const auto &blob : centres[label])
+			for (unsigned i = 0; i < IMAGE_SIZE; i++)
+				for (unsigned j = 0; j < IMAGE_SIZE; j++)
+				{
+					const float y = i - blob[0] - di, x = j - blob[1] - dj;
+					image[i][j] += std::exp(-(x * x + y * y) / 8.0f);
+				}
+
+		for (auto &row : image)
+			for (float &v : row)
+				v = std::min(v, 1.0f);
+	};
+
+	for (unsigned n = 0; n < NUM_TRAINING_SAMPLES; n++)
+	{
+		const unsigned label = random.below(NUM_CLASSES);
+		draw(label, training_images[n]);
+		nn::util::expectation_from_label(label, training_expectation[n]);
+	}
+
+	for (unsigned n = 0; n < NUM_TEST_SAMPLES; n++)
+	{
+		const unsigned label = random.below(NUM_CLASSES);
+		draw(label, test_images[n]);
+		nn::util::expectation_from_label(label, test_expectation[n]);
+	}
+}
+
+template <unsigned... Is>
+void program::time_forward(nn::workspace_t<BATCH_SIZE, MyNetwork> &work, layer_times &times, const unsigned step, std::integer_sequence<unsigned, Is...>)
+{
+	using clock = std::chrono::steady_clock;
+
+	([&]
+	{
+		const auto start = clock::now();
+		nn::forward_layers<Is, Is + 1>(work, params);
+		times.forward[Is][step] = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+	}(), ...);
+}
+
+// each layer's time forward and backward, over PROFILE_STEPS steps that
+// don't change the params. the softmax's backward is the cost's derivative,
+// they're done together.
+std::unique_ptr<layer_times> program::profile()
+{
+	using clock = std::chrono::steady_clock;
+
+	nn::arena::scope step(scratch);
+
+	auto &work = nn::make_workspace<BATCH_SIZE, MyNetwork>(scratch);
+	auto &expectation = scratch.make<nn::expectation_t<BATCH_SIZE, Cost, MyNetwork>>();
+	auto &gradient = scratch.make<nn::params_t<MyNetwork>>();
+
+	auto times = std::make_unique<layer_times>();
+
+	for (unsigned s = 0; s < PROFILE_STEPS; s++)
+	{
+		for (unsigned n = 0; n < BATCH_SIZE; n++)
+		{
+			const unsigned index = (s * BATCH_SIZE + n) % NUM_TRAINING_SAMPLES;
+			work.input()[n] = training_images[index];
+			expectation[n] = training_expectation[index];
+		}
+
+		time_forward(work, *times, s, std::make_integer_sequence<unsigned, LAYER_COUNT>());
+
+		// each layer's gradient is ready as soon as its backward is done, so
+		// the time between one and the next is what the next one took
+		auto last = clock::now();
+		nn::cost_and_backward<Cost>(expectation, work, params, gradient, [&](const nn::layer_gradient &ready)
+		{
+			const auto now = clock::now();
+			times->backward[ready.layer][s] += std::chrono::duration<double, std::micro>(now - last).count();
+			last = now;
+		});
+	}
+
+	return times;
+}
+
+// one go at training from scratch, with everything it measures added to run
+void program::repeat(run_record &run)
+{
+	using clock = std::chrono::steady_clock;
+
+	nn::randomise_params<MyNetwork>(params);
+	velocity = 0.0f;
+
+	const auto test_chunk = [&](const unsigned first, const unsigned count, auto &input, auto &expectation)
+	{
+		for (unsigned n = 0; n < count; n++)
+		{
+			input[n] = test_images[first + n];
+			expectation[n] = test_expectation[first + n];
+		}
+	};
+
+	double seconds = 0.0;
+	unsigned steps_to_accuracy = 0;
+	double time_to_accuracy = 0.0;
+
+	for (unsigned step = 0; step < STEPS; step++)
+	{
+		const auto fill_batch = [&](auto &input, auto &expectation)
+		{
+			for (unsigned n = 0; n < BATCH_SIZE; n++)
+			{
+				const unsigned index = (step * BATCH_SIZE + n) % NUM_TRAINING_SAMPLES;
+				input[n] = training_images[index];
+				expectation[n] = training_expectation[index];
+			}
+		};
+
+		const auto update = [&](auto &gradient)
+		{
+			for (unsigned i = 0; i < nn::param_count_v<MyNetwork>; i++)
+			{
+				velocity[i] = MOMENTUM * velocity[i] + LEARNING_RATE * gradient[i];
+				params[i] -= velocity[i];
+			}
+		};
+
+		const auto start = clock::now();
+		nn::train_step<Cost, BATCH_SIZE, MyNetwork>(scratch, params, fill_batch, update);
+		seconds += std::chrono::duration<double>(clock::now() - start).count();
+
+		if (steps_to_accuracy == 0 && (step + 1) % EVAL_EVERY == 0)
+		{
+			const auto result = nn::evaluate<TEST_CHUNK_SIZE, MyNetwork>(params, NUM_TEST_SAMPLES, test_chunk);
+			if (result.accuracy() >= TARGET_ACCURACY)
+			{
+				steps_to_accuracy = step + 1;
+				time_to_accuracy = seconds;
+			}
+		}
+	}
+
+	const double samples_per_second = static_cast<double>(STEPS) * BATCH_SIZE / seconds;
+
+	run.values["samples_per_second"].push_back(samples_per_second);
+
+	// a run that never got there still counts, as one step past the end and
+	// all of its training time, so that missing the target shows up as worse
+	// rather than the run dropping out of the means
+	const bool reached = steps_to_accuracy != 0;
+
+	run.values["reached_accuracy"].push_back(reached ? 1.0 : 0.0);
+	run.values["steps_to_accuracy"].push_back(reached ? steps_to_accuracy : STEPS + 1);
+	run.values["time_to_accuracy"].push_back(reached ? time_to_accuracy : seconds);
+
+	const auto times = profile();
+
+	for (unsigned l = 0; l < LAYER_COUNT; l++)
+	{
+		const std::string name = "layer" + std::to_string(l);
+		run.values[name + "_forward_us"].push_back(median(times->forward[l]));
+		run.values[name + "_backward_us"].push_back(median(times->backward[l]));
+	}
+
+	if (reached)
+		printf("%11.0f   %5u   %6.2fs\n", samples_per_second, steps_to_accuracy, time_to_accuracy);
+	else
+		printf("%11.0f   didn't get to %.0f%% in %u steps\n", samples_per_second, 100.0f * TARGET_ACCURACY, STEPS);
+}
+
+int program::run(const int argc, const char *argv[])
+{
+	run_record run;
+	run.commit = "unknown";
+	run.time = static_cast<long long>(std::time(nullptr));
+	run.host = nn::tuning::host();
+	run.network = nn::signature<MyNetwork>();
+
+	std::string path = default_results_path();
+	unsigned repeats = REPEATS;
+	bool save = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--commit") == 0 && i + 1 < argc)
+			run.commit = argv[++i];
+		else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if (strcmp(argv[i], "--repeats") == 0 && i + 1 < argc)
+			repeats = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--no-save") == 0)
+			save = false;
+		else
+		{
+			printf("usage: %s [--commit id] [--repeats n] [--results path] [--no-save]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	nn::tuning::load();
+
+	make_data();
+
+	printf("%s, %u repeats\n", run.network.c_str(), repeats);
+	printf("samples/sec   steps   time to %.0f%%\n", 100.0f * TARGET_ACCURACY);
+
+	for (unsigned r = 0; r < repeats; r++)
+		repeat(run);
+
+	run.values["peak_rss_kb"].push_back(peak_rss_kb());
+
+	for (unsigned l = 0; l < LAYER_COUNT; l++)
+	{
+		const std::string name = "layer" + std::to_string(l);
+		printf("layer %u: %8.1f us forward, %8.1f us backward\n", l,
+		       summarise(run.values[name + "_forward_us"]).mean,
+		       summarise(run.values[name + "_backward_us"]).mean);
+	}
+
+	printf("peak rss: %.0f kb\n", run.values["peak_rss_kb"].back());
+
+	if (!save)
+		return 0;
+
+	if (!append_run(path, run))
+	{
+		printf("couldn't write %s\n", path.c_str());
+		return 1;
+	}
+
+	printf("added to %s as %s\n", path.c_str(), run.commit.c_str());
+	return 0;
+}
+
+int main(const int argc, const char *argv[])
+{
+	auto p = std::make_unique<program>();
+	return p->run(argc, argv);
+}
@@ -0,0 +1,195 @@
+#include "cnn/cnn.hpp"
+#include "cnn/distributed.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// distributed training on made up data, linux only.
+//
+//     distributed --local 4
+//         forks 4 ranks on this machine, talking over unix sockets
+//
+//     distributed RANK tcp:host0:port0 tcp:host1:port1 ...
+//         runs as rank RANK of however many endpoints there are, start one of
+//         these on each machine with the same list
+//
+// every rank should print the same checksum at the end, since they all apply
+// the same averaged gradient to the same starting params.
+
+constexpr unsigned NUM_SAMPLES = 8'192;
+constexpr unsigned BATCH_SIZE = 64; // per rank
+constexpr unsigned NUM_CLASSES = 10;
+constexpr unsigned IMAGE_SIZE = 28;
+constexpr unsigned EPOCHS = 5;
+
+using InputShape = shape_t<IMAGE_SIZE, IMAGE_SIZE>;
+using OutputShape = shape_t<NUM_CLASSES>;
+
+using MyNetwork = nn::network_t<
+	InputShape,
+	nn::layers::fully_connected<100>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<30>::type,
+	nn::layers::relu,
+	nn::layers::fully_connected<NUM_CLASSES>::type,
+	nn::layers::softmax>;
+
+using Trainer = nn::distributed_trainer<nn::cost_functions::softmax_cross_entropy, BATCH_SIZE, MyNetwork>;
+
+struct program
+{
+	vector_of<NUM_SAMPLES, InputShape> images;
+	vector_of<NUM_SAMPLES, OutputShape> expectation;
+
+	nn::params_t<MyNetwork> params, velocity;
+
+	int run(nn::transport &link);
+};
+
+int program::run(nn::transport &link)
+{
+	// every rank makes the same data set: one random template per class,
+	// with noise on top
+	std::minstd_rand generator(1234);
+	std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+
+	static float templates[NUM_CLASSES][IMAGE_SIZE * IMAGE_SIZE];
+	for (auto &t : templates)
+		for (float &v : t)
+			v = pixel(generator);
+
+	for (unsigned n = 0; n < NUM_SAMPLES; n++)
+	{
+		const unsigned label = generator() % NUM_CLASSES;
+
+		float *image = &images[n][0][0];
+		for (unsigned i = 0; i < IMAGE_SIZE * IMAGE_SIZE; i++)
+			image[i] = 0.5f * templates[label][i] + 0.5f * pixel(generator);
+
+		nn::util::expectation_from_label(label, expectation[n]);
+	}
+
+	Trainer trainer(link);
+
+	// only rank 0's random params matter, everyone else gets them from it
+	nn::randomise_params<MyNetwork>(params);
+	trainer.broadcast(params);
+	velocity = 0.0f;
+
+	// the global batch grows with the number of ranks, and the learning rate
+	// with it so that an epoch gets about as far in fewer steps
+	const float decay = 0.9f;
+	const float learning_rate = 0.01f * trainer.size();
+
+	const unsigned global_batch = BATCH_SIZE * trainer.size();
+	const unsigned iterations = NUM_SAMPLES / global_batch;
+
+	for (unsigned epoch = 0; epoch < EPOCHS; epoch++)
+	{
+		float cost = 0.0f;
+
+		for (unsigned iteration = 0; iteration < iterations; iteration++)
+		{
+			// this rank's shard of the global batch
+			const unsigned first = iteration * global_batch + trainer.rank() * BATCH_SIZE;
+
+			const auto fill_batch = [&](auto &batch_images, auto &batch_expectation)
+			{
+				for (unsigned n = 0; n < BATCH_SIZE; n++)
+				{
+					batch_images[n] = images[first + n];
+					batch_expectation[n] = expectation[first + n];
+				}
+			};
+
+			const auto update = [&](auto &gradient)
+			{
+				velocity *= decay;
+				gradient *= learning_rate;
+				velocity -= gradient;
+
+				params += velocity;
+			};
+
+			cost += trainer.step(params, fill_batch, update);
+		}
+
+		if (trainer.rank() == 0)
+			printf("epoch #%u, %u ranks, average cost %.4f\n", epoch, trainer.size(), cost / iterations);
+	}
+
+	double checksum = 0.0;
+	for (unsigned i = 0; i < nn::param_count_v<MyNetwork>; i++)
+		checksum += params[i] * static_cast<double>(i % 97 + 1);
+
+	printf("rank %u params checksum %.9g\n", trainer.rank(), checksum);
+
+	return 0;
+}
+
+static int run_rank(const unsigned rank, const std::vector<std::string> &endpoints)
+{
+	try
+	{
+		nn::socket_transport link(rank, endpoints);
+
+		auto p = std::make_unique<program>();
+		return p->run(link);
+	}
+	catch (const std::exception &e)
+	{
+		fprintf(stderr, "rank %u: %s\n", rank, e.what());
+		return 1;
+	}
+}
+
+int main(const int argc, const char *argv[])
+{
+	if (argc == 3 && std::string(argv[1]) == "--local")
+	{
+		const int ranks = atoi(argv[2]);
+		if (ranks < 1)
+		{
+			puts("need at least one rank");
+			return 1;
+		}
+
+		std::vector<std::string> endpoints;
+		for (int r = 0; r < ranks; r++)
+			endpoints.push_back("unix:/tmp/nn-distributed-" + std::to_string(getpid()) + "-" + std::to_string(r) + ".sock");
+
+		for (int r = 0; r < ranks; r++)
+		{
+			if (fork() == 0)
+				return run_rank(r, endpoints);
+		}
+
+		int result = 0;
+		for (int r = 0; r < ranks; r++)
+		{
+			int status = 0;
+			wait(&status);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				result = 1;
+		}
+
+		return result;
+	}
+
+	if (argc >= 3)
+	{
+		const unsigned rank = static_cast<unsigned>(atoi(argv[1]));
+		return run_rank(rank, std::vector<std::string>(argv + 2, argv + argc));
+	}
+
+	puts("usage: distributed --local RANKS");
+	puts("       distributed RANK ENDPOINT...   (endpoints are tcp:host:port or unix:/path)");
+	return 1;
+}
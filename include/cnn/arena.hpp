@@ -0,0 +1,379 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "plan.hpp"
+
+// an arena is one up-front block of memory that training scratch space gets
+// bump-allocated out of. allocating is just moving a pointer, and giving it
+// all back is resetting it, so a training step that takes its workspace,
+// minibatch and gradient buffers out of an arena never touches the heap.
+//
+// on linux the pages land on whichever numa node first writes to them, and an
+// arena writes to all of its pages when it's created, so an arena created on
+// a worker thread is local to that thread (or pass a node to pin it there).
+// huge pages cut down on tlb misses for big workspaces, and are used if the
+// system has any to give, falling back to normal pages if not.
+
+namespace nn
+{
+
+class arena
+{
+public:
+	static constexpr std::size_t default_alignment = 64;
+	static constexpr int any_node = -1;
+
+	explicit arena(const std::size_t capacity, const bool huge_pages = false, const int numa_node = any_node)
+	{
+		reserve(capacity, huge_pages, numa_node);
+	}
+
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+
+	arena(arena &&other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	arena &operator=(arena &&other) noexcept
+	{
+		std::swap(base, other.base);
+		std::swap(capacity_, other.capacity_);
+		std::swap(used_, other.used_);
+		std::swap(high_water_, other.high_water_);
+		std::swap(mapped_size, other.mapped_size);
+		std::swap(source, other.source);
+		return *this;
+	}
+
+	~arena()
+	{
+		release();
+	}
+
+	// throws std::bad_alloc if it doesn't fit, which means the arena was
+	// sized wrong rather than that the system's out of memory
+	void *allocate(const std::size_t size, const std::size_t alignment = default_alignment)
+	{
+		const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(base) + used_;
+		const std::size_t padding = (alignment - start % alignment) % alignment;
+
+		if (used_ + padding + size > capacity_)
+			throw std::bad_alloc();
+
+		void *p = base + used_ + padding;
+		used_ += padding + size;
+
+		if (used_ > high_water_)
+			high_water_ = used_;
+
+		return p;
+	}
+
+	// the things that go in an arena (tensors, workspaces) are all plain old
+	// data, so this hands back memory and calls no constructor. whatever's in
+	// there is left over from the last step.
+	template <typename T>
+	T &make()
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "nothing in an arena gets destroyed");
+		return *static_cast<T *>(allocate(sizeof(T), alignof(T) > default_alignment ? alignof(T) : default_alignment));
+	}
+
+	std::size_t mark() const { return used_; }
+	void rewind(const std::size_t to) { used_ = to; }
+	void reset() { used_ = 0; }
+
+	std::size_t used() const { return used_; }
+	std::size_t capacity() const { return capacity_; }
+
+	// the most that's ever been used, for sizing the arena next time
+	std::size_t high_water() const { return high_water_; }
+
+	bool is_huge_page_backed() const { return source == memory_source::huge_pages; }
+
+	// gives back everything allocated in its lifetime, so a step can do
+	//     nn::arena::scope step(scratch);
+	// and not care what it allocated
+	class scope
+	{
+	public:
+		explicit scope(arena &a) : owner(a), start(a.mark()) {}
+		~scope() { owner.rewind(start); }
+
+		scope(const scope &) = delete;
+		scope &operator=(const scope &) = delete;
+
+	private:
+		arena &owner;
+		std::size_t start;
+	};
+
+private:
+	enum class memory_source { none, huge_pages, pages, heap };
+
+	void reserve(const std::size_t capacity, const bool huge_pages, const int numa_node)
+	{
+		capacity_ = capacity;
+
+#if defined(__linux__)
+		const std::size_t huge_page_size = 2 << 20;
+
+		if (huge_pages)
+		{
+			mapped_size = (capacity + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+			void *p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				base = static_cast<unsigned char *>(p);
+				source = memory_source::huge_pages;
+			}
+		}
+
+		if (!base)
+		{
+			mapped_size = capacity;
+
+			void *p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+
+			base = static_cast<unsigned char *>(p);
+			source = memory_source::pages;
+
+			// no hugetlbfs pages reserved, transparent huge pages might do
+			if (huge_pages)
+				madvise(p, mapped_size, MADV_HUGEPAGE);
+		}
+
+		if (numa_node != any_node)
+		{
+			// mbind(MPOL_PREFERRED) without dragging in libnuma
+			const unsigned long mask = 1ul << numa_node;
+			syscall(SYS_mbind, base, mapped_size, 1, &mask, sizeof(mask) * 8, 0);
+		}
+#elif defined(_WIN32)
+		(void)numa_node;
+
+		if (huge_pages)
+		{
+			const std::size_t large_page_size = GetLargePageMinimum();
+			if (large_page_size != 0)
+			{
+				mapped_size = (capacity + large_page_size - 1) / large_page_size * large_page_size;
+				base = static_cast<unsigned char *>(VirtualAlloc(nullptr, mapped_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+				if (base)
+					source = memory_source::huge_pages;
+			}
+		}
+
+		if (!base)
+		{
+			mapped_size = capacity;
+			base = static_cast<unsigned char *>(VirtualAlloc(nullptr, mapped_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+			if (!base)
+				throw std::bad_alloc();
+			source = memory_source::pages;
+		}
+#else
+		(void)huge_pages;
+		(void)numa_node;
+
+		mapped_size = capacity;
+		base = static_cast<unsigned char *>(::operator new(capacity, std::align_val_t(default_alignment)));
+		source = memory_source::heap;
+#endif
+
+		// first touch, from whichever thread is making the arena
+		for (std::size_t i = 0; i < mapped_size; i += 4096)
+			base[i] = 0;
+	}
+
+	void release()
+	{
+		if (!base)
+			return;
+
+#if defined(__linux__)
+		munmap(base, mapped_size);
+#elif defined(_WIN32)
+		VirtualFree(base, 0, MEM_RELEASE);
+#else
+		::operator delete(base, std::align_val_t(default_alignment));
+#endif
+
+		base = nullptr;
+	}
+
+	unsigned char *base = nullptr;
+	std::size_t capacity_ = 0;
+	std::size_t used_ = 0;
+	std::size_t high_water_ = 0;
+	std::size_t mapped_size = 0;
+	memory_source source = memory_source::none;
+};
+
+// -----------------------------------------------------------------------------
+
+// what a training step of N samples needs out of an arena: the workspace, the
+// minibatch's expectation, and the gradient. the cost function only matters
+// if it has an expectation of its own
+template <unsigned N, typename NetworkType, typename CostFunctionType = void>
+constexpr std::size_t step_arena_size_v =
+	sizeof(workspace_t<N, NetworkType>) +
+	sizeof(expectation_t<N, CostFunctionType, NetworkType>) +
+	sizeof(params_t<NetworkType>) +
+	3 * arena::default_alignment;
+
+// the same for a sparse training step (see train_step), whose gradient only
+// has room for the rows a batch can use, so that an arena for a network with
+// a big embedding isn't as big as the table
+template <unsigned N, typename NetworkType, typename CostFunctionType = void>
+constexpr std::size_t sparse_step_arena_size_v =
+	sizeof(workspace_t<N, NetworkType>) +
+	sizeof(expectation_t<N, CostFunctionType, NetworkType>) +
+	sizeof(sparse_gradient_t<N, NetworkType>) +
+	3 * arena::default_alignment;
+
+template <unsigned N, typename NetworkType, bool Training = true>
+auto make_workspace(arena &scratch) -> workspace_t<N, NetworkType, Training> &
+{
+	return scratch.make<workspace_t<N, NetworkType, Training>>();
+}
+
+// -----------------------------------------------------------------------------
+
+// a whole training step, with everything it needs beyond params coming out of
+// scratch and going back to it before returning. fill_batch gets the batch's
+// input and expectation to fill in, and the gradient is handed to update,
+// e.g. to apply momentum to params. random is for the stochastic layers.
+//
+// an update that takes (gradient, const sparse_rows<NetworkType> &) gets a
+// sparse_gradient_t instead (see sparse_backward), with the rows saying where
+// its params are, so that a network with an embedding neither goes over nor
+// needs memory for the whole table every step. scratch then only needs to be
+// sparse_step_arena_size_v. see sparse_momentum_update.
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename FillBatch, typename Update>
+float train_step(arena &scratch,
+                 const params_t<NetworkType> &params,
+                 philox &random,
+                 FillBatch &&fill_batch,
+                 Update &&update)
+{
+	arena::scope step(scratch);
+
+	auto &work = make_workspace<N, NetworkType>(scratch);
+	auto &expectation = scratch.make<expectation_t<N, CostFunctionType, NetworkType>>();
+
+	fill_batch(work.input(), expectation);
+
+	forward(work, params, random);
+
+	if constexpr(std::is_invocable_v<Update &, sparse_gradient_t<N, NetworkType> &, const sparse_rows<NetworkType> &>)
+	{
+		auto &gradient = scratch.make<sparse_gradient_t<N, NetworkType>>();
+
+		// kept from one step to the next so as not to allocate every time
+		thread_local sparse_rows<NetworkType> rows;
+
+		const float value = sparse_backward<CostFunctionType>(expectation, work, params, gradient, rows);
+
+		update(gradient, std::as_const(rows));
+
+		return value;
+	}
+	else
+	{
+		auto &gradient = scratch.make<params_t<NetworkType>>();
+
+		const float value = cost_and_backward<CostFunctionType>(expectation, work, params, gradient);
+
+		update(gradient);
+
+		return value;
+	}
+}
+
+// the same, for a network that doesn't need a generator
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename FillBatch, typename Update>
+float train_step(arena &scratch,
+                 const params_t<NetworkType> &params,
+                 FillBatch &&fill_batch,
+                 Update &&update)
+{
+	static_assert(!is_stochastic_v<NetworkType>, "the network has random layers, train_step needs a generator");
+
+	philox unused;
+	return train_step<CostFunctionType, N, NetworkType>(scratch, params, unused, fill_batch, update);
+}
+
+// a training step on a batch of N * MicroBatches, that only ever has N of it
+// in the network at once, so the scratch it needs is train_step's for N
+// (step_arena_size_v<N, NetworkType>) however big the batch. fill_batch(k,
+// input, expectation) fills in the k'th N samples, and update gets the
+// gradient averaged over the whole batch. returns the batch's mean cost.
+template <typename CostFunctionType, unsigned N, unsigned MicroBatches, typename NetworkType, typename FillBatch, typename Update>
+float train_step_accumulated(arena &scratch,
+                             const params_t<NetworkType> &params,
+                             philox &random,
+                             FillBatch &&fill_batch,
+                             Update &&update)
+{
+	static_assert(MicroBatches > 0);
+
+	arena::scope step(scratch);
+
+	auto &work = make_workspace<N, NetworkType>(scratch);
+	auto &expectation = scratch.make<expectation_t<N, CostFunctionType, NetworkType>>();
+	auto &gradient = scratch.make<params_t<NetworkType>>();
+
+	gradient = 0.0f;
+
+	float value = 0.0f;
+	for (unsigned k = 0; k < MicroBatches; k++)
+	{
+		fill_batch(k, work.input(), expectation);
+
+		forward(work, params, random);
+		value += accumulate_backward<CostFunctionType>(expectation, work, params, gradient);
+	}
+
+	gradient /= N * MicroBatches;
+
+	update(gradient);
+
+	return value / MicroBatches;
+}
+
+template <typename CostFunctionType, unsigned N, unsigned MicroBatches, typename NetworkType, typename FillBatch, typename Update>
+float train_step_accumulated(arena &scratch,
+                             const params_t<NetworkType> &params,
+                             FillBatch &&fill_batch,
+                             Update &&update)
+{
+	static_assert(!is_stochastic_v<NetworkType>, "the network has random layers, train_step_accumulated needs a generator");
+
+	philox unused;
+	return train_step_accumulated<CostFunctionType, N, MicroBatches, NetworkType>(scratch, params, unused, fill_batch, update);
+}
+
+} // nn
@@ -0,0 +1,441 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// coroutines for getting everything that isn't a training step off the
+// training thread. a task is a lazy coroutine that does nothing until it's
+// co_awaited or spawned onto an executor, which runs it on its thread pool
+// and hands back an async_result to wait on (or co_await) later:
+//
+//     nn::task<float> evaluate(nn::executor &ex, ...)
+//     {
+//         co_await ex.schedule();
+//         ...
+//         co_return accuracy;
+//     }
+//
+//     auto accuracy = ex.spawn(evaluate(ex, ...));
+//     // carry on training
+//     printf("%f\n", accuracy.get());
+//
+// a task resumes whoever's awaiting it directly when it finishes, so chains
+// of tasks don't bounce through the executor's queue between every step.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+template <typename T = void>
+class task;
+
+template <typename T>
+class _task_promise_base
+{
+public:
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	// hands straight over to whatever was awaiting this, if anything
+	auto final_suspend() noexcept
+	{
+		struct final_awaiter
+		{
+			bool await_ready() noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept
+			{
+				return continuation ? continuation : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept {}
+
+			std::coroutine_handle<> continuation;
+		};
+
+		return final_awaiter{ continuation };
+	}
+
+	void unhandled_exception() { error = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+};
+
+template <typename T>
+class _task_promise : public _task_promise_base<T>
+{
+public:
+	task<T> get_return_object();
+
+	void return_value(T v) { value.emplace(std::move(v)); }
+
+	T result()
+	{
+		if (this->error)
+			std::rethrow_exception(this->error);
+		return std::move(*value);
+	}
+
+	std::optional<T> value;
+};
+
+template <>
+class _task_promise<void> : public _task_promise_base<void>
+{
+public:
+	task<void> get_return_object();
+
+	void return_void() {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+template <typename T>
+class task
+{
+public:
+	using promise_type = _task_promise<T>;
+	using value_type = T;
+
+	task(task &&other) noexcept : coroutine(std::exchange(other.coroutine, nullptr)) {}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	task &operator=(task &&other) noexcept
+	{
+		if (coroutine)
+			coroutine.destroy();
+		coroutine = std::exchange(other.coroutine, nullptr);
+		return *this;
+	}
+
+	~task()
+	{
+		if (coroutine)
+			coroutine.destroy();
+	}
+
+	// starts the task, and the awaiting coroutine picks up once it's done.
+	// exceptions in the task come out here.
+	auto operator co_await() && noexcept
+	{
+		struct awaiter
+		{
+			bool await_ready() noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				coroutine.promise().continuation = awaiting;
+				return coroutine;
+			}
+
+			T await_resume() { return coroutine.promise().result(); }
+
+			std::coroutine_handle<promise_type> coroutine;
+		};
+
+		return awaiter{ coroutine };
+	}
+
+private:
+	friend promise_type;
+
+	explicit task(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+
+	std::coroutine_handle<promise_type> coroutine;
+};
+
+template <typename T>
+task<T> _task_promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<_task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> _task_promise<void>::get_return_object()
+{
+	return task<void>(std::coroutine_handle<_task_promise<void>>::from_promise(*this));
+}
+
+// -----------------------------------------------------------------------------
+
+class executor;
+
+// where a spawned task's result ends up
+template <typename T>
+class _result_state
+{
+public:
+	void set_value(std::optional<T> v)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		value = std::move(v);
+		finish();
+	}
+
+	void set_error(std::exception_ptr e)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		error = std::move(e);
+		finish();
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&] { return done; });
+	}
+
+	bool ready()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return done;
+	}
+
+	// false if it's already done, and the awaiting coroutine should just carry on
+	bool add_waiter(std::coroutine_handle<> waiter)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (done)
+			return false;
+		waiters.push_back(waiter);
+		return true;
+	}
+
+	std::optional<T> value;
+	std::exception_ptr error;
+
+	executor *owner = nullptr;
+
+private:
+	// mutex held
+	void finish();
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool done = false;
+	std::vector<std::coroutine_handle<>> waiters;
+};
+
+// the result of a task spawned on an executor. get() blocks for it, or
+// co_await it from another task.
+template <typename T = void>
+class async_result
+{
+public:
+	async_result() = default;
+
+	bool valid() const { return state != nullptr; }
+	bool ready() const { return state->ready(); }
+	void wait() const { state->wait(); }
+
+	// rethrows anything the task threw
+	T get() const
+	{
+		state->wait();
+		if (state->error)
+			std::rethrow_exception(state->error);
+		if constexpr(!std::is_void_v<T>)
+			return *state->value;
+	}
+
+	auto operator co_await() const noexcept
+	{
+		struct awaiter
+		{
+			bool await_ready() { return state->ready(); }
+			bool await_suspend(std::coroutine_handle<> awaiting) { return state->add_waiter(awaiting); }
+
+			T await_resume()
+			{
+				if (state->error)
+					std::rethrow_exception(state->error);
+				if constexpr(!std::is_void_v<T>)
+					return *state->value;
+			}
+
+			std::shared_ptr<_result_state<std::conditional_t<std::is_void_v<T>, bool, T>>> state;
+		};
+
+		return awaiter{ state };
+	}
+
+private:
+	friend class executor;
+
+	using state_type = _result_state<std::conditional_t<std::is_void_v<T>, bool, T>>;
+
+	explicit async_result(std::shared_ptr<state_type> state) : state(std::move(state)) {}
+
+	std::shared_ptr<state_type> state;
+};
+
+// -----------------------------------------------------------------------------
+
+// a coroutine that starts straight away and cleans up after itself, for
+// running a task to completion and stashing its result
+struct _detached
+{
+	struct promise_type
+	{
+		_detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+class executor
+{
+public:
+	// threads = 0 uses every cpu but one, leaving one for training
+	explicit executor(unsigned threads = 0)
+	{
+		if (threads == 0)
+			threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+		for (unsigned t = 0; t < threads; t++)
+			workers.emplace_back([this] { run(); });
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	// runs everything that's already been queued before returning
+	~executor()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		condition.notify_all();
+
+		for (auto &w : workers)
+			w.join();
+	}
+
+	unsigned thread_count() const { return static_cast<unsigned>(workers.size()); }
+
+	void post(std::function<void()> work)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(std::move(work));
+		}
+		condition.notify_one();
+	}
+
+	void post(const std::coroutine_handle<> coroutine)
+	{
+		post([coroutine] { coroutine.resume(); });
+	}
+
+	// co_await ex.schedule() carries on on one of ex's threads
+	auto schedule()
+	{
+		struct awaiter
+		{
+			bool await_ready() noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> coroutine) { ex.post(coroutine); }
+			void await_resume() noexcept {}
+
+			executor &ex;
+		};
+
+		return awaiter{ *this };
+	}
+
+	// starts t on one of the executor's threads
+	template <typename T>
+	async_result<T> spawn(task<T> t)
+	{
+		auto state = std::make_shared<typename async_result<T>::state_type>();
+		state->owner = this;
+
+		drive(std::move(t), state);
+
+		return async_result<T>(state);
+	}
+
+private:
+	template <typename T, typename State>
+	_detached drive(task<T> t, std::shared_ptr<State> state)
+	{
+		co_await schedule();
+
+		try
+		{
+			if constexpr(std::is_void_v<T>)
+			{
+				co_await std::move(t);
+				state->set_value(true);
+			}
+			else
+			{
+				state->set_value(co_await std::move(t));
+			}
+		}
+		catch (...)
+		{
+			state->set_error(std::current_exception());
+		}
+	}
+
+	void run()
+	{
+		for (;;)
+		{
+			std::function<void()> work;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+
+				work = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			work();
+		}
+	}
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::function<void()>> queue;
+	bool stopping = false;
+};
+
+// anyone awaiting the result carries on back on the executor, rather than on
+// whichever thread finished the task
+template <typename T>
+void _result_state<T>::finish()
+{
+	done = true;
+	condition.notify_all();
+
+	for (const auto waiter : waiters)
+		owner->post(waiter);
+	waiters.clear();
+}
+
+} // nn
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "arena.hpp"
+#include "parallel.hpp"
+#include "tuning.hpp"
+
+// fills in the tuning cache (see tuning.hpp) for one network: times every
+// block size for each of the products its training step runs, and if there's
+// more than one cpu, how many numa_trainer workers get the most samples
+// through a second. run it once per kind of machine and save what it found:
+//
+//     nn::tuning::load();
+//     nn::autotune<nn::cost_functions::softmax_cross_entropy, 64, MyNetwork>();
+//     nn::tuning::save();
+//
+// it takes a second or two for a small network. nothing it picks changes the
+// numbers that come out, only how long they take.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+struct autotune_options
+{
+	// how long to spend timing each block size, for each product
+	double seconds = 0.05;
+
+	// something has to be this much quicker than the default to be picked
+	// over it, so that noise doesn't fill the cache with coin tosses
+	double margin = 0.03;
+
+	// time thread counts for numa_trainer too
+	bool threads = true;
+
+	// training steps timed per thread count
+	unsigned steps = 10;
+
+	std::uint64_t seed = philox::default_seed;
+};
+
+struct tuned_kernel
+{
+	unsigned rows, cols;
+	unsigned block;
+
+	// nanoseconds per call with the default block and with the one picked
+	double default_time, time;
+};
+
+struct autotune_result
+{
+	std::vector<tuned_kernel> kernels;
+
+	// 0 if thread counts weren't tuned
+	unsigned threads = 0;
+	double samples_per_second = 0.0;
+};
+
+// -----------------------------------------------------------------------------
+
+// the products only register themselves once they've run, so this runs a
+// training step to get them all
+template <typename CostFunctionType, unsigned N, typename NetworkType>
+void _run_training_step(const std::uint64_t seed)
+{
+	arena scratch(step_arena_size_v<N, NetworkType, CostFunctionType> + sizeof(params_t<NetworkType>) + arena::default_alignment);
+	auto &params = scratch.make<params_t<NetworkType>>();
+	randomise_params<NetworkType>(params, seed);
+
+	philox random(seed);
+
+	const auto fill_batch = [&](auto &input, auto &expectation)
+	{
+		random.fill_uniform(input);
+		expectation.set(1.0f / NetworkType::output_shape::count);
+	};
+
+	train_step<CostFunctionType, N, NetworkType>(scratch, params, random, fill_batch, [](auto &) {});
+}
+
+// the best block for one product. the blocks are capped at the matrix's
+// width, so some of them are the same thing and are only timed the once
+inline tuned_kernel _tune_kernel(tuning::kernel &k, const autotune_options &options)
+{
+	const auto effective = [&](const unsigned block) { return std::min(block, k.cols); };
+
+	tuned_kernel tuned{ k.rows, k.cols, tuning::default_block, 0.0, 0.0 };
+	tuned.default_time = tuned.time = k.time(tuning::default_block, options.seconds);
+
+	std::vector<unsigned> timed{ effective(tuning::default_block) };
+
+	for (const unsigned block : tuning::blocks)
+	{
+		if (std::find(timed.begin(), timed.end(), effective(block)) != timed.end())
+			continue;
+		timed.push_back(effective(block));
+
+		const double time = k.time(block, options.seconds);
+		if (time < tuned.time && time < tuned.default_time * (1.0 - options.margin))
+		{
+			tuned.block = block;
+			tuned.time = time;
+		}
+	}
+
+	k.block = tuned.block;
+	return tuned;
+}
+
+// samples per second through numa_trainer with count workers
+template <typename CostFunctionType, unsigned WorkerBatch, typename NetworkType>
+double _time_trainer(const unsigned count, const numa_topology &topology, const autotune_options &options)
+{
+	using trainer_type = numa_trainer<CostFunctionType, WorkerBatch, NetworkType>;
+
+	auto params = std::make_unique<params_t<NetworkType>>();
+	auto input = std::make_unique<typename trainer_type::input_type>();
+	auto expectation = std::make_unique<typename trainer_type::expectation_type>();
+
+	randomise_params<NetworkType>(*params, options.seed);
+
+	philox random(options.seed);
+	random.fill_uniform(*input);
+	expectation->set(1.0f / NetworkType::output_shape::count);
+
+	trainer_type trainer(count, false, topology, options.seed);
+
+	// every worker gets the same shard, it's only the time that matters
+	const auto fill_shard = [&](const unsigned, auto &shard_input, auto &shard_expectation)
+	{
+		shard_input = *input;
+		shard_expectation = *expectation;
+	};
+
+	// the params are left as they are, so every step does the same work
+	const auto update = [](auto &) {};
+
+	// warm up, first touches and all that
+	trainer.step(*params, fill_shard, update);
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (unsigned s = 0; s < options.steps; s++)
+		trainer.step(*params, fill_shard, update);
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return static_cast<double>(options.steps) * WorkerBatch * trainer.worker_count() / seconds;
+}
+
+// tunes the products, then the thread count for numa_trainer with N samples
+// per worker, and puts everything it picked into the tuning cache (in
+// memory, tuning::save to keep it)
+template <typename CostFunctionType, unsigned N, typename NetworkType>
+autotune_result autotune(const autotune_options &options = autotune_options())
+{
+	autotune_result result;
+
+	_run_training_step<CostFunctionType, N, NetworkType>(options.seed);
+
+	tuning::for_each_kernel([&](tuning::kernel &k)
+	{
+		result.kernels.push_back(_tune_kernel(k, options));
+	});
+
+	const numa_topology topology = numa_topology::detect();
+	const unsigned cpu_count = topology.cpu_count();
+
+	if (!options.threads || cpu_count < 2)
+		return result;
+
+	// 1, 2, 4 and so on up to every cpu, and more only if it's worth it
+	for (unsigned count = 1; ; count = std::min(count * 2, cpu_count))
+	{
+		const double rate = _time_trainer<CostFunctionType, N, NetworkType>(count, topology, options);
+		if (rate > result.samples_per_second * (1.0 + options.margin))
+		{
+			result.threads = count;
+			result.samples_per_second = rate;
+		}
+
+		if (count == cpu_count)
+			break;
+	}
+
+	tuning::set_threads(numa_trainer<CostFunctionType, N, NetworkType>::tuning_name(), result.threads);
+
+	return result;
+}
+
+} // nn
@@ -0,0 +1,415 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "arena.hpp"
+
+// cheaper inference for classifiers, for when most samples are easy. a first
+// stage answers every sample, and the ones it's sure of (its highest
+// probability is at least threshold) keep its answer; only the rest go on to
+// the second stage. the stragglers are packed together at the front of the
+// batch before the second stage, so it runs on a short full batch rather
+// than a long one with holes in it. the stages are either
+//
+//     a cheap network and then the full one, both from the input
+//
+//         nn::cascade<64, SmallNetwork, MyNetwork> model(small_params, params, 0.95f);
+//
+//     or the full network's first layers and a small head on the end of them
+//     (ending in a softmax), and then the rest of the full network, carrying
+//     on from where the first stage left it
+//
+//         nn::early_exit<64, MyNetwork, 2, HeadNetwork> model(params, head_params, 0.95f);
+//
+// and either way:
+//
+//     fill model.input() with up to 64 samples
+//     const auto &output = model.forward(count);
+//     printf("%.0f flops a sample\n", model.stats().mean_flops());
+//
+// the threshold trades accuracy for speed, calibrate_cascade works out what
+// each threshold costs on a validation set and picks one.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// how a cascade's been doing since it was made, or since reset
+struct cascade_stats
+{
+	std::uint64_t samples = 0;
+	std::uint64_t early = 0;	// answered by the first stage
+	double flops = 0.0;
+
+	double early_fraction() const { return samples ? static_cast<double>(early) / samples : 0.0; }
+	double mean_flops() const { return samples ? flops / samples : 0.0; }
+};
+
+template <typename Shape>
+float _confidence(const tensor<Shape> &probabilities)
+{
+	return math::max(probabilities);
+}
+
+// the stages and the compacting in between, which both kinds of cascade
+// share. Stages has the workspaces and what runs in them:
+//
+//     input_type &input()
+//     const output_type &first(count)             the first stage, on input
+//     void keep(n, m)                             sample n goes to the second
+//                                                 stage as its m'th
+//     const output_type &second(count)            the second stage, on those
+//     early_flops, late_flops                     per sample
+template <unsigned N, typename OutputShape, typename Stages>
+class _cascade : protected Stages
+{
+public:
+	using output_type = vector_of<N, OutputShape>;
+
+	static constexpr unsigned batch_size = N;
+	static constexpr double early_flops = Stages::early_flops;
+	static constexpr double late_flops = Stages::late_flops;
+
+	float threshold;
+
+	template <typename... Args>
+	explicit _cascade(const float threshold, Args &&... args)
+		: Stages(std::forward<Args>(args)...), threshold(threshold), output(std::make_unique<output_type>())
+	{
+	}
+
+	using Stages::input;
+
+	// the first count samples of input() through the cascade
+	const output_type &forward(const unsigned count = N)
+	{
+		const output_type &early = Stages::first(count);
+
+		unsigned late = 0;
+		for (unsigned n = 0; n < count; n++)
+		{
+			if (_confidence(early[n]) >= threshold)
+			{
+				(*output)[n] = early[n];
+			}
+			else
+			{
+				Stages::keep(n, late);
+				late_samples[late++] = n;
+			}
+		}
+
+		if (late > 0)
+		{
+			const output_type &answers = Stages::second(late);
+			for (unsigned m = 0; m < late; m++)
+				(*output)[late_samples[m]] = answers[m];
+		}
+
+		counts.samples += count;
+		counts.early += count - late;
+		counts.flops += count * early_flops + late * late_flops;
+
+		return *output;
+	}
+
+	// both stages for every sample, whatever the threshold, for calibrating
+	void forward_both(const unsigned count, output_type &early, output_type &late)
+	{
+		early = Stages::first(count);
+
+		for (unsigned n = 0; n < count; n++)
+			Stages::keep(n, n);
+
+		late = Stages::second(count);
+	}
+
+	const cascade_stats &stats() const { return counts; }
+	void reset_stats() { counts = cascade_stats(); }
+
+private:
+	std::unique_ptr<output_type> output;
+	std::array<unsigned, N> late_samples;
+
+	cascade_stats counts;
+};
+
+// -----------------------------------------------------------------------------
+
+template <unsigned N, typename CheapNetwork, typename FullNetwork>
+class _cascade_stages
+{
+	static_assert(std::is_same_v<typename CheapNetwork::input_shape, typename FullNetwork::input_shape>, "both networks take the same input");
+	static_assert(std::is_same_v<typename CheapNetwork::output_shape, typename FullNetwork::output_shape>, "both networks classify into the same classes");
+	static_assert(FullNetwork::output_shape::dim == 1, "only classifiers can be cascaded");
+
+protected:
+	using input_type = vector_of<N, typename FullNetwork::input_shape>;
+	using output_type = output_t<N, FullNetwork>;
+
+	static constexpr double early_flops = flops_v<CheapNetwork>;
+	static constexpr double late_flops = flops_v<FullNetwork>;
+
+	_cascade_stages(const params_t<CheapNetwork> &cheap_params, const params_t<FullNetwork> &full_params)
+		: cheap_params(cheap_params), full_params(full_params),
+		  scratch(sizeof(workspace_t<N, CheapNetwork, false>) + sizeof(workspace_t<N, FullNetwork, false>) + 2 * arena::default_alignment),
+		  cheap(make_workspace<N, CheapNetwork, false>(scratch)),
+		  full(make_workspace<N, FullNetwork, false>(scratch))
+	{
+	}
+
+public:
+	input_type &input() { return cheap.input(); }
+
+protected:
+	const output_type &first(const unsigned count) { return nn::forward(cheap, cheap_params, count); }
+	void keep(const unsigned n, const unsigned m) { full.input()[m] = cheap.input()[n]; }
+	const output_type &second(const unsigned count) { return nn::forward(full, full_params, count); }
+
+private:
+	const params_t<CheapNetwork> &cheap_params;
+	const params_t<FullNetwork> &full_params;
+
+	arena scratch;
+	workspace_t<N, CheapNetwork, false> &cheap;
+	workspace_t<N, FullNetwork, false> &full;
+};
+
+template <unsigned N, typename NetworkType, unsigned ExitLayer, typename HeadNetwork>
+class _early_exit_stages
+{
+	static constexpr unsigned layer_count = layer_count_v<NetworkType>;
+
+	static_assert(ExitLayer > 0 && ExitLayer < layer_count, "the head has to go on the output of one of the layers before the last");
+	static_assert(std::is_same_v<typename HeadNetwork::input_shape, activation_shape_t<NetworkType, ExitLayer>>, "the head takes what comes out of the layer before ExitLayer");
+	static_assert(std::is_same_v<typename HeadNetwork::output_shape, typename NetworkType::output_shape>, "the head classifies into the same classes as the network");
+	static_assert(NetworkType::output_shape::dim == 1, "only classifiers can be cascaded");
+
+protected:
+	using input_type = vector_of<N, typename NetworkType::input_shape>;
+	using output_type = output_t<N, NetworkType>;
+
+	static constexpr double early_flops = flops_v<NetworkType, 0, ExitLayer> + flops_v<HeadNetwork>;
+	static constexpr double late_flops = flops_v<NetworkType, ExitLayer>;
+
+	_early_exit_stages(const params_t<NetworkType> &params, const params_t<HeadNetwork> &head_params)
+		: params(params), head_params(head_params),
+		  scratch(sizeof(workspace_t<N, NetworkType, false>) + sizeof(workspace_t<N, HeadNetwork, false>) + 2 * arena::default_alignment),
+		  work(make_workspace<N, NetworkType, false>(scratch)),
+		  head(make_workspace<N, HeadNetwork, false>(scratch))
+	{
+	}
+
+public:
+	input_type &input() { return work.input(); }
+
+protected:
+	const output_type &first(const unsigned count)
+	{
+		forward_layers<0, ExitLayer>(work, params, count);
+
+		for (unsigned n = 0; n < count; n++)
+			head.input()[n] = trunk()[n];
+
+		return nn::forward(head, head_params, count);
+	}
+
+	// packed down in place, m is never past n
+	void keep(const unsigned n, const unsigned m)
+	{
+		if (m != n)
+			trunk()[m] = trunk()[n];
+	}
+
+	const output_type &second(const unsigned count)
+	{
+		forward_layers<ExitLayer, layer_count>(work, params, count);
+		return work.get_output();
+	}
+
+private:
+	auto &trunk() { return work.template activation<ExitLayer>(); }
+
+	const params_t<NetworkType> &params;
+	const params_t<HeadNetwork> &head_params;
+
+	arena scratch;
+	workspace_t<N, NetworkType, false> &work;
+	workspace_t<N, HeadNetwork, false> &head;
+};
+
+// a cheap network, then the full one for whatever it isn't sure of. the params
+// are only referred to, so they can be trained or loaded in between batches.
+template <unsigned N, typename CheapNetwork, typename FullNetwork>
+class cascade : public _cascade<N, typename FullNetwork::output_shape, _cascade_stages<N, CheapNetwork, FullNetwork>>
+{
+public:
+	cascade(const params_t<CheapNetwork> &cheap_params, const params_t<FullNetwork> &full_params, const float threshold)
+		: cascade::_cascade(threshold, cheap_params, full_params)
+	{
+	}
+};
+
+// the network's layers up to ExitLayer and HeadNetwork on the end of them,
+// then layers ExitLayer on for whatever the head isn't sure of
+template <unsigned N, typename NetworkType, unsigned ExitLayer, typename HeadNetwork>
+class early_exit : public _cascade<N, typename NetworkType::output_shape, _early_exit_stages<N, NetworkType, ExitLayer, HeadNetwork>>
+{
+public:
+	early_exit(const params_t<NetworkType> &params, const params_t<HeadNetwork> &head_params, const float threshold)
+		: early_exit::_cascade(threshold, params, head_params)
+	{
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+// what a cascade would do at a threshold, over the calibration set
+struct cascade_point
+{
+	float threshold;
+	double early_fraction;
+	double accuracy;
+	double accuracy_loss;	// against the second stage on its own
+	double mean_flops;
+};
+
+class cascade_calibration
+{
+public:
+	struct sample
+	{
+		float confidence;
+		bool early_correct, late_correct;
+	};
+
+	cascade_calibration(std::vector<sample> samples, const double early_flops, const double late_flops)
+		: samples(std::move(samples)), early_flops(early_flops), late_flops(late_flops)
+	{
+		// most sure first, so that a threshold takes a run off the front
+		std::sort(this->samples.begin(), this->samples.end(), [](const sample &a, const sample &b) { return a.confidence > b.confidence; });
+
+		for (const sample &s : this->samples)
+		{
+			late_correct += s.late_correct;
+			early_correct += s.early_correct;
+		}
+	}
+
+	std::size_t size() const { return samples.size(); }
+
+	// the second stage's accuracy, i.e. the cascade's with nothing answered early
+	double full_accuracy() const { return fraction(late_correct); }
+
+	// the first stage's, with everything answered early
+	double cheap_accuracy() const { return fraction(early_correct); }
+
+	cascade_point at(const float threshold) const
+	{
+		std::size_t early = 0, correct = late_correct;
+		for (; early < samples.size() && samples[early].confidence >= threshold; early++)
+			correct += static_cast<std::size_t>(samples[early].early_correct) - samples[early].late_correct;
+
+		return point(threshold, early, correct);
+	}
+
+	// the lowest threshold (the most answered early) that loses no more than
+	// max_loss of accuracy against the second stage on its own
+	cascade_point threshold_for(const double max_loss) const
+	{
+		if (samples.empty())
+			return point(1.0f, 0, 0);
+
+		// nothing early to start with, just over the surest sample
+		float best = std::nextafter(samples.front().confidence, 2.0f);
+		std::size_t best_early = 0, best_correct = late_correct;
+
+		std::size_t correct = late_correct;
+		for (std::size_t early = 0; early < samples.size(); )
+		{
+			// every sample on the same confidence goes early together
+			const float confidence = samples[early].confidence;
+			for (; early < samples.size() && samples[early].confidence == confidence; early++)
+				correct += static_cast<std::size_t>(samples[early].early_correct) - samples[early].late_correct;
+
+			if (full_accuracy() - fraction(correct) <= max_loss)
+			{
+				best = confidence;
+				best_early = early;
+				best_correct = correct;
+			}
+		}
+
+		return point(best, best_early, best_correct);
+	}
+
+	// at steps thresholds evenly from 0 to 1, for a table or a plot
+	std::vector<cascade_point> curve(const unsigned steps = 20) const
+	{
+		std::vector<cascade_point> points;
+		for (unsigned i = 0; i <= steps; i++)
+			points.push_back(at(static_cast<float>(i) / steps));
+		return points;
+	}
+
+private:
+	double fraction(const std::size_t count) const
+	{
+		return samples.empty() ? 0.0 : static_cast<double>(count) / samples.size();
+	}
+
+	cascade_point point(const float threshold, const std::size_t early, const std::size_t correct) const
+	{
+		const double early_fraction = fraction(early);
+		return { threshold, early_fraction, fraction(correct), full_accuracy() - fraction(correct), early_flops + (1.0 - early_fraction) * late_flops };
+	}
+
+	std::vector<sample> samples;
+	double early_flops, late_flops;
+	std::size_t early_correct = 0, late_correct = 0;
+};
+
+// runs sample_count samples through both stages of model, a batch at a time,
+// to see what each threshold would cost. fill_chunk(first, count, input,
+// expectation) is the same as for evaluate (metrics.hpp). then e.g.
+//
+//     const auto calibration = nn::calibrate_cascade(model, NUM_VALIDATION_SAMPLES, fill_chunk);
+//     model.threshold = calibration.threshold_for(0.002).threshold;
+template <typename Model, typename FillChunk>
+cascade_calibration calibrate_cascade(Model &model, const unsigned sample_count, FillChunk &&fill_chunk)
+{
+	constexpr unsigned N = Model::batch_size;
+	using output_type = typename Model::output_type;
+
+	auto expectation = std::make_unique<output_type>();
+	auto early = std::make_unique<output_type>();
+	auto late = std::make_unique<output_type>();
+
+	std::vector<cascade_calibration::sample> samples;
+	samples.reserve(sample_count);
+
+	for (unsigned first = 0; first < sample_count; first += N)
+	{
+		const unsigned count = std::min(N, sample_count - first);
+
+		fill_chunk(first, count, model.input(), *expectation);
+		model.forward_both(count, *early, *late);
+
+		for (unsigned n = 0; n < count; n++)
+		{
+			const unsigned label = math::argmax((*expectation)[n]);
+			samples.push_back({ _confidence((*early)[n]), math::argmax((*early)[n]) == label, math::argmax((*late)[n]) == label });
+		}
+	}
+
+	return cascade_calibration(std::move(samples), Model::early_flops, Model::late_flops);
+}
+
+} // nn
@@ -2,4 +2,7 @@
 
 #include "network.hpp"
 #include "layers.hpp"
-#include "cost_functions.hpp"
\ No newline at end of file
+#include "recurrent.hpp"
+#include "cost_functions.hpp"
+#include "plan.hpp"
+#include "graph.hpp"
\ No newline at end of file
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 
+#include "tensor.hpp"
+#include "fast_math.hpp"
+#include "layers.hpp"
+
 namespace nn
 {
 
@@ -16,7 +21,41 @@ struct cross_entropy
 	{
 		float value = 0.0f;
 		for (unsigned i = 0; i < N; i++)
-			value -= expectation[i] * log(prediction[i]) + (1.0f - expectation[i]) * log(1.0f - prediction[i]);
+			value -= expectation[i] * math::log(prediction[i]) + (1.0f - expectation[i]) * math::log(1.0f - prediction[i]);
+		return value;
+	}
+
+	template <unsigned N>
+	static void derivative(const vector<N> &expectation,
+                           const vector<N> &prediction,
+                           vector<N> &delta)
+	{
+		// a saturated prediction would otherwise divide by zero
+		for (unsigned i = 0; i < N; i++)
+			delta[i] = (prediction[i] - expectation[i]) / std::max(prediction[i] * (1.0f - prediction[i]), 1e-7f);
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+// categorical cross entropy, for use after layers::softmax. on its own the
+// derivative is the usual -expectation/prediction, but it names softmax as
+// its fused_layer, so nn::backward hands it the softmax's input instead and
+// it goes straight from the logits to prediction - expectation in O(N), never
+// taking the log of a prediction that's underflowed to zero.
+struct softmax_cross_entropy
+{
+	template <typename InputShape>
+	using fused_layer = layers::softmax<InputShape>;
+
+	template <unsigned N>
+	static float cost(const vector<N> &expectation,
+                       const vector<N> &prediction)
+	{
+		float value = 0.0f;
+		for (unsigned i = 0; i < N; i++)
+			if (expectation[i] != 0.0f)
+				value -= expectation[i] * math::log(prediction[i]);
 		return value;
 	}
 
@@ -26,7 +65,111 @@ struct cross_entropy
                            vector<N> &delta)
 	{
 		for (unsigned i = 0; i < N; i++)
-			delta[i] = (prediction[i] - expectation[i]) / (prediction[i] * (1.0f - prediction[i]));
+			delta[i] = -expectation[i] / std::max(prediction[i], 1e-7f);
+	}
+
+	// cost and derivative with respect to the logits going into the softmax,
+	// with the cost done as log-sum-exp - logit so nothing under/overflows
+	template <unsigned N>
+	static float cost_and_derivative(const vector<N> &expectation,
+                                     const vector<N> &logits,
+                                     vector<N> &delta_logits)
+	{
+		const float max_logit = math::max(logits);
+
+		for (unsigned i = 0; i < N; i++)
+			delta_logits[i] = math::exp(logits[i] - max_logit);
+
+		float sum = 0.0f;
+		for (unsigned i = 0; i < N; i++)
+			sum += delta_logits[i];
+
+		const float log_sum_exp = max_logit + math::log(sum);
+
+		float value = 0.0f, expectation_sum = 0.0f;
+		for (unsigned i = 0; i < N; i++)
+		{
+			value += expectation[i] * (log_sum_exp - logits[i]);
+			expectation_sum += expectation[i];
+		}
+
+		// expectation_sum is 1 for anything that's actually a distribution
+		const float scale = expectation_sum / sum;
+		for (unsigned i = 0; i < N; i++)
+			delta_logits[i] = delta_logits[i] * scale - expectation[i];
+
+		return value;
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+// knowledge distillation, training a small student network to do what a big
+// teacher does. each sample's expectation is two rows, what the teacher makes
+// of it softened to Temperature (see distillation.hpp) and then the label,
+// and the cost is
+//
+//     HardPercent% of the cross entropy with the label, plus the rest of
+//     Temperature^2 * the cross entropy with the teacher, with the student's
+//     softmax at Temperature too
+//
+// the Temperature^2 keeps the soft part's gradient about the same size
+// whatever the temperature. the student has to end in a softmax.
+template <unsigned Temperature, unsigned HardPercent = 10>
+struct distillation
+{
+	static_assert(Temperature > 0, "a temperature of 0 is argmax");
+	static_assert(HardPercent <= 100);
+
+	static constexpr float temperature = static_cast<float>(Temperature);
+	static constexpr float hard = HardPercent / 100.0f;
+	static constexpr float soft = 1.0f - hard;
+
+	template <typename OutputShape>
+	using expectation_shape = shape_t<2, OutputShape::count>;
+
+	template <typename InputShape>
+	using fused_layer = layers::softmax<InputShape>;
+
+	// from the softmax's output, which gives the logits back up to a constant
+	// that the softmaxes don't care about
+	template <unsigned N>
+	static float cost(const matrix<2, N> &expectation,
+                       const vector<N> &prediction)
+	{
+		vector<N> logits, unused;
+		for (unsigned i = 0; i < N; i++)
+			logits[i] = math::log(std::max(prediction[i], 1e-30f));
+		return cost_and_derivative(expectation, logits, unused);
+	}
+
+	// only for a student that doesn't end in a softmax, which it has to
+	template <unsigned N>
+	static void derivative(const matrix<2, N> &, const vector<N> &, vector<N> &)
+	{
+		static_assert(N == 0, "distillation needs the student to end in a softmax");
+	}
+
+	template <unsigned N>
+	static float cost_and_derivative(const matrix<2, N> &expectation,
+                                     const vector<N> &logits,
+                                     vector<N> &delta_logits)
+	{
+		float value = hard * softmax_cross_entropy::cost_and_derivative(expectation[1], logits, delta_logits);
+		delta_logits *= hard;
+
+		vector<N> softened, delta_softened;
+		for (unsigned i = 0; i < N; i++)
+			softened[i] = logits[i] / temperature;
+
+		value += soft * temperature * temperature * softmax_cross_entropy::cost_and_derivative(expectation[0], softened, delta_softened);
+
+		// softened is logits / temperature, so one temperature of the square
+		// cancels on the way back
+		for (unsigned i = 0; i < N; i++)
+			delta_logits[i] += soft * temperature * delta_softened[i];
+
+		return value;
 	}
 };
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.hpp"
+#include "cost_functions.hpp"
+
+// training a narrow student network on a trained teacher's answers as well as
+// the labels, with cost_functions::distillation. the teacher's answers for a
+// training set that doesn't change are worked out once, up front, on every
+// cpu, so the teacher costs one inference pass over the set rather than one
+// per epoch and training the student runs as fast as training it on labels:
+//
+//     using Cost = nn::cost_functions::distillation<4>;
+//
+//     const nn::soft_targets<4, Teacher> teacher(teacher_params, NUM_TRAINING_SAMPLES,
+//         [&](unsigned first, unsigned count, auto &input) { ... });
+//
+//     const auto fill_batch = [&](auto &input, auto &expectation)
+//     {
+//         for (unsigned n = 0; n < BATCH_SIZE; n++)
+//         {
+//             input[n] = training_images[index];
+//             teacher.expectation(index, training_expectation[index], expectation[n]);
+//         }
+//     };
+//
+//     nn::train_step<Cost, BATCH_SIZE, Student>(scratch, student_params, fill_batch, update);
+//
+// for inputs that change every epoch (augmented, say), run the teacher on
+// each batch and soften its output instead.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// a softmax's probabilities as they'd have been with the logits divided by
+// Temperature, i.e. flattened out so that the teacher's second and third
+// guesses have something to say
+template <unsigned Temperature, unsigned N>
+void soften(const vector<N> &probabilities, vector<N> &softened)
+{
+	for (unsigned i = 0; i < N; i++)
+		softened[i] = math::log(std::max(probabilities[i], 1e-30f)) / Temperature;
+
+	const float max_value = math::max(softened);
+
+	float sum = 0.0f;
+	for (unsigned i = 0; i < N; i++)
+		sum += softened[i] = math::exp(softened[i] - max_value);
+
+	softened /= sum;
+}
+
+template <unsigned Chunk, typename TeacherNetwork>
+constexpr std::size_t soft_targets_arena_size_v =
+	sizeof(workspace_t<Chunk, TeacherNetwork, false>) +
+	arena::default_alignment;
+
+// the teacher's softened answer for every sample in a training set, made
+// Chunk samples at a time on however many threads (0 for every cpu).
+// fill_chunk(first, count, input) fills in the first count samples of a
+// chunk with samples first onwards, from several threads at once.
+template <unsigned Temperature, typename TeacherNetwork, unsigned Chunk = 100>
+class soft_targets
+{
+	static_assert(TeacherNetwork::output_shape::dim == 1, "the teacher has to be a classifier");
+
+public:
+	using target_type = tensor<typename TeacherNetwork::output_shape>;
+
+	static constexpr unsigned classes = TeacherNetwork::output_shape::count;
+
+	template <typename FillChunk>
+	soft_targets(const params_t<TeacherNetwork> &params,
+	             const unsigned sample_count,
+	             FillChunk &&fill_chunk,
+	             const unsigned threads = 0)
+		: targets(sample_count)
+	{
+		const unsigned chunk_count = (sample_count + Chunk - 1) / Chunk;
+
+		_for_each_chunk(chunk_count, threads, [&](const auto &next)
+		{
+			arena scratch(soft_targets_arena_size_v<Chunk, TeacherNetwork>);
+			auto &work = make_workspace<Chunk, TeacherNetwork, false>(scratch);
+
+			for (std::size_t chunk; (chunk = next()) < chunk_count; )
+			{
+				const unsigned first = static_cast<unsigned>(chunk) * Chunk;
+				const unsigned count = std::min(Chunk, sample_count - first);
+
+				fill_chunk(first, count, work.input());
+				const auto &output = forward(work, params, count);
+
+				for (unsigned n = 0; n < count; n++)
+					soften<Temperature>(output[n], targets[first + n]);
+			}
+		});
+	}
+
+	unsigned size() const { return static_cast<unsigned>(targets.size()); }
+
+	const target_type &operator[](const unsigned sample) const { return targets[sample]; }
+
+	// a sample's expectation for cost_functions::distillation, the teacher's
+	// answer and then the label
+	void expectation(const unsigned sample, const target_type &label, matrix<2, classes> &expectation) const
+	{
+		expectation[0] = targets[sample];
+		expectation[1] = label;
+	}
+
+private:
+	std::vector<target_type> targets;
+};
+
+} // nn
@@ -0,0 +1,636 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "arena.hpp"
+
+// data parallel training over several processes, possibly on several
+// machines. every rank runs forward/backward on its own shard of the batch
+// and the gradients are averaged with a ring all-reduce before every rank
+// applies the same update, so the params stay identical everywhere.
+//
+// the gradient is reduced in buckets of whole layers, starting from the
+// output since that's the order backward finishes them in, on a thread of its
+// own. backward's layer hook says when each layer is done, so the last
+// layers' buckets are on the wire while the first layers are still running
+// backward.
+//
+// how the ranks talk to each other is down to a transport, of which there's
+// one for tcp and unix sockets here.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// the ranks are connected in a ring, and a transport is this rank's link to
+// the rank after it and the rank before it
+class transport
+{
+public:
+	virtual ~transport() = default;
+
+	virtual unsigned rank() const = 0;
+	virtual unsigned size() const = 0;
+
+	// sends to the next rank and receives from the previous one at the same
+	// time. it has to be both at once: every rank's send is another's receive,
+	// so a rank that sent everything before receiving would deadlock as soon
+	// as a message outgrew the socket buffers.
+	virtual void exchange(const void *send_data, std::size_t send_size, void *receive_data, std::size_t receive_size) = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+#if defined(__unix__)
+
+// endpoints are "tcp:host:port" or "unix:/path/to/socket", one per rank,
+// saying where that rank listens. every rank gets the same list.
+class socket_transport : public transport
+{
+public:
+	socket_transport(const unsigned rank, std::vector<std::string> endpoints, const std::chrono::seconds timeout = std::chrono::seconds(60))
+		: rank_(rank), endpoints(std::move(endpoints))
+	{
+		const unsigned count = size();
+
+		if (rank_ >= count)
+			throw std::invalid_argument("rank out of range");
+
+		if (count == 1)
+			return;
+
+		listener = listen_on(this->endpoints[rank_]);
+
+		// everyone's listening before anyone accepts, so connect first and
+		// keep retrying until the next rank is up
+		next = connect_to(this->endpoints[(rank_ + 1) % count], timeout);
+		previous = accept_from((rank_ + count - 1) % count);
+
+		::close(listener);
+		listener = -1;
+
+		if (this->endpoints[rank_].compare(0, 5, "unix:") == 0)
+			::unlink(this->endpoints[rank_].c_str() + 5);
+
+		set_non_blocking(next);
+		set_non_blocking(previous);
+	}
+
+	socket_transport(const socket_transport &) = delete;
+	socket_transport &operator=(const socket_transport &) = delete;
+
+	~socket_transport() override
+	{
+		for (const int fd : { listener, next, previous })
+			if (fd >= 0)
+				::close(fd);
+	}
+
+	unsigned rank() const override { return rank_; }
+	unsigned size() const override { return static_cast<unsigned>(endpoints.size()); }
+
+	void exchange(const void *send_data, const std::size_t send_size, void *receive_data, const std::size_t receive_size) override
+	{
+		const char *out = static_cast<const char *>(send_data);
+		char *in = static_cast<char *>(receive_data);
+
+		std::size_t sent = 0, received = 0;
+
+		while (sent < send_size || received < receive_size)
+		{
+			pollfd fds[2];
+			nfds_t count = 0;
+
+			if (sent < send_size)
+				fds[count++] = pollfd{ next, POLLOUT, 0 };
+			if (received < receive_size)
+				fds[count++] = pollfd{ previous, POLLIN, 0 };
+
+			if (::poll(fds, count, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw_error("poll");
+			}
+
+			for (nfds_t i = 0; i < count; i++)
+			{
+				if (fds[i].revents == 0)
+					continue;
+
+				if (fds[i].fd == next)
+				{
+					const ssize_t n = ::send(next, out + sent, send_size - sent, MSG_NOSIGNAL);
+					if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+						throw_error("send");
+					if (n > 0)
+						sent += static_cast<std::size_t>(n);
+				}
+				else
+				{
+					const ssize_t n = ::recv(previous, in + received, receive_size - received, 0);
+					if (n == 0)
+						throw std::runtime_error("previous rank hung up");
+					if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+						throw_error("recv");
+					if (n > 0)
+						received += static_cast<std::size_t>(n);
+				}
+			}
+		}
+	}
+
+private:
+	[[noreturn]] static void throw_error(const char *what)
+	{
+		throw std::system_error(errno, std::generic_category(), what);
+	}
+
+	// fills in address for an endpoint, returning its length
+	static socklen_t resolve(const std::string &endpoint, sockaddr_storage &address)
+	{
+		std::memset(&address, 0, sizeof(address));
+
+		if (endpoint.compare(0, 5, "unix:") == 0)
+		{
+			const std::string path = endpoint.substr(5);
+
+			sockaddr_un &un = reinterpret_cast<sockaddr_un &>(address);
+			if (path.empty() || path.size() >= sizeof(un.sun_path))
+				throw std::invalid_argument("bad unix socket path: " + endpoint);
+
+			un.sun_family = AF_UNIX;
+			std::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+			return sizeof(sockaddr_un);
+		}
+
+		if (endpoint.compare(0, 4, "tcp:") == 0)
+		{
+			const std::size_t colon = endpoint.rfind(':');
+			if (colon <= 4)
+				throw std::invalid_argument("expected tcp:host:port, got " + endpoint);
+
+			const std::string host = endpoint.substr(4, colon - 4);
+			const std::string port = endpoint.substr(colon + 1);
+
+			addrinfo hints{};
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+
+			addrinfo *found = nullptr;
+			if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+				throw std::invalid_argument("couldn't resolve " + endpoint);
+
+			std::memcpy(&address, found->ai_addr, found->ai_addrlen);
+			const socklen_t length = found->ai_addrlen;
+			::freeaddrinfo(found);
+			return length;
+		}
+
+		throw std::invalid_argument("endpoints start with tcp: or unix:, got " + endpoint);
+	}
+
+	static int open_socket(const sockaddr_storage &address)
+	{
+		const int fd = ::socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw_error("socket");
+		return fd;
+	}
+
+	static void configure(const int fd, const sockaddr_storage &address)
+	{
+		// the ring sends lots of medium sized messages back and forth, nagle
+		// only gets in the way
+		if (address.ss_family != AF_UNIX)
+		{
+			const int on = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+	}
+
+	static void set_non_blocking(const int fd)
+	{
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	static void write_all(const int fd, const void *data, const std::size_t size)
+	{
+		for (std::size_t done = 0; done < size; )
+		{
+			const ssize_t n = ::send(fd, static_cast<const char *>(data) + done, size - done, MSG_NOSIGNAL);
+			if (n < 0 && errno != EINTR)
+				throw_error("send");
+			if (n > 0)
+				done += static_cast<std::size_t>(n);
+		}
+	}
+
+	static void read_all(const int fd, void *data, const std::size_t size)
+	{
+		for (std::size_t done = 0; done < size; )
+		{
+			const ssize_t n = ::recv(fd, static_cast<char *>(data) + done, size - done, 0);
+			if (n == 0)
+				throw std::runtime_error("peer hung up during the handshake");
+			if (n < 0 && errno != EINTR)
+				throw_error("recv");
+			if (n > 0)
+				done += static_cast<std::size_t>(n);
+		}
+	}
+
+	int listen_on(const std::string &endpoint)
+	{
+		sockaddr_storage address;
+		const socklen_t length = resolve(endpoint, address);
+
+		if (address.ss_family == AF_UNIX)
+			::unlink(reinterpret_cast<sockaddr_un &>(address).sun_path);
+
+		const int fd = open_socket(address);
+
+		const int on = 1;
+		::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (::bind(fd, reinterpret_cast<sockaddr *>(&address), length) < 0 || ::listen(fd, 1) < 0)
+		{
+			const int error = errno;
+			::close(fd);
+			throw std::system_error(error, std::generic_category(), "couldn't listen on " + endpoint);
+		}
+
+		return fd;
+	}
+
+	int connect_to(const std::string &endpoint, const std::chrono::seconds timeout)
+	{
+		sockaddr_storage address;
+		const socklen_t length = resolve(endpoint, address);
+
+		const auto give_up = std::chrono::steady_clock::now() + timeout;
+
+		for (;;)
+		{
+			const int fd = open_socket(address);
+
+			if (::connect(fd, reinterpret_cast<sockaddr *>(&address), length) == 0)
+			{
+				configure(fd, address);
+
+				// say who we are, so the other end knows it's the right rank
+				const std::uint32_t id = rank_;
+				write_all(fd, &id, sizeof(id));
+				return fd;
+			}
+
+			const int error = errno;
+			::close(fd);
+
+			if (std::chrono::steady_clock::now() > give_up)
+				throw std::system_error(error, std::generic_category(), "couldn't connect to " + endpoint);
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	}
+
+	int accept_from(const unsigned expected_rank)
+	{
+		for (;;)
+		{
+			const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw_error("accept");
+			}
+
+			sockaddr_storage address;
+			socklen_t length = sizeof(address);
+			::getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length);
+			configure(fd, address);
+
+			std::uint32_t id;
+			read_all(fd, &id, sizeof(id));
+
+			if (id == expected_rank)
+				return fd;
+
+			::close(fd);
+			throw std::runtime_error("connection from rank " + std::to_string(id) + ", expected " + std::to_string(expected_rank));
+		}
+	}
+
+	unsigned rank_;
+	std::vector<std::string> endpoints;
+
+	int listener = -1;
+	int next = -1;
+	int previous = -1;
+};
+
+#endif
+
+// -----------------------------------------------------------------------------
+
+// sums a buffer over every rank, in place. a reduce-scatter then an
+// all-gather, each size - 1 steps of passing a 1/size chunk round the ring,
+// so every rank sends and receives 2 (size - 1) / size of the buffer however
+// many ranks there are.
+class ring_allreduce
+{
+public:
+	explicit ring_allreduce(transport &link) : link(link) {}
+
+	transport &get_transport() { return link; }
+
+	void sum(float *data, const unsigned count)
+	{
+		const unsigned size = link.size();
+		const unsigned rank = link.rank();
+
+		if (size == 1 || count == 0)
+			return;
+
+		// chunk c of size, wrapping round
+		const auto chunk_begin = [&](const unsigned c)
+		{
+			return static_cast<unsigned>(static_cast<unsigned long long>(count) * (c % size) / size);
+		};
+		const auto chunk_size = [&](const unsigned c)
+		{
+			return static_cast<unsigned>(static_cast<unsigned long long>(count) * (c % size + 1) / size) - chunk_begin(c);
+		};
+
+		incoming.resize(count / size + 1);
+
+		// after step s, chunk rank - s - 1 holds s + 2 ranks' worth
+		for (unsigned s = 0; s + 1 < size; s++)
+		{
+			const unsigned send = rank + size - s;
+			const unsigned receive = rank + size - s - 1;
+
+			link.exchange(data + chunk_begin(send), chunk_size(send) * sizeof(float),
+			              incoming.data(), chunk_size(receive) * sizeof(float));
+
+			float *target = data + chunk_begin(receive);
+			for (unsigned i = 0, n = chunk_size(receive); i < n; i++)
+				target[i] += incoming[i];
+		}
+
+		// chunk rank + 1 is now complete here, pass the complete chunks on
+		for (unsigned s = 0; s + 1 < size; s++)
+		{
+			const unsigned send = rank + size + 1 - s;
+			const unsigned receive = rank + size - s;
+
+			link.exchange(data + chunk_begin(send), chunk_size(send) * sizeof(float),
+			              data + chunk_begin(receive), chunk_size(receive) * sizeof(float));
+		}
+	}
+
+	// every rank ends up with the root's values
+	void broadcast(float *data, const unsigned count, const unsigned root = 0)
+	{
+		if (link.rank() != root)
+			std::fill(data, data + count, 0.0f);
+		sum(data, count);
+	}
+
+private:
+	transport &link;
+	std::vector<float> incoming;
+};
+
+// -----------------------------------------------------------------------------
+
+// averages a params_t sized gradient over every rank, a bucket at a time on
+// its own thread. start() hands over the gradient to work on, layer_ready(i)
+// says that layer i's slice is final, and as soon as every layer in a bucket
+// is ready it goes off to be reduced. wait() blocks until they all have.
+//
+// buckets are always reduced in the same order, whatever order their layers
+// turn up in, since every rank has to be reducing the same one at once
+template <typename NetworkType>
+class gradient_reducer
+{
+public:
+	static constexpr unsigned layer_count = layer_count_v<NetworkType>;
+
+	static constexpr std::size_t default_bucket_size = 1 << 20;
+
+	explicit gradient_reducer(transport &link, const std::size_t bucket_size = default_bucket_size)
+		: ring(link)
+	{
+		constexpr auto offsets = param_offsets_v<NetworkType>;
+		const unsigned bucket_floats = static_cast<unsigned>(std::max<std::size_t>(bucket_size / sizeof(float), 1));
+
+		// from the output back, closing a bucket once it's big enough
+		for (unsigned i = layer_count; i-- > 0; )
+		{
+			if (buckets.empty() || buckets.back().end - buckets.back().begin >= bucket_floats)
+				buckets.push_back(bucket{ offsets[i + 1], offsets[i + 1], 0, 0, 0 });
+
+			bucket &b = buckets.back();
+			b.begin = offsets[i];
+			b.layers++;
+			layer_bucket[i] = static_cast<unsigned>(buckets.size() - 1);
+		}
+
+		comm_thread = std::thread([this] { run(); });
+	}
+
+	gradient_reducer(const gradient_reducer &) = delete;
+	gradient_reducer &operator=(const gradient_reducer &) = delete;
+
+	~gradient_reducer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		condition.notify_all();
+		comm_thread.join();
+	}
+
+	unsigned bucket_count() const { return static_cast<unsigned>(buckets.size()); }
+
+	ring_allreduce &get_ring() { return ring; }
+
+	void start(params_t<NetworkType> &gradient)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		data = gradient.data();
+		step++;
+		reduced = 0;
+
+		for (bucket &b : buckets)
+			b.remaining = b.layers;
+	}
+
+	void layer_ready(const unsigned layer)
+	{
+		bool ready;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			bucket &b = buckets[layer_bucket[layer]];
+			ready = --b.remaining == 0;
+			if (ready)
+				b.ready_step = step;
+		}
+
+		if (ready)
+			condition.notify_all();
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&] { return reduced == buckets.size(); });
+	}
+
+private:
+	struct bucket
+	{
+		unsigned begin, end;
+		unsigned layers, remaining;
+		unsigned ready_step;
+	};
+
+	void run()
+	{
+		for (unsigned this_step = 1; ; this_step++)
+		{
+			for (bucket &b : buckets)
+			{
+				float *gradient;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					condition.wait(lock, [&] { return stopping || (step == this_step && b.ready_step == this_step); });
+					if (stopping)
+						return;
+					gradient = data;
+				}
+
+				ring.sum(gradient + b.begin, b.end - b.begin);
+
+				const float scale = 1.0f / ring.get_transport().size();
+				for (unsigned i = b.begin; i < b.end; i++)
+					gradient[i] *= scale;
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					reduced++;
+				}
+				condition.notify_all();
+			}
+		}
+	}
+
+	ring_allreduce ring;
+
+	std::vector<bucket> buckets;
+	unsigned layer_bucket[layer_count];
+
+	std::thread comm_thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	float *data = nullptr;
+	unsigned step = 0;
+	std::size_t reduced = 0;
+	bool stopping = false;
+};
+
+// -----------------------------------------------------------------------------
+
+// one rank's worth of distributed training, N samples per rank per step
+template <typename CostFunctionType, unsigned N, typename NetworkType>
+class distributed_trainer
+{
+public:
+	using params_type = params_t<NetworkType>;
+
+	// seed is for stochastic layers, every rank gets its own stream of it
+	explicit distributed_trainer(transport &link,
+	                             const std::size_t bucket_size = gradient_reducer<NetworkType>::default_bucket_size,
+	                             const bool huge_pages = false,
+	                             const std::uint64_t seed = philox::default_seed)
+		: link(link), scratch(step_arena_size_v<N, NetworkType, CostFunctionType>, huge_pages), reducer(link, bucket_size), random(seed, link.rank())
+	{
+	}
+
+	unsigned rank() const { return link.rank(); }
+	unsigned size() const { return link.size(); }
+
+	// call this once before training so that everyone starts from rank 0's params
+	void broadcast(params_type &params)
+	{
+		reducer.get_ring().broadcast(params.data(), param_count_v<NetworkType>);
+	}
+
+	// same as nn::train_step, but with the gradient averaged over every rank
+	// before it's handed to update. the cost is averaged over every rank too.
+	template <typename FillBatch, typename Update>
+	float step(params_type &params, FillBatch &&fill_batch, Update &&update)
+	{
+		arena::scope step(scratch);
+
+		auto &work = make_workspace<N, NetworkType>(scratch);
+		auto &expectation = scratch.make<expectation_t<N, CostFunctionType, NetworkType>>();
+		auto &gradient = scratch.make<params_type>();
+
+		fill_batch(work.input(), expectation);
+
+		forward(work, params, random);
+
+		reducer.start(gradient);
+		float value = cost_and_backward<CostFunctionType>(expectation, work, params, gradient,
+			[this](const layer_gradient &ready) { reducer.layer_ready(ready.layer); });
+		reducer.wait();
+
+		// the comm thread's idle until the next start, so the ring's free
+		reducer.get_ring().sum(&value, 1);
+		value /= size();
+
+		update(gradient);
+
+		return value;
+	}
+
+private:
+	transport &link;
+	arena scratch;
+	gradient_reducer<NetworkType> reducer;
+	philox random;
+};
+
+} // nn
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "tensor.hpp"
+
+// branch-free float approximations of the transcendental functions used by the
+// activation and cost paths. every function here is a straight line of
+// multiplies, adds and selects so that loops over them vectorise, which
+// calling into libm per element never will.
+//
+// measured worst case error in ulp against a double precision reference,
+// sweeping the finite input range:
+//
+//                    low       medium    high
+//     exp            662       3         1
+//     log            261       2         1
+//     logistic       662       4         3
+//     tanh           1815      7         3
+//
+// log is measured where |log(x)| > 0.05, its relative error is unbounded
+// around log(1) = 0 so below that it's better read as an absolute error of
+// 8e-6 (low) and 4e-6 (medium and high). low is ~4e-5 relative, which is
+// plenty for an activation but maybe not for a cost you want to report.
+
+#ifndef NN_MATH_ACCURACY
+#define NN_MATH_ACCURACY medium
+#endif
+
+namespace nn
+{
+
+namespace math
+{
+
+enum class accuracy { low, medium, high };
+
+// what all of the layers and cost functions use, pick another at build time
+// with -DNN_MATH_ACCURACY=low|medium|high
+constexpr accuracy default_accuracy = accuracy::NN_MATH_ACCURACY;
+
+// -----------------------------------------------------------------------------
+
+inline float as_float(const std::uint32_t bits)
+{
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline std::uint32_t as_bits(const float value)
+{
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+// clamps by comparing the bit patterns as ordered integers. a plain float
+// compare against a constant gets turned into a branch (gcc propagates the
+// constant through the rest of the function) and then nothing vectorises.
+// nan ends up at the upper bound.
+inline float _clamp(const float x, const float lower, const float upper)
+{
+	const auto ordered = [](const std::int32_t b) { return b ^ ((b >> 31) & 0x7fffffff); };
+
+	const std::int32_t lo = ordered(static_cast<std::int32_t>(as_bits(lower)));
+	const std::int32_t hi = ordered(static_cast<std::int32_t>(as_bits(upper)));
+
+	std::int32_t b = ordered(static_cast<std::int32_t>(as_bits(x)));
+	b = b < lo ? lo : b;
+	b = b > hi ? hi : b;
+
+	return as_float(static_cast<std::uint32_t>(ordered(b)));
+}
+
+// -----------------------------------------------------------------------------
+
+// e^r - 1 for r in [-ln2/2, ln2/2], written so that it doesn't cancel near 0
+template <accuracy Accuracy>
+float _expm1_reduced(const float r)
+{
+	if constexpr (Accuracy == accuracy::low)
+	{
+		return r + r * r * (0.5f + r * (1.6666667e-1f + r * 4.1666668e-2f));
+	}
+	else if constexpr (Accuracy == accuracy::medium)
+	{
+		return r + r * r * (0.5f + r * (1.6666667e-1f + r * (4.1666668e-2f + r * (8.3333338e-3f + r * 1.3888889e-3f))));
+	}
+	else
+	{
+		// cephes expf coefficients, minimax on the reduced range
+		return r + r * r * (5.0000001201e-1f + r * (1.6666665459e-1f + r * (4.1665795894e-2f
+			+ r * (8.3334519073e-3f + r * (1.3981999507e-3f + r * 1.9875691500e-4f)))));
+	}
+}
+
+// splits x into n * ln2 + r, returns r and leaves 2^n in scale_a * scale_b
+inline float _reduce_exp(const float x, float &scale_a, float &scale_b)
+{
+	// adding 1.5 * 2^23 rounds to the nearest integer without a branch or a call
+	const float shifter = 12582912.0f;
+	const float n = (x * 1.44269504f + shifter) - shifter;
+
+	// n runs from -126 to 128, which doesn't fit in one exponent, so halve it
+	const std::int32_t i = static_cast<std::int32_t>(n);
+	scale_a = as_float(static_cast<std::uint32_t>((i >> 1) + 127) << 23);
+	scale_b = as_float(static_cast<std::uint32_t>(i - (i >> 1) + 127) << 23);
+
+	// ln2 split in two so that n * ln2_hi is exact
+	return (x - n * 6.93359375e-1f) + n * 2.12194440e-4f;
+}
+
+// inputs are clamped to the finite range, so exp(x > 88.7) is FLT_MAX-ish
+// rather than inf and exp(x < -87.3) is FLT_MIN-ish rather than a denormal
+template <accuracy Accuracy = default_accuracy>
+float exp(const float x)
+{
+	float scale_a, scale_b;
+	const float r = _reduce_exp(_clamp(x, -87.3365f, 88.7228f), scale_a, scale_b);
+
+	return (_expm1_reduced<Accuracy>(r) + 1.0f) * scale_a * scale_b;
+}
+
+// e^x - 1, accurate near zero, clamped like exp
+template <accuracy Accuracy = default_accuracy>
+float expm1(const float x)
+{
+	float scale_a, scale_b;
+	const float r = _reduce_exp(_clamp(x, -87.3365f, 88.0f), scale_a, scale_b);
+	const float scale = scale_a * scale_b;
+
+	return _expm1_reduced<Accuracy>(r) * scale + (scale - 1.0f);
+}
+
+// natural log. log(0) is -inf, log(x < 0) is nan, denormals are treated as
+// FLT_MIN and so come out as -87.3
+template <accuracy Accuracy = default_accuracy>
+float log(const float x)
+{
+	const std::int32_t x_bits = static_cast<std::int32_t>(as_bits(x));
+
+	// split into m * 2^e with m in [sqrt(1/2), sqrt(2)). this is garbage for
+	// anything that isn't a normal positive float, those get patched up below
+	const std::uint32_t bits = as_bits(x) + (0x3f800000u - 0x3f3504f3u);
+	const float e = static_cast<float>(static_cast<std::int32_t>(bits >> 23) - 127);
+	const float f = as_float((bits & 0x007fffffu) + 0x3f3504f3u) - 1.0f;
+
+	// log(1 + f) = f - f^2/2 + f^3 p(f). no division, so that none of this
+	// stops the special case selects below from being if-converted
+	float p;
+
+	if constexpr (Accuracy == accuracy::low)
+	{
+		p = -1.5021379261e-1f;
+		p = p * f + 2.2100687176e-1f;
+		p = p * f - 2.5232752319e-1f;
+		p = p * f + 3.3257179829e-1f;
+	}
+	else if constexpr (Accuracy == accuracy::medium)
+	{
+		p = 8.4791545045e-2f;
+		p = p * f - 1.4316773186e-1f;
+		p = p * f + 1.5020804728e-1f;
+		p = p * f - 1.6574571506e-1f;
+		p = p * f + 1.9951409962e-1f;
+		p = p * f - 2.5001292532e-1f;
+		p = p * f + 3.3334266756e-1f;
+	}
+	else
+	{
+		// cephes logf coefficients
+		p = 7.0376836292e-2f;
+		p = p * f - 1.1514610310e-1f;
+		p = p * f + 1.1676998740e-1f;
+		p = p * f - 1.2420140846e-1f;
+		p = p * f + 1.4249322787e-1f;
+		p = p * f - 1.6668057665e-1f;
+		p = p * f + 2.0000714765e-1f;
+		p = p * f - 2.4999993993e-1f;
+		p = p * f + 3.3333331174e-1f;
+	}
+
+	const float z = f * f;
+	float y = f + (f * z * p - 0.5f * z);
+
+	y = (y - e * 2.12194440e-4f) + e * 6.93359375e-1f;
+
+	// +-0 goes to -inf, negatives to nan, inf and nan pass through and
+	// denormals are treated as FLT_MIN
+	float special = x_bits < 0x00800000 ? -87.3365447f : x;
+	special = x_bits < 0 ? std::numeric_limits<float>::quiet_NaN() : special;
+	special = (x_bits & 0x7fffffff) == 0 ? -std::numeric_limits<float>::infinity() : special;
+
+	// blended in with a mask, a select here has gcc sink the whole polynomial
+	// under a branch that it then can't vectorise
+	const std::uint32_t use_special = x_bits < 0x00800000 || x_bits >= 0x7f800000 ? ~0u : 0u;
+	return as_float((as_bits(y) & ~use_special) | (as_bits(special) & use_special));
+}
+
+// log(1 + x) for x > -1, without losing x when it's tiny
+template <accuracy Accuracy = default_accuracy>
+float log1p(const float x)
+{
+	const float u = 1.0f + x;
+	const float d = u - 1.0f;
+	return d == 0.0f ? x : log<Accuracy>(u) * (x / d);
+}
+
+template <accuracy Accuracy = default_accuracy>
+float logistic(const float x)
+{
+	return 1.0f / (1.0f + exp<Accuracy>(-x));
+}
+
+template <accuracy Accuracy = default_accuracy>
+float tanh(const float x)
+{
+	// odd, so work on |x| and put the sign back on at the end. tanh(|x|)
+	// rounds to 1 past 9.01
+	const std::uint32_t sign = as_bits(x) & 0x80000000u;
+	const float a = _clamp(as_float(as_bits(x) ^ sign), 0.0f, 9.1f);
+
+	const float em = expm1<Accuracy>(2.0f * a);
+	return as_float(as_bits(em / (em + 2.0f)) | sign);
+}
+
+// -----------------------------------------------------------------------------
+
+// bulk versions, for when there's a whole vector to do
+
+template <accuracy Accuracy = default_accuracy, unsigned N>
+auto exp(const vector<N> &values, vector<N> &result) -> decltype(result)
+{
+	for (unsigned n = 0; n < N; n++)
+		result[n] = exp<Accuracy>(values[n]);
+	return result;
+}
+
+template <accuracy Accuracy = default_accuracy, unsigned N>
+auto log(const vector<N> &values, vector<N> &result) -> decltype(result)
+{
+	for (unsigned n = 0; n < N; n++)
+		result[n] = log<Accuracy>(values[n]);
+	return result;
+}
+
+template <accuracy Accuracy = default_accuracy, unsigned N>
+auto logistic(const vector<N> &values, vector<N> &result) -> decltype(result)
+{
+	for (unsigned n = 0; n < N; n++)
+		result[n] = logistic<Accuracy>(values[n]);
+	return result;
+}
+
+template <accuracy Accuracy = default_accuracy, unsigned N>
+auto tanh(const vector<N> &values, vector<N> &result) -> decltype(result)
+{
+	for (unsigned n = 0; n < N; n++)
+		result[n] = tanh<Accuracy>(values[n]);
+	return result;
+}
+
+} // math
+
+} // nn
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "parallel.hpp"
+
+// checks backward against the cost function's actual slope, on networks of
+// any size. numerical_gradient nudges every param in turn; this only nudges
+// a few in each layer, picked at random, and then nudges each layer's params
+// all at once in a few directions, which catches a wrong gradient
+// anywhere in the layer without having to visit all of it:
+//
+//     auto check = nn::check_gradient<nn::cost_functions::softmax_cross_entropy, 32, MyNetwork>(params, input, expectation);
+//
+//     for (const auto &layer : check.layers)
+//         printf("layer %u: %.2e, %.2e along random directions\n", layer.layer, layer.max_error, layer.directional_error);
+//
+// every nudge is a forward pass of its own, and they're spread over however
+// many threads. random layers get the same random numbers on every pass, so
+// they check like any other.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+struct gradient_check_options
+{
+	// params per layer nudged one at a time, all of them in a smaller layer
+	unsigned samples_per_layer = 16;
+
+	// random directions per layer, to nudge the whole layer along
+	unsigned directions_per_layer = 4;
+
+	// how far to nudge. the forward passes are in floats, so much less than
+	// this and the difference in cost is mostly rounding.
+	float epsilon = 1e-2f;
+
+	// slopes smaller than this are too small to measure well, errors are
+	// relative to at least this much
+	float floor = 1e-3f;
+
+	std::uint64_t seed = philox::default_seed;
+
+	// 0 uses every cpu
+	unsigned threads = 0;
+};
+
+// relative errors, |backward - measured| / max(|backward|, |measured|, floor),
+// or infinity if either of them isn't a finite number
+struct layer_gradient_check
+{
+	unsigned layer;
+	unsigned param_offset;
+	unsigned param_count;
+
+	// how many params were nudged on their own, and the worst of them
+	unsigned checked = 0;
+	float max_error = 0.0f;
+
+	// the worst of the random directions
+	float directional_error = 0.0f;
+};
+
+template <typename NetworkType>
+struct gradient_check_t
+{
+	std::array<layer_gradient_check, layer_count_v<NetworkType>> layers;
+
+	float worst() const
+	{
+		float value = 0.0f;
+		for (const auto &layer : layers)
+			value = std::max({ value, layer.max_error, layer.directional_error });
+		return value;
+	}
+
+	bool passed(const float tolerance = 1e-2f) const
+	{
+		return worst() <= tolerance;
+	}
+};
+
+// scratch for one checking thread
+template <unsigned N, typename NetworkType>
+constexpr std::size_t gradient_check_arena_size_v =
+	sizeof(workspace_t<N, NetworkType>) +
+	sizeof(params_t<NetworkType>) +
+	2 * arena::default_alignment;
+
+// -----------------------------------------------------------------------------
+
+// one nudge: a single param, or a whole layer along a random direction
+struct _gradient_probe
+{
+	unsigned layer;
+	bool directional;
+
+	// the param for a single one, the direction's stream for a direction
+	std::uint64_t index;
+
+	double backward = 0.0;
+	double measured = 0.0;
+};
+
+// count distinct indices from [0, range), or all of them if there aren't that
+// many (floyd's algorithm)
+inline std::vector<unsigned> _sample_indices(const unsigned range, const unsigned count, philox &random)
+{
+	std::vector<unsigned> indices;
+
+	if (count >= range)
+	{
+		for (unsigned i = 0; i < range; i++)
+			indices.push_back(i);
+		return indices;
+	}
+
+	for (unsigned j = range - count; j < range; j++)
+	{
+		const unsigned t = random.below(j + 1);
+		indices.push_back(std::find(indices.begin(), indices.end(), t) == indices.end() ? t : j);
+	}
+
+	std::sort(indices.begin(), indices.end());
+	return indices;
+}
+
+// scales values to unit length, if they aren't all zero
+inline void _normalise(float *values, const unsigned count)
+{
+	double length = 0.0;
+	for (unsigned i = 0; i < count; i++)
+		length += static_cast<double>(values[i]) * values[i];
+
+	if (length == 0.0)
+		return;
+
+	const float scale = static_cast<float>(1.0 / std::sqrt(length));
+	for (unsigned i = 0; i < count; i++)
+		values[i] *= scale;
+}
+
+// a unit length direction, half the way backward says is downhill and half
+// random (the same every time for the same stream). a purely random direction
+// in a big layer is close to square on to the gradient, and its slope too
+// small to measure.
+inline void _probe_direction(std::vector<float> &direction, const float *gradient, const unsigned count, const std::uint64_t seed, const std::uint64_t stream)
+{
+	direction.resize(count);
+
+	philox random(seed, stream);
+	random.fill_normal(direction.data(), count);
+	_normalise(direction.data(), count);
+
+	std::vector<float> downhill(gradient, gradient + count);
+	_normalise(downhill.data(), count);
+
+	for (unsigned i = 0; i < count; i++)
+		direction[i] += downhill[i];
+	_normalise(direction.data(), count);
+}
+
+// the batch's mean cost, added up in doubles so as not to lose the little
+// differences between nudges
+template <typename CostFunctionType, unsigned N, unsigned... ExpectationSizes, unsigned... Sizes>
+double _mean_cost(const tensor<shape_t<N, ExpectationSizes...>> &expectation,
+                  const tensor<shape_t<N, Sizes...>> &prediction)
+{
+	double value = 0.0;
+	for (unsigned n = 0; n < N; n++)
+		value += CostFunctionType::cost(expectation[n], prediction[n]);
+	return value / N;
+}
+
+template <typename CostFunctionType, unsigned N, typename NetworkType>
+auto check_gradient(const params_t<NetworkType> &params,
+                    const vector_of<N, typename NetworkType::input_shape> &input,
+                    const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                    const gradient_check_options &options = gradient_check_options()) -> gradient_check_t<NetworkType>
+{
+	constexpr unsigned layer_count = layer_count_v<NetworkType>;
+	constexpr auto offsets = param_offsets_v<NetworkType>;
+
+	// the same random numbers for every pass, for the random layers
+	const auto forward_pass = [&](workspace_t<N, NetworkType> &work, const params_t<NetworkType> &p) -> const output_t<N, NetworkType> &
+	{
+		philox random(options.seed);
+		return forward(work, p, random);
+	};
+
+	// what backward makes of it
+	arena backward_scratch(step_arena_size_v<N, NetworkType, CostFunctionType>);
+	auto &gradient = backward_scratch.make<params_t<NetworkType>>();
+	{
+		auto &work = make_workspace<N, NetworkType>(backward_scratch);
+		work.input() = input;
+
+		forward_pass(work, params);
+		backward<CostFunctionType>(expectation, work, params, gradient);
+	}
+
+	gradient_check_t<NetworkType> result;
+
+	// off the seed, stream 0 is the random layers', 1 picks the params to nudge
+	// and the directions have one each from 2 on
+	std::vector<_gradient_probe> probes;
+	philox picking(options.seed, 1);
+
+	for (unsigned l = 0; l < layer_count; l++)
+	{
+		const unsigned count = offsets[l + 1] - offsets[l];
+		result.layers[l].layer = l;
+		result.layers[l].param_offset = offsets[l];
+		result.layers[l].param_count = count;
+
+		if (count == 0)
+			continue;
+
+		for (const unsigned i : _sample_indices(count, options.samples_per_layer, picking))
+			probes.push_back({ l, false, offsets[l] + i });
+
+		for (unsigned d = 0; d < options.directions_per_layer; d++)
+			probes.push_back({ l, true, 2 + probes.size() });
+	}
+
+	_for_each_chunk(probes.size(), options.threads, [&](const auto &next)
+	{
+		arena scratch(gradient_check_arena_size_v<N, NetworkType>);
+		auto &work = make_workspace<N, NetworkType>(scratch);
+		auto &nudged = scratch.make<params_t<NetworkType>>();
+
+		work.input() = input;
+		nudged = params;
+
+		std::vector<float> direction;
+
+		for (std::size_t p; (p = next()) < probes.size(); )
+		{
+			_gradient_probe &probe = probes[p];
+
+			const unsigned first = offsets[probe.layer];
+			const unsigned count = offsets[probe.layer + 1] - first;
+
+			// nudges by step along the direction, or the one param
+			const auto nudge = [&](const float step)
+			{
+				if (probe.directional)
+				{
+					for (unsigned i = 0; i < count; i++)
+						nudged[first + i] = params[first + i] + step * direction[i];
+				}
+				else
+				{
+					nudged[probe.index] = params[probe.index] + step;
+				}
+			};
+
+			if (probe.directional)
+			{
+				_probe_direction(direction, &gradient[first], count, options.seed, probe.index);
+
+				for (unsigned i = 0; i < count; i++)
+					probe.backward += static_cast<double>(gradient[first + i]) * direction[i];
+			}
+			else
+			{
+				probe.backward = gradient[probe.index];
+			}
+
+			nudge(options.epsilon);
+			const double plus = _mean_cost<CostFunctionType>(expectation, forward_pass(work, nudged));
+
+			nudge(-options.epsilon);
+			const double minus = _mean_cost<CostFunctionType>(expectation, forward_pass(work, nudged));
+
+			nudge(0.0f);
+
+			probe.measured = (plus - minus) / (2.0 * options.epsilon);
+		}
+	});
+
+	for (const _gradient_probe &probe : probes)
+	{
+		const double scale = std::max({ std::fabs(probe.backward), std::fabs(probe.measured), static_cast<double>(options.floor) });
+		float relative = static_cast<float>(std::fabs(probe.backward - probe.measured) / scale);
+
+		// a nan would slip through std::max and the check would pass, so a
+		// slope or a cost that isn't a number is as wrong as it gets
+		if (!std::isfinite(probe.backward) || !std::isfinite(probe.measured) || !std::isfinite(relative))
+			relative = std::numeric_limits<float>::infinity();
+
+		layer_gradient_check &layer = result.layers[probe.layer];
+		if (probe.directional)
+		{
+			layer.directional_error = std::max(layer.directional_error, relative);
+		}
+		else
+		{
+			layer.checked++;
+			layer.max_error = std::max(layer.max_error, relative);
+		}
+	}
+
+	return result;
+}
+
+} // nn
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "network.hpp"
+#include "plan.hpp"
+#include "random.hpp"
+
+// layers made of other layers, for networks that aren't a straight line. a
+// branch layer sends its input down several chains of layers side by side and
+// merges what comes out, by adding it up or by concatenating it:
+//
+//     nn::network_t<
+//         shape_t<64>,
+//         nn::layers::fully_connected<64>::type,
+//         nn::layers::residual<
+//             nn::layers::fully_connected<64>::type,
+//             nn::layers::relu,
+//             nn::layers::fully_connected<64>::type
+//         >::type,
+//         nn::layers::relu,
+//         nn::layers::concat<
+//             nn::layers::chain<nn::layers::fully_connected<32>::type, nn::layers::tanh>,
+//             nn::layers::chain<nn::layers::fully_connected<16>::type, nn::layers::relu>
+//         >::type,
+//         ...>
+//
+// an empty chain is a skip connection, the input as it is, and residual<...>
+// is just add<chain<>, chain<...>>. branches can have branches in them.
+//
+// to the network around it a branch is a layer like any other, with its
+// branches' params one after the other as its params, so everything that
+// takes a network takes one with branches without knowing. each branch is a
+// network of its own, and in training runs in a planned workspace of its own
+// (see plan.hpp) that lives in the branch layer's state, so its activations
+// are packed the same way the outer network's are. in backward the input's
+// delta is the sum of every branch's, and each branch's params get their own
+// gradient as usual.
+
+namespace nn
+{
+
+namespace layers
+{
+
+// -----------------------------------------------------------------------------
+
+// the layers down one branch
+template <template <typename> typename... LayerTypes>
+struct chain
+{
+};
+
+namespace merge_methods
+{
+
+// for use with layers::branch
+
+// the branches' outputs added up, which all have to be the same shape
+struct add
+{
+	template <typename Shape, typename... Shapes>
+	struct output
+	{
+		static_assert((std::is_same_v<Shape, Shapes> && ...), "added branches have to come out the same shape");
+		using type = Shape;
+	};
+
+	// where each branch's output goes in the merged output
+	template <unsigned... Counts>
+	static constexpr std::array<unsigned, sizeof...(Counts)> offsets()
+	{
+		return {};
+	}
+
+	static constexpr bool sums = true;
+};
+
+// the branches' outputs one after another. outputs with more than one
+// dimension are stacked along the first, so three convolutions' worth of
+// channels become one set of channels, and have to match in the rest.
+struct concat
+{
+	template <typename Shape, typename... Shapes>
+	struct output
+	{
+		static_assert((std::is_same_v<typename Shape::next_shape, typename Shapes::next_shape> && ...), "concatenated branches have to match in all but their first dimension");
+		using type = extend_shape_t<(Shape::count + ... + Shapes::count) / Shape::next_shape::count, typename Shape::next_shape>;
+	};
+
+	template <unsigned Size, unsigned... Sizes>
+	struct output<shape_t<Size>, shape_t<Sizes>...>
+	{
+		using type = shape_t<(Size + ... + Sizes)>;
+	};
+
+	template <unsigned... Counts>
+	static constexpr std::array<unsigned, sizeof...(Counts)> offsets()
+	{
+		std::array<unsigned, sizeof...(Counts)> result{};
+		const unsigned counts[] = { Counts... };
+
+		for (std::size_t b = 1; b < sizeof...(Counts); b++)
+			result[b] = result[b - 1] + counts[b - 1];
+		return result;
+	}
+
+	static constexpr bool sums = false;
+};
+
+} // merge_methods
+
+// -----------------------------------------------------------------------------
+
+// one branch's worth of a branch layer
+
+template <typename Chain, typename InputShape>
+struct _branch;
+
+// a skip connection
+template <typename InputShape>
+struct _branch<chain<>, InputShape>
+{
+	using output_shape = InputShape;
+
+	static constexpr unsigned param_count = 0;
+	static constexpr bool is_stochastic = false;
+
+	struct state_t
+	{
+	};
+
+	static void randomise(float *params, philox &random)
+	{
+	}
+
+	template <typename Merge>
+	static void forward(const tensor<InputShape> &input, const float *params, Merge &&merge)
+	{
+		merge(input);
+	}
+
+	static const tensor<output_shape> &forward(const tensor<InputShape> &input, state_t &state, const float *params, philox &random)
+	{
+		return input;
+	}
+
+	static void backward(state_t &state,
+                         const float *params,
+                         const tensor<output_shape> &delta_output,
+                         tensor<InputShape> &delta_input,
+                         float *delta_params)
+	{
+		delta_input += delta_output;
+	}
+};
+
+template <template <typename> typename... LayerTypes, typename InputShape>
+struct _branch<chain<LayerTypes...>, InputShape>
+{
+	using network = network_t<InputShape, LayerTypes...>;
+	using output_shape = typename network::output_shape;
+
+	static constexpr unsigned layer_count = layer_count_v<network>;
+	static constexpr unsigned param_count = param_count_v<network>;
+	static constexpr bool is_stochastic = is_stochastic_v<network>;
+
+	using state_t = workspace_t<1, network, true>;
+
+	static const params_t<network> &_params(const float *params)
+	{
+		return *reinterpret_cast<const params_t<network> *>(params);
+	}
+
+	static params_t<network> &_params(float *params)
+	{
+		return *reinterpret_cast<params_t<network> *>(params);
+	}
+
+	// off a seed of its own, so that its layers' streams don't run into the
+	// outer network's
+	static void randomise(float *params, philox &random)
+	{
+		const std::uint64_t seed = static_cast<std::uint64_t>(random()) << 32 | random();
+		_randomise_params<network>(_params(params), seed, 0);
+	}
+
+	// outside of training, in a workspace on the stack
+	template <typename Merge>
+	static void forward(const tensor<InputShape> &input, const float *params, Merge &&merge)
+	{
+		workspace_t<1, network, false> work;
+
+		work.input()[0] = input;
+		merge(nn::forward(work, _params(params))[0]);
+	}
+
+	static const tensor<output_shape> &forward(const tensor<InputShape> &input, state_t &state, const float *params, philox &random)
+	{
+		state.input()[0] = input;
+		return nn::forward(state, _params(params), random)[0];
+	}
+
+	template <unsigned I>
+	static void _backward(state_t &state, const params_t<network> &params, params_t<network> &delta_params)
+	{
+		using layer_network = network_at_t<network, I>;
+
+		constexpr unsigned param_offset = param_offset_v<network, I>;
+
+		backward_sample<layer_network>(
+			state.template activation<I>()[0],
+			state.template activation<I + 1>()[0],
+			sample_state<layer_network, 1>(state.template state<I>(), 0),
+			params.template offset<param_offset>(),
+			state.template delta<I>()[0],
+			state.template delta<I + 1>()[0],
+			delta_params.template offset<param_offset>()
+		);
+
+		if constexpr(I > 0)
+			_backward<I - 1>(state, params, delta_params);
+	}
+
+	static void backward(state_t &state,
+                         const float *params,
+                         const tensor<output_shape> &delta_output,
+                         tensor<InputShape> &delta_input,
+                         float *delta_params)
+	{
+		state.template delta<layer_count>()[0] = delta_output;
+		_backward<layer_count - 1>(state, _params(params), _params(delta_params));
+
+		delta_input += state.template delta<0>()[0];
+	}
+};
+
+// the branches' workspaces, and a generator for any random layers in them
+template <typename InputShape, typename... Chains>
+struct _branch_state
+{
+	// backward works out the branches' deltas in their workspaces, but only
+	// gets the state const like any other layer
+	mutable std::tuple<typename _branch<Chains, InputShape>::state_t...> branches;
+
+	philox random;
+};
+
+template <typename State, bool Stochastic>
+struct _branch_sampler
+{
+};
+
+template <typename State>
+struct _branch_sampler<State, true>
+{
+	// the random layers inside sample as they're run, off a stream that's
+	// this sample's
+	static void sample(State &state, philox &random)
+	{
+		state.random = random.stream(static_cast<std::uint64_t>(random()) << 32 | random());
+	}
+};
+
+// leave as incomplete type to imply no params
+struct _no_branch_params;
+
+// -----------------------------------------------------------------------------
+
+template <typename MergeMethod, typename... Chains>
+struct branch
+{
+	static_assert(sizeof...(Chains) > 0, "a branch layer needs branches");
+
+	template <typename InputShape>
+	struct type : _branch_sampler<_branch_state<InputShape, Chains...>, (_branch<Chains, InputShape>::is_stochastic || ...)>
+	{
+		using branches = std::tuple<_branch<Chains, InputShape>...>;
+
+		template <std::size_t B>
+		using branch_t = std::tuple_element_t<B, branches>;
+
+		static constexpr unsigned branch_count = sizeof...(Chains);
+
+		using output_shape = typename MergeMethod::template output<typename _branch<Chains, InputShape>::output_shape...>::type;
+
+		// where each branch's output goes in this one's, as floats
+		static constexpr auto output_offsets = MergeMethod::template offsets<_branch<Chains, InputShape>::output_shape::count...>();
+
+		// where each branch's params start in this one's
+		static constexpr auto param_offsets = merge_methods::concat::offsets<_branch<Chains, InputShape>::param_count...>();
+		static constexpr unsigned param_count = (0 + ... + _branch<Chains, InputShape>::param_count);
+
+		struct _params_t
+		{
+			float values[param_count ? param_count : 1];
+
+			void randomise(philox &random)
+			{
+				_randomise(values, random, std::make_index_sequence<branch_count>());
+			}
+		};
+
+		using params_t = std::conditional_t<param_count != 0, _params_t, _no_branch_params>;
+		using state_t = _branch_state<InputShape, Chains...>;
+
+		template <std::size_t... Bs>
+		static void _randomise(float *params, philox &random, std::index_sequence<Bs...>)
+		{
+			(branch_t<Bs>::randomise(params + param_offsets[Bs], random), ...);
+		}
+
+		template <std::size_t B>
+		static void _merge(const tensor<typename branch_t<B>::output_shape> &branch_output, tensor<output_shape> &output)
+		{
+			const float *in = reinterpret_cast<const float *>(&branch_output);
+			float *out = reinterpret_cast<float *>(&output) + output_offsets[B];
+
+			for (unsigned i = 0; i < branch_t<B>::output_shape::count; i++)
+			{
+				if constexpr(MergeMethod::sums && B > 0)
+					out[i] += in[i];
+				else
+					out[i] = in[i];
+			}
+		}
+
+		template <std::size_t... Bs>
+		static void _forward(const tensor<InputShape> &input, tensor<output_shape> &output, const float *params, std::index_sequence<Bs...>)
+		{
+			(branch_t<Bs>::forward(input, params + param_offsets[Bs], [&](const auto &branch_output) { _merge<Bs>(branch_output, output); }), ...);
+		}
+
+		template <std::size_t... Bs>
+		static void _forward(const tensor<InputShape> &input, tensor<output_shape> &output, state_t &state, const float *params, std::index_sequence<Bs...>)
+		{
+			(_merge<Bs>(branch_t<Bs>::forward(input, std::get<Bs>(state.branches), params + param_offsets[Bs], state.random), output), ...);
+		}
+
+		template <std::size_t... Bs>
+		static void _backward(const state_t &state,
+                              const float *params,
+                              tensor<InputShape> &delta_input,
+                              const tensor<output_shape> &delta_output,
+                              float *delta_params,
+                              std::index_sequence<Bs...>)
+		{
+			// each branch gets its part of the output's delta, or all of it if
+			// they were added, and adds its input delta to the rest
+			delta_input.zero();
+
+			(branch_t<Bs>::backward(
+				std::get<Bs>(state.branches),
+				params + param_offsets[Bs],
+				*reinterpret_cast<const tensor<typename branch_t<Bs>::output_shape> *>(reinterpret_cast<const float *>(&delta_output) + output_offsets[Bs]),
+				delta_input,
+				delta_params + param_offsets[Bs]), ...);
+		}
+
+		// outside of training
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            const params_t &params)
+		{
+			_forward(input, output, reinterpret_cast<const float *>(&params), std::make_index_sequence<branch_count>());
+		}
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output)
+		{
+			_forward(input, output, nullptr, std::make_index_sequence<branch_count>());
+		}
+
+		// training
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            state_t &state,
+                            const params_t &params)
+		{
+			_forward(input, output, state, reinterpret_cast<const float *>(&params), std::make_index_sequence<branch_count>());
+		}
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            state_t &state)
+		{
+			_forward(input, output, state, nullptr, std::make_index_sequence<branch_count>());
+		}
+
+		static void backward(const tensor<InputShape> &input,
+                             const tensor<output_shape> &output,
+                             const state_t &state,
+                             const params_t &params,
+                             tensor<InputShape> &delta_input,
+                             const tensor<output_shape> &delta_output,
+                             params_t &delta_params)
+		{
+			_backward(state, reinterpret_cast<const float *>(&params), delta_input, delta_output, reinterpret_cast<float *>(&delta_params), std::make_index_sequence<branch_count>());
+		}
+
+		static void backward(const tensor<InputShape> &input,
+                             const tensor<output_shape> &output,
+                             const state_t &state,
+                             tensor<InputShape> &delta_input,
+                             const tensor<output_shape> &delta_output)
+		{
+			_backward(state, nullptr, delta_input, delta_output, nullptr, std::make_index_sequence<branch_count>());
+		}
+	};
+};
+
+template <typename... Chains>
+using add = branch<merge_methods::add, Chains...>;
+
+template <typename... Chains>
+using concat = branch<merge_methods::concat, Chains...>;
+
+// input + layers(input)
+template <template <typename> typename... LayerTypes>
+using residual = add<chain<>, chain<LayerTypes...>>;
+
+} // layers
+
+} // nn
@@ -1,10 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <type_traits>
+#include <vector>
 
 #include "tensor.hpp"
 #include "math.hpp"
+#include "fast_math.hpp"
+#include "random.hpp"
 
 // A selection of layer types and templates for layer types
 
@@ -22,7 +28,7 @@ struct logistic
 {
 	static float evaluate(const float x)
 	{
-		return 1.0f / (1.0f + exp(-x));
+		return math::logistic(x);
 	}
 
 	static float derivative(const float x, const float y)
@@ -31,6 +37,19 @@ struct logistic
 	}
 };
 
+struct tanh
+{
+	static float evaluate(const float x)
+	{
+		return math::tanh(x);
+	}
+
+	static float derivative(const float x, const float y)
+	{
+		return 1.0f - y * y;
+	}
+};
+
 struct relu
 {
 	static float evaluate(const float x)
@@ -44,16 +63,65 @@ struct relu
 	}
 };
 
+struct leaky_relu
+{
+	static constexpr float slope = 0.01f;
+
+	static float evaluate(const float x)
+	{
+		return x > 0.0f ? x : slope * x;
+	}
+
+	static float derivative(const float x, const float y)
+	{
+		return x > 0.0f ? 1.0f : slope;
+	}
+};
+
 struct softplus
 {
 	static float evaluate(const float x)
 	{
-		return log(1.0f + exp(x));
+		// log(1 + e^x) overflows for big x, this doesn't
+		return std::max(0.0f, x) + math::log1p(math::exp(-std::abs(x)));
+	}
+
+	static float derivative(const float x, const float y)
+	{
+		return math::logistic(x);
+	}
+};
+
+// x * logistic(x), aka swish
+struct silu
+{
+	static float evaluate(const float x)
+	{
+		return x * math::logistic(x);
+	}
+
+	static float derivative(const float x, const float y)
+	{
+		const float s = math::logistic(x);
+		return s * (1.0f + x * (1.0f - s));
+	}
+};
+
+// the tanh approximation, which is what everyone actually uses
+struct gelu
+{
+	static constexpr float a = 0.7978845608f; // sqrt(2/pi)
+	static constexpr float b = 0.044715f;
+
+	static float evaluate(const float x)
+	{
+		return 0.5f * x * (1.0f + math::tanh(a * (x + b * x * x * x)));
 	}
 
 	static float derivative(const float x, const float y)
 	{
-		return 1.0f / (1.0f + exp(-x));
+		const float t = math::tanh(a * (x + b * x * x * x));
+		return 0.5f * (1.0f + t) + 0.5f * x * (1.0f - t * t) * a * (1.0f + 3.0f * b * x * x);
 	}
 };
 
@@ -74,21 +142,21 @@ struct non_linearity
 
 		struct params_t; // leave as incomplete type to imply no params
 
-		static void forward(const vector<InputShape::count> &input,
+		NN_KERNEL static void forward(const vector<InputShape::count> &input,
                             vector<InputShape::count> &output)
 		{
 			for (unsigned i = 0; i < InputShape::count; i++)
 				output[i] = FunctionType::evaluate(input[i]);
 		}
 
-		template <typename = std::enable_if_t<InputShape::dim != 1>>
+		template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 		static void forward(const tensor<InputShape> &input,
                             tensor<InputShape> &output)
 		{
 			forward(input.unravel(), output.unravel());
 		}
 
-		static void backward(const vector<InputShape::count> &input,
+		NN_KERNEL static void backward(const vector<InputShape::count> &input,
                              const vector<output_shape::count> &output,
                              vector<InputShape::count> &delta_input,
                              const vector<output_shape::count> &delta_output)
@@ -97,7 +165,7 @@ struct non_linearity
 				delta_input[i] = delta_output[i] * FunctionType::derivative(input[i], output[i]);
 		}
 
-		template <typename = std::enable_if_t<InputShape::dim != 1>>
+		template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 		static void backward(const tensor<InputShape> &input,
                              const tensor<output_shape> &output,
                              tensor<InputShape> &delta_input,
@@ -117,6 +185,18 @@ using softplus = non_linearity<non_linearity_functions::softplus>::type<InputSha
 template <typename InputShape>
 using relu = non_linearity<non_linearity_functions::relu>::type<InputShape>;
 
+template <typename InputShape>
+using tanh = non_linearity<non_linearity_functions::tanh>::type<InputShape>;
+
+template <typename InputShape>
+using leaky_relu = non_linearity<non_linearity_functions::leaky_relu>::type<InputShape>;
+
+template <typename InputShape>
+using silu = non_linearity<non_linearity_functions::silu>::type<InputShape>;
+
+template <typename InputShape>
+using gelu = non_linearity<non_linearity_functions::gelu>::type<InputShape>;
+
 // -----------------------------------------------------------------------------
 
 template <typename InputShape>
@@ -131,15 +211,19 @@ struct softmax
 	{
 		const float maxValue = math::max(input);
 
+		// exp in its own loop so that it vectorises, the sum won't
+		for (unsigned i = 0; i < InputShape::count; i++)
+			output[i] = math::exp(input[i] - maxValue);
+
 		float sum = 0.0;
 		for (unsigned i = 0; i < InputShape::count; i++)
-			sum += (output[i] = exp(input[i] - maxValue));
+			sum += output[i];
 
 		for (unsigned i = 0; i < InputShape::count; i++)
 			output[i] /= sum;
 	}
 
-	template <typename = std::enable_if_t<InputShape::dim != 1>>
+	template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 	static void forward(const tensor<InputShape> &input,
                         tensor<output_shape> &output)
 	{
@@ -151,15 +235,15 @@ struct softmax
                          vector<InputShape::count> &delta_input,
                          const tensor<output_shape> &delta_output)
 	{
+		// sum_j delta_output[j] * (kdelta(i, j) - output[j]) * output[i], but
+		// the sum over j doesn't depend on i so it only needs doing once
+		const float weighted = math::dot(delta_output, output);
+
 		for (unsigned i = 0; i < InputShape::count; i++)
-		{
-			delta_input[i] = 0.0;
-			for (unsigned j = 0; j < InputShape::count; j++)
-				delta_input[i] += delta_output[j] * (math::kdelta(i, j) - output[i]) * output[j];
-		}
+			delta_input[i] = output[i] * (delta_output[i] - weighted);
 	}
 
-	template <typename = std::enable_if_t<InputShape::dim != 1>>
+	template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 	static void backward(const tensor<InputShape> &input,
                          const tensor<output_shape> &output,
                          tensor<InputShape> &delta_input,
@@ -171,6 +255,99 @@ struct softmax
 
 // -----------------------------------------------------------------------------
 
+// inverted dropout: in training every value is zeroed with a chance of
+// Percent in 100, and the ones left are scaled up to make up for it, so that
+// outside of training it's just a copy. GroupSize values share each bit of the
+// mask, which is kept a bit per group rather than a float per value.
+template <unsigned Percent, typename InputShape, unsigned GroupSize>
+struct _dropout
+{
+	static_assert(Percent < 100, "dropping everything doesn't leave much to train");
+	static_assert(InputShape::count % GroupSize == 0);
+
+	using output_shape = InputShape;
+
+	struct params_t;
+
+	static constexpr unsigned count = InputShape::count;
+	static constexpr unsigned groups = count / GroupSize;
+
+	static constexpr float keep = (100 - Percent) / 100.0f;
+	static constexpr float scale = 100.0f / (100 - Percent);
+
+	struct state_t
+	{
+		std::uint32_t mask[(groups + 31) / 32];
+	};
+
+	static void sample(state_t &state, philox &random)
+	{
+		random.fill_bits(state.mask, groups, keep);
+	}
+
+	static float _scale(const state_t &state, const unsigned i)
+	{
+		const unsigned group = i / GroupSize;
+		return static_cast<float>((state.mask[group / 32] >> (group % 32)) & 1u) * scale;
+	}
+
+	// outside of training
+	static void forward(const tensor<InputShape> &input,
+                        tensor<InputShape> &output)
+	{
+		output = input;
+	}
+
+	static void forward(const tensor<InputShape> &input,
+                        tensor<InputShape> &output,
+                        const state_t &state)
+	{
+		const float *in = reinterpret_cast<const float *>(&input);
+		float *out = reinterpret_cast<float *>(&output);
+
+		for (unsigned i = 0; i < count; i++)
+			out[i] = in[i] * _scale(state, i);
+	}
+
+	static void backward(const tensor<InputShape> &input,
+                         const tensor<InputShape> &output,
+                         const state_t &state,
+                         tensor<InputShape> &delta_input,
+                         const tensor<InputShape> &delta_output)
+	{
+		const float *delta_out = reinterpret_cast<const float *>(&delta_output);
+		float *delta_in = reinterpret_cast<float *>(&delta_input);
+
+		for (unsigned i = 0; i < count; i++)
+			delta_in[i] = delta_out[i] * _scale(state, i);
+	}
+};
+
+// drops single values
+template <unsigned Percent>
+struct dropout
+{
+	template <typename InputShape>
+	struct type : _dropout<Percent, InputShape, 1>
+	{
+	};
+};
+
+// drops whole channels (the first dimension) at a time, for after a
+// convolution where neighbouring values are too alike for dropping single
+// ones to do much
+template <unsigned Percent>
+struct spatial_dropout
+{
+	template <typename InputShape>
+	struct type : _dropout<Percent, InputShape, InputShape::next_shape::count>
+	{
+		static_assert(InputShape::dim > 1, "spatial dropout needs channels, use dropout");
+	};
+};
+
+// -----------------------------------------------------------------------------
+
 template <unsigned OutputSize>
 struct fully_connected
 {
@@ -184,10 +361,10 @@ struct fully_connected
 			matrix<InputShape::count, OutputSize> weight;
 			vector<OutputSize> bias;
 
-			void randomise()
+			void randomise(philox &random)
 			{
-				nn::util::randomise(weight) /= InputShape::count;
-				nn::util::randomise(bias);
+				nn::util::randomise(weight, random) /= InputShape::count;
+				nn::util::randomise(bias, random);
 			}
 		};
 
@@ -199,7 +376,7 @@ struct fully_connected
 			output += params.bias;
 		}
 
-		template <typename = std::enable_if_t<InputShape::dim != 1>>
+		template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 		static void forward(const tensor<InputShape> &input,
                             vector<OutputSize> &output,
                             const params_t &params)
@@ -214,20 +391,16 @@ struct fully_connected
                              const vector<OutputSize> &delta_output,
                              params_t &delta_params)
 		{
-			for (unsigned j = 0; j < OutputSize; j++)
-			{
-				// we're ADDING to the values that exist in deltaParams
-				// bc allocating buffers for it would be a expensive.
-				// it'll be zero'd and averaged outside of this function.
-				delta_params.bias[j] += delta_output[j];
-				for (unsigned i = 0; i < InputShape::count; i++)
-					delta_params.weight[i][j] += input[i] * delta_output[j];
-			}
+			// we're ADDING to the values that exist in deltaParams
+			// bc allocating buffers for it would be a expensive.
+			// it'll be zero'd and averaged outside of this function.
+			delta_params.bias += delta_output;
+			math::add_outer(delta_params.weight, input, delta_output);
 
 			math::product(delta_input, params.weight, delta_output);
 		}
 
-		template <typename = std::enable_if_t<InputShape::dim != 1>>
+		template <typename S = InputShape, typename = std::enable_if_t<S::dim != 1>>
 		static void backward(const tensor<InputShape> &input,
                              const vector<OutputSize> &output,
                              const params_t &params,
@@ -241,6 +414,107 @@ struct fully_connected
 	};
 };
 
+// -----------------------------------------------------------------------------
+
+// a table of VocabSize rows of Dim, looked up by id: the input is Count ids
+// (words, items, categories), as floats since that's what tensors hold, and
+// the output is the row for each of them. an id that isn't in the table
+// (negative, VocabSize or more, or nan) gets an extra row after the last of
+// them, out_of_vocabulary, which learns what unknown ids mean without
+// touching a real id's row.
+//
+// a batch only uses a handful of the rows, so this is a sparse layer (see
+// is_sparse_v). trained with an update that takes sparse_rows, a step only
+// costs the rows it touched rather than the whole table, and a table too big
+// for memory can live in a file, see mapped_params.
+template <unsigned VocabSize, unsigned Dim>
+struct embedding
+{
+	static_assert(VocabSize <= (1u << 24), "ids past 2^24 can't be told apart as floats");
+	static_assert(std::uint64_t(VocabSize + 1) * Dim < (std::uint64_t(1) << 32) - 1, "the table has more params than an unsigned can count");
+
+	static constexpr unsigned out_of_vocabulary = VocabSize;
+
+	template <typename InputShape>
+	struct type
+	{
+		static_assert(InputShape::dim == 1, "embedding takes a vector of ids");
+
+		static constexpr unsigned count = InputShape::count;
+
+		using output_shape = shape_t<count, Dim>;
+
+		struct params_t
+		{
+			matrix<VocabSize + 1, Dim> table;
+
+			void randomise(philox &random)
+			{
+				nn::util::randomise(table, random);
+			}
+		};
+
+		// a copy per id, the table itself is never read through
+		static constexpr std::size_t flops = std::size_t(count) * Dim;
+
+		static constexpr unsigned row_size = Dim;
+		static constexpr unsigned rows_per_sample = count;
+
+		static unsigned row(const float id)
+		{
+			return id >= 0.0f && id < VocabSize ? static_cast<unsigned>(id) : out_of_vocabulary;
+		}
+
+		static void rows(const vector<count> &input, std::vector<unsigned> &rows)
+		{
+			for (unsigned i = 0; i < count; i++)
+				rows.push_back(row(input[i]));
+		}
+
+		static void forward(const vector<count> &input,
+                            matrix<count, Dim> &output,
+                            const params_t &params)
+		{
+			for (unsigned i = 0; i < count; i++)
+				output[i] = params.table[row(input[i])];
+		}
+
+		static void backward(const vector<count> &input,
+                             const matrix<count, Dim> &output,
+                             const params_t &params,
+                             vector<count> &delta_input,
+                             const matrix<count, Dim> &delta_output,
+                             params_t &delta_params)
+		{
+			for (unsigned i = 0; i < count; i++)
+				delta_params.table[row(input[i])] += delta_output[i];
+
+			// there's nothing to learn about an id
+			delta_input.zero();
+		}
+
+		// backward into a compact gradient (see sparse_backward), where rows are
+		// the rows the batch used, sorted, and gradient's row k is rows[k]'s
+		static void backward_rows(const vector<count> &input,
+                                  vector<count> &delta_input,
+                                  const matrix<count, Dim> &delta_output,
+                                  const std::vector<unsigned> &rows,
+                                  float *gradient)
+		{
+			for (unsigned i = 0; i < count; i++)
+			{
+				const auto k = std::lower_bound(rows.begin(), rows.end(), row(input[i])) - rows.begin();
+				float *g = gradient + k * Dim;
+
+				for (unsigned j = 0; j < Dim; j++)
+					g[j] += delta_output[i][j];
+			}
+
+			delta_input.zero();
+		}
+	};
+};
+
 namespace pooling_methods
 {
 
@@ -262,9 +536,9 @@ struct max
 	}
 
 	template <unsigned PoolSize, unsigned InputRows, unsigned InputCols>
-	void backward(const float input,
-                   const float output,
-                   const float delta_output)
+	float backward(const float input,
+                    const float output,
+                    const float delta_output)
 	{
 		return input == output ? delta_output : 0.0;
 	}
@@ -287,8 +561,8 @@ struct average
 
 	template <unsigned PoolSize, unsigned InputRows, unsigned InputCols>
 	float backward(const float input,
-                   const float output,
-                   const float delta_output)
+                    const float output,
+                    const float delta_output)
 	{
 		return delta_output / PoolSize / PoolSize;
 	}
@@ -322,7 +596,7 @@ struct pooling
 		{
 			for (unsigned i = 0; i < OutputRows; i++)
 				for (unsigned j = 0; j < OutputCols; j++)
-					output[i][j] = PoolMethod::forward<PoolSize>(input, i*PoolSize, j*PoolSize);
+					output[i][j] = PoolMethod::template forward<PoolSize>(input, i*PoolSize, j*PoolSize);
 		}
 
 		static void backward(const matrix<InputRows, InputCols> &input,
@@ -333,7 +607,7 @@ struct pooling
 			for (unsigned i = 0; i < InputRows; i++)
 				for (unsigned j = 0; j < InputCols; j++)
 					{
-						delta_input[i][j] = PoolMethod::backward<PoolSize>(
+						delta_input[i][j] = PoolMethod::template backward<PoolSize>(
 							input[i][j],
 							output[i / PoolSize][j / PoolSize],
 							delta_output[i / PoolSize][j / PoolSize]
@@ -370,9 +644,9 @@ struct convolution
 		{
 			tensor<shape_t<KernelCount, KernelSize, KernelSize>> kernels;
 
-			void randomise()
+			void randomise(philox &random)
 			{
-				nn::util::randomise(kernels) /= KernelSize * KernelSize;
+				nn::util::randomise(kernels, random) /= KernelSize * KernelSize;
 			}
 		};
 
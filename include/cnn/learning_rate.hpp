@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "plan.hpp"
+
+// learning rates that change over training, and layer-wise adaptive rate
+// scaling (LARS) to go with them, which is what lets the batch size go up
+// into the thousands without the training falling apart.
+//
+// a schedule is anything with float operator()(unsigned step), the rate for
+// that step counting from 0. the ones here are small structs to fill in:
+//
+//     const unsigned steps = EPOCHS * NUM_TRAINING_SAMPLES / BATCH_SIZE;
+//     const nn::warmup<nn::cosine_decay> schedule{ steps / 20, { 2.0f, steps } };
+//
+//     const auto update = [&](auto &gradient)
+//     {
+//         nn::lars_update<MyNetwork>(params, velocity, gradient, schedule(step++));
+//     };
+//
+// a big batch wants a big rate (twice the batch, twice the rate is where to
+// start), and the warmup keeps that from throwing the params all over the
+// place before they've settled.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// the same rate throughout
+struct constant_rate
+{
+	float rate;
+
+	float operator()(unsigned) const
+	{
+		return rate;
+	}
+};
+
+// rate, cut by factor every so many steps. every 0 (as it is if it's left
+// out) never cuts it
+struct step_decay
+{
+	float rate;
+	unsigned every = 0;
+	float factor = 0.1f;
+
+	float operator()(const unsigned step) const
+	{
+		if (every == 0)
+			return rate;
+
+		return rate * std::pow(factor, static_cast<float>(step / every));
+	}
+};
+
+// rate down to floor along half a cosine over steps, floor after that
+struct cosine_decay
+{
+	float rate;
+	unsigned steps;
+	float floor = 0.0f;
+
+	float operator()(const unsigned step) const
+	{
+		if (step >= steps)
+			return floor;
+
+		const float t = static_cast<float>(step) / steps;
+		return floor + (rate - floor) * 0.5f * (1.0f + std::cos(3.14159265f * t));
+	}
+};
+
+// up from peak / 25 to peak over the first rising part of steps, then down
+// to peak / 10000 over the rest, both along half a cosine (smith's one-cycle)
+struct one_cycle
+{
+	float peak;
+	unsigned steps;
+	float rising = 0.3f;
+
+	float operator()(const unsigned step) const
+	{
+		const float start = peak / 25.0f, end = peak / 10000.0f;
+		const unsigned top = std::max(1u, static_cast<unsigned>(rising * steps));
+
+		if (step < top)
+			return cosine_decay{ start - peak, top }(step) + peak;
+
+		return cosine_decay{ peak, steps - top, end }(step - top);
+	}
+};
+
+// ramps whatever schedule's rate is up from nothing over the first steps
+template <typename Schedule>
+struct warmup
+{
+	unsigned steps;
+	Schedule schedule;
+
+	float operator()(const unsigned step) const
+	{
+		const float rate = schedule(step);
+		return step < steps ? rate * (step + 1) / steps : rate;
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+struct lars_options
+{
+	float momentum = 0.9f;
+
+	// added to the gradient as weight_decay * params
+	float weight_decay = 0.0f;
+
+	// how far a step moves a layer's params, relative to how big they are,
+	// at a rate of 1
+	float trust = 0.001f;
+};
+
+// sgd with momentum, with every layer's step scaled to the size of its params
+// rather than its gradient, so that a layer with a small gradient (the ones
+// at the start, mostly) learns at the same pace as the rest. a layer whose
+// params or gradient are all zero (e.g. straight after zeroing the params)
+// gets the plain rate. gradient is left with the decay added in.
+template <typename NetworkType>
+void lars_update(params_t<NetworkType> &params,
+                 params_t<NetworkType> &velocity,
+                 params_t<NetworkType> &gradient,
+                 const float rate,
+                 const lars_options &options = lars_options())
+{
+	constexpr auto offsets = param_offsets_v<NetworkType>;
+
+	for (unsigned l = 0; l < layer_count_v<NetworkType>; l++)
+	{
+		const unsigned first = offsets[l], last = offsets[l + 1];
+
+		double params_norm = 0.0, gradient_norm = 0.0;
+		for (unsigned i = first; i < last; i++)
+		{
+			gradient[i] += options.weight_decay * params[i];
+
+			params_norm += static_cast<double>(params[i]) * params[i];
+			gradient_norm += static_cast<double>(gradient[i]) * gradient[i];
+		}
+
+		float local = 1.0f;
+		if (params_norm > 0.0 && gradient_norm > 0.0)
+			local = static_cast<float>(options.trust * std::sqrt(params_norm / gradient_norm));
+
+		const float scale = rate * local;
+		for (unsigned i = first; i < last; i++)
+		{
+			velocity[i] = options.momentum * velocity[i] + scale * gradient[i];
+			params[i] -= velocity[i];
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+// sgd with momentum on a sparse gradient (see train_step): only what the
+// rows say has a gradient moves, velocity and all. an embedding row nobody
+// used this step keeps its velocity for the next step that uses it rather
+// than coasting on it, which is the usual (lazy) way to train a big table
+// and the only way that costs the rows touched rather than the whole table.
+// velocity is as big as params though, so for a table that won't fit twice
+// map it too (see mapped_params) or use sparse_sgd_update.
+template <typename NetworkType, unsigned GradientSize>
+void sparse_momentum_update(params_t<NetworkType> &params,
+                            params_t<NetworkType> &velocity,
+                            const vector<GradientSize> &gradient,
+                            const sparse_rows<NetworkType> &rows,
+                            const float rate,
+                            const float momentum = 0.9f)
+{
+	rows.for_each_range([&](const unsigned first, const unsigned from, const unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+		{
+			velocity[first + i] = momentum * velocity[first + i] + rate * gradient[from + i];
+			params[first + i] -= velocity[first + i];
+		}
+	});
+}
+
+// plain sgd on a sparse gradient, which needs nothing the size of params
+template <typename NetworkType, unsigned GradientSize>
+void sparse_sgd_update(params_t<NetworkType> &params,
+                       const vector<GradientSize> &gradient,
+                       const sparse_rows<NetworkType> &rows,
+                       const float rate)
+{
+	rows.for_each_range([&](const unsigned first, const unsigned from, const unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+			params[first + i] -= rate * gradient[from + i];
+	});
+}
+
+} // nn
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "network.hpp"
+
+// a network's params kept in a file and mapped into memory rather than read
+// in, for when they're mostly one big embedding table (see layers::embedding)
+// that's more than there's memory for, or that several processes want to
+// share. the os pages in the rows that get used and writes back the ones
+// that change, so a sparse training step (see sparse_rows) only ever touches
+// the rows in its batch:
+//
+//     nn::mapped_params<MyNetwork> params("table.bin");
+//     nn::mapped_params<MyNetwork> velocity("table.velocity.bin");
+//
+//     if (!params.is_open() || !velocity.is_open())
+//         return 1;
+//
+//     nn::arena scratch{ nn::sparse_step_arena_size_v<BATCH_SIZE, MyNetwork> };
+//
+//     nn::train_step<Cost, BATCH_SIZE, MyNetwork>(scratch, params.params(), fill_batch,
+//         [&](auto &gradient, const auto &rows)
+//         {
+//             nn::sparse_momentum_update<MyNetwork>(params.params(), velocity.params(), gradient, rows, rate);
+//         });
+//
+// the file is the same raw floats as util::save writes, so either can read
+// what the other wrote. a file that's too short (or isn't there) is made up to
+// size with zeros, randomise_params the params if it's new.
+
+namespace nn
+{
+
+template <typename NetworkType>
+class mapped_params
+{
+public:
+	static constexpr std::size_t size = sizeof(params_t<NetworkType>);
+
+	mapped_params() = default;
+
+	// read_only maps it copy on write, so the params can still be changed but
+	// the changes never reach the file
+	explicit mapped_params(const char *filename, const bool read_only = false)
+	{
+		open(filename, read_only);
+	}
+
+	mapped_params(const mapped_params &) = delete;
+	mapped_params &operator=(const mapped_params &) = delete;
+
+	mapped_params(mapped_params &&other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	mapped_params &operator=(mapped_params &&other) noexcept
+	{
+		std::swap(base, other.base);
+#if defined(_WIN32)
+		std::swap(file, other.file);
+		std::swap(mapping, other.mapping);
+#endif
+		return *this;
+	}
+
+	~mapped_params()
+	{
+		close();
+	}
+
+	// false if the file can't be opened, made big enough or mapped, in which
+	// case nothing's mapped
+	bool open(const char *filename, const bool read_only = false)
+	{
+		close();
+
+#if defined(_WIN32)
+		file = CreateFileA(filename, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+		                   FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		                   read_only ? OPEN_EXISTING : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || (read_only && static_cast<std::size_t>(file_size.QuadPart) < size))
+			return close(), false;
+
+		// a mapping bigger than the file makes the file that big, zeros and all
+		const DWORD protection = read_only ? PAGE_WRITECOPY : PAGE_READWRITE;
+		mapping = CreateFileMappingA(file, nullptr, protection,
+		                             static_cast<DWORD>(static_cast<unsigned long long>(size) >> 32),
+		                             static_cast<DWORD>(size & 0xffffffffu), nullptr);
+		if (!mapping)
+			return close(), false;
+
+		base = MapViewOfFile(mapping, read_only ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, size);
+		if (!base)
+			return close(), false;
+
+		return true;
+#elif defined(__unix__) || defined(__APPLE__)
+		const int fd = ::open(filename, read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+			return false;
+
+		struct stat status;
+		bool sized = fstat(fd, &status) == 0;
+
+		if (sized && static_cast<std::size_t>(status.st_size) < size)
+			sized = !read_only && ftruncate(fd, static_cast<off_t>(size)) == 0;
+
+		void *p = MAP_FAILED;
+		if (sized)
+			p = mmap(nullptr, size, PROT_READ | PROT_WRITE, read_only ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+
+		// the mapping keeps the file open
+		::close(fd);
+
+		if (p == MAP_FAILED)
+			return false;
+
+		base = p;
+		return true;
+#else
+		(void)filename;
+		(void)read_only;
+		return false;
+#endif
+	}
+
+	bool is_open() const { return base != nullptr; }
+
+	params_t<NetworkType> &params() { return *static_cast<params_t<NetworkType> *>(base); }
+	const params_t<NetworkType> &params() const { return *static_cast<const params_t<NetworkType> *>(base); }
+
+	// writes whatever's changed back to the file now rather than whenever the
+	// os gets round to it, e.g. at the end of an epoch
+	bool flush()
+	{
+		if (!base)
+			return false;
+
+#if defined(_WIN32)
+		return FlushViewOfFile(base, 0) && FlushFileBuffers(file);
+#elif defined(__unix__) || defined(__APPLE__)
+		return msync(base, size, MS_SYNC) == 0;
+#else
+		return false;
+#endif
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#elif defined(__unix__) || defined(__APPLE__)
+		if (base)
+			munmap(base, size);
+#endif
+
+		base = nullptr;
+	}
+
+private:
+	void *base = nullptr;
+
+#if defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+} // nn
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <memory>
+#include <utility>
+
 #include "tensor.hpp"
+#include "target.hpp"
+#include "tuning.hpp"
 
 namespace nn
 {
@@ -8,7 +14,124 @@ namespace nn
 namespace math
 {
 
-float kdelta(unsigned i, unsigned j)
+// -----------------------------------------------------------------------------
+
+// every size is known at compile time, so the kernels below pick their shape
+// with if constexpr:
+//
+//   - up to unroll_limit the loop is unrolled away entirely, as a fold over an
+//     index_sequence, so a fully_connected<10> never runs a loop counter over
+//     its outputs
+//   - past that the running sums are one block of locals that the compiler
+//     keeps in registers while the inputs stream past, a block at a time.
+//     how big a block is up to the tuning cache, see tuning.hpp
+constexpr unsigned unroll_limit = 16;
+
+// y[0, M) += a * x[0, M)
+template <std::size_t... Ms>
+NN_KERNEL_INLINE void _axpy(float *y, const float a, const float *x, std::index_sequence<Ms...>)
+{
+	((y[Ms] += a * x[Ms]), ...);
+}
+
+template <unsigned M>
+NN_KERNEL_INLINE void _axpy(float *y, const float a, const float *x)
+{
+	if constexpr(M <= unroll_limit)
+	{
+		_axpy(y, a, x, std::make_index_sequence<M>());
+	}
+	else
+	{
+		for (unsigned m = 0; m < M; m++)
+			y[m] += a * x[m];
+	}
+}
+
+// y[0, M) += a[0, M) * x[0, M)
+template <std::size_t... Ms>
+NN_KERNEL_INLINE void _multiply_add(float *y, const float *a, const float *x, std::index_sequence<Ms...>)
+{
+	((y[Ms] += a[Ms] * x[Ms]), ...);
+}
+
+// the sum of a[i] * b[i]. short ones are added up pairwise, longer ones in 16
+// running sums that vectorise, rather than in one long chain of dependent adds.
+// 16 is a whole number of registers at every width up to avx-512, so every
+// instruction set adds up in the same order and gets the same answer (with
+// 8, gcc -O3 splits them across a zmm with shuffles and runs 8x slower).
+// they're a fold rather than a loop so that -O2 keeps them in registers too
+template <unsigned M>
+NN_KERNEL_INLINE float _dot(const float *a, const float *b)
+{
+	if constexpr(M == 1)
+	{
+		return a[0] * b[0];
+	}
+	else if constexpr(M <= unroll_limit)
+	{
+		return _dot<M / 2>(a, b) + _dot<M - M / 2>(a + M / 2, b + M / 2);
+	}
+	else
+	{
+		float sums[16] = {};
+		for (unsigned m = 0; m + 16 <= M; m += 16)
+			_multiply_add(sums, a + m, b + m, std::make_index_sequence<16>());
+
+		for (unsigned j = 0; j < 8; j++)
+			sums[j] += sums[j + 8];
+
+		float v = ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+		if constexpr(M % 16 != 0)
+			v += _dot<M % 16>(a + M - M % 16, b + M - M % 16);
+
+		return v;
+	}
+}
+
+// Block columns of lhs * rhs, starting at column first
+template <unsigned Block, unsigned N, unsigned M>
+NN_KERNEL_INLINE void _product_block(float *result, const vector<N> &lhs, const matrix<N, M> &rhs, const unsigned first)
+{
+	const float *rows = reinterpret_cast<const float *>(&rhs) + first;
+
+	if constexpr(Block <= unroll_limit)
+	{
+		float sums[Block] = {};
+		for (unsigned n = 0; n < N; n++)
+			_axpy(sums, lhs[n], rows + n * M, std::make_index_sequence<Block>());
+
+		for (unsigned m = 0; m < Block; m++)
+			result[first + m] = sums[m];
+	}
+	else
+	{
+		// rounded up to a whole number of simd registers, so that the loop
+		// over the sums vectorises without a scalar tail. the extra sums read
+		// the start of the next row and get thrown away, only the last row has
+		// to stop short.
+		constexpr unsigned Padded = (Block + 7) / 8 * 8;
+
+		float sums[Padded] = {};
+		for (unsigned n = 0; n + 1 < N; n++)
+		{
+			const float a = lhs[n];
+			const float *row = rows + n * M;
+
+			for (unsigned m = 0; m < Padded; m++)
+				sums[m] += a * row[m];
+		}
+
+		_axpy<Block>(sums, lhs[N - 1], rows + (N - 1) * M);
+
+		for (unsigned m = 0; m < Block; m++)
+			result[first + m] = sums[m];
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+inline float kdelta(unsigned i, unsigned j)
 {
 	return i == j ? 1.0f : 0.0f;
 }
@@ -48,46 +171,96 @@ float min(const vector<N> &values)
 template <unsigned N>
 float dot(const vector<N> &a, const vector<N> &b)
 {
-	float v = 0.0;
-	for (unsigned n = 0; n < N; n++)
-		v += a[n] * b[n];
-	return v;
+	return _dot<N>(a.data(), b.data());
 }
 
+// rows of rhs scaled by lhs and added up, Block columns at a time, rather than
+// a dot product down every column of rhs, so rhs is read in order
+template <unsigned Block, unsigned N, unsigned M>
+NN_KERNEL void _product_columns(vector<M> &result, const vector<N> &lhs, const matrix<N, M> &rhs)
+{
+	if constexpr(M <= Block)
+	{
+		_product_block<M>(result.data(), lhs, rhs, 0);
+	}
+	else
+	{
+		for (unsigned m = 0; m + Block <= M; m += Block)
+			_product_block<Block>(result.data(), lhs, rhs, m);
+
+		if constexpr(M % Block != 0)
+			_product_block<M % Block>(result.data(), lhs, rhs, M - M % Block);
+	}
+}
+
+template <unsigned Block, unsigned N, unsigned M>
+void _product_tiled(vector<M> &result, const vector<N> &lhs, const matrix<N, M> &rhs)
+{
+	// blocks wider than the matrix are all the same kernel
+	_product_columns<(Block < M ? Block : M)>(result, lhs, rhs);
+}
+
+// with the given block size, for the autotuner
 template <unsigned N, unsigned M>
-auto product(vector<M> &result, const vector<N> &lhs, const matrix<N, M> &rhs) -> decltype(result)
+void product(vector<M> &result, const vector<N> &lhs, const matrix<N, M> &rhs, const unsigned block)
 {
-	for (unsigned m = 0; m < M; m++)
+	switch (block)
 	{
-		float &v = result[m] = 0.0f;
-		for (unsigned n = 0; n < N; n++)
-			v += lhs[n] * rhs[n][m];
+	case 16: _product_tiled<16>(result, lhs, rhs); break;
+	case 32: _product_tiled<32>(result, lhs, rhs); break;
+	case 128: _product_tiled<128>(result, lhs, rhs); break;
+	default: _product_tiled<64>(result, lhs, rhs); break;
 	}
+}
+
+// how long a block size takes, for the autotuner to pick between
+template <unsigned N, unsigned M>
+double _time_vec_mat(const unsigned block, const double seconds)
+{
+	auto result = std::make_unique<vector<M>>();
+	auto lhs = std::make_unique<vector<N>>();
+	auto rhs = std::make_unique<matrix<N, M>>();
+
+	*lhs = 0.5f;
+	*rhs = 0.5f;
+
+	return tuning::time_calls([&] { product(*result, *lhs, *rhs, block); }, seconds);
+}
+
+// the block size comes out of the tuning cache, see tuning.hpp. shapes too
+// small for it to matter don't look
+template <unsigned N, unsigned M>
+auto product(vector<M> &result, const vector<N> &lhs, const matrix<N, M> &rhs) -> decltype(result)
+{
+	if constexpr(M <= unroll_limit)
+		_product_columns<M>(result, lhs, rhs);
+	else
+		product(result, lhs, rhs, tuning::block<N, M>(&_time_vec_mat<N, M>));
 	return result;
 }
 
 template <unsigned N, unsigned M>
-auto product(vector<N> &result, const matrix<N, M> &lhs, const vector<M> &rhs) -> decltype(result)
+NN_KERNEL auto product(vector<N> &result, const matrix<N, M> &lhs, const vector<M> &rhs) -> decltype(result)
 {
 	for (unsigned n = 0; n < N; n++)
-	{
-		float &v = result[n] = 0.0f;
-		for (unsigned m = 0; m < M; m++)
-			v += lhs[n][m] * rhs[m];
-	}
+		result[n] = _dot<M>(lhs[n].data(), rhs.data());
 	return result;
 }
 
-template <int I, int J, int K>
+template <unsigned I, unsigned J, unsigned K>
 auto product(matrix<I, J> &result, const matrix<I, K> &lhs, const matrix<K, J> &rhs) -> decltype(result)
 {
 	for (unsigned i = 0; i < I; i++)
-		for (unsigned j = 0; j < J; j++)
-		{
-			float &v = result[i][j] = 0.0f;
-			for (unsigned k = 0; k < K; k++)
-				v += lhs[i][k] * rhs[k][j];
-		}
+		product(result[i], lhs[i], rhs);
+	return result;
+}
+
+// result += lhs * rhs transposed, i.e. result[n][m] += lhs[n] * rhs[m]
+template <unsigned N, unsigned M>
+NN_KERNEL auto add_outer(matrix<N, M> &result, const vector<N> &lhs, const vector<M> &rhs) -> decltype(result)
+{
+	for (unsigned n = 0; n < N; n++)
+		_axpy<M>(result[n].data(), lhs[n], rhs.data());
 	return result;
 }
 
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+
+#include "parallel.hpp"
+
+// evaluating a classifier on a test set without holding the test set's
+// activations. the set is streamed through the network a chunk at a time on
+// however many threads, and everything that's measured is a running count
+// that gets added to as chunks come back, so the memory used is a workspace
+// per thread whatever the size of the test set.
+//
+//     auto result = nn::evaluate<100, MyNetwork>(params, NUM_TEST_SAMPLES,
+//         [&](unsigned first, unsigned count, auto &input, auto &expectation) { ... });
+//
+//     printf("%.2f%% top-1, %.2f%% top-3\n", 100 * result.accuracy(), 100 * result.top_k(3));
+//
+// the network's output is taken to be class probabilities (i.e. it ends in a
+// softmax) for the log-loss, the rest only care about which class is highest.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+template <unsigned Classes>
+class metrics
+{
+public:
+	static constexpr unsigned classes = Classes;
+
+	// the expectation's highest class is the label, so one-hot expectations
+	// work as they are
+	void add(const vector<Classes> &prediction, const vector<Classes> &expectation)
+	{
+		add(prediction, math::argmax(expectation));
+	}
+
+	void add(const vector<Classes> &prediction, const unsigned label)
+	{
+		const unsigned predicted = math::argmax(prediction);
+		const float p = prediction[label];
+
+		// how many classes beat the right one, so top_k can be had for any k
+		unsigned rank = 0;
+		for (unsigned c = 0; c < Classes; c++)
+			if (prediction[c] > p)
+				rank++;
+
+		samples++;
+		confusion_[label][predicted]++;
+		ranks[rank]++;
+		log_loss_sum -= std::log(std::max(static_cast<double>(p), 1e-15));
+	}
+
+	template <unsigned N>
+	void add(const matrix<N, Classes> &prediction, const matrix<N, Classes> &expectation, const unsigned count = N)
+	{
+		for (unsigned n = 0; n < count; n++)
+			add(prediction[n], expectation[n]);
+	}
+
+	metrics &operator+=(const metrics &other)
+	{
+		samples += other.samples;
+		for (unsigned i = 0; i < Classes; i++)
+		{
+			for (unsigned j = 0; j < Classes; j++)
+				confusion_[i][j] += other.confusion_[i][j];
+			ranks[i] += other.ranks[i];
+		}
+		log_loss_sum += other.log_loss_sum;
+		return *this;
+	}
+
+	std::uint64_t count() const { return samples; }
+
+	// how many samples of class expected were classified as predicted
+	std::uint64_t confusion(const unsigned expected, const unsigned predicted) const
+	{
+		return confusion_[expected][predicted];
+	}
+
+	// the rest are all fractions, 0 if there's nothing to go on
+
+	float accuracy() const
+	{
+		std::uint64_t correct = 0;
+		for (unsigned c = 0; c < Classes; c++)
+			correct += confusion_[c][c];
+		return _ratio(correct, samples);
+	}
+
+	// how often the right class was in the k highest. ties go the right
+	// class's way.
+	float top_k(const unsigned k) const
+	{
+		std::uint64_t correct = 0;
+		for (unsigned r = 0; r < std::min(k, Classes); r++)
+			correct += ranks[r];
+		return _ratio(correct, samples);
+	}
+
+	// of the samples classified as c, how many were c
+	float precision(const unsigned c) const
+	{
+		std::uint64_t predicted = 0;
+		for (unsigned e = 0; e < Classes; e++)
+			predicted += confusion_[e][c];
+		return _ratio(confusion_[c][c], predicted);
+	}
+
+	// of the samples that were c, how many were classified as c
+	float recall(const unsigned c) const
+	{
+		std::uint64_t expected = 0;
+		for (unsigned p = 0; p < Classes; p++)
+			expected += confusion_[c][p];
+		return _ratio(confusion_[c][c], expected);
+	}
+
+	float f1(const unsigned c) const
+	{
+		const float p = precision(c), r = recall(c);
+		return p + r > 0.0f ? 2.0f * p * r / (p + r) : 0.0f;
+	}
+
+	// mean cross entropy of the right class, in nats
+	float log_loss() const
+	{
+		return samples ? static_cast<float>(log_loss_sum / samples) : 0.0f;
+	}
+
+private:
+	static float _ratio(const std::uint64_t n, const std::uint64_t d)
+	{
+		return d ? static_cast<float>(static_cast<double>(n) / d) : 0.0f;
+	}
+
+	std::uint64_t samples = 0;
+	std::uint64_t confusion_[Classes][Classes] = {};
+	std::uint64_t ranks[Classes] = {};
+	double log_loss_sum = 0.0;
+};
+
+template <typename NetworkType>
+using metrics_t = metrics<NetworkType::output_shape::count>;
+
+// -----------------------------------------------------------------------------
+
+// scratch for one evaluating thread
+template <unsigned Chunk, typename NetworkType>
+constexpr std::size_t evaluate_arena_size_v =
+	sizeof(workspace_t<Chunk, NetworkType, false>) +
+	sizeof(output_t<Chunk, NetworkType>) +
+	2 * arena::default_alignment;
+
+// runs sample_count samples through the network Chunk at a time and measures
+// how it did. fill_chunk(first, count, input, expectation) fills in the first
+// count samples of a chunk with samples first onwards; the last chunk can be
+// short. it's called from several threads at once, for different chunks.
+//
+// threads = 0 uses every cpu. the result doesn't depend on how many threads
+// there were, besides the last few bits of the log-loss.
+template <unsigned Chunk, typename NetworkType, typename FillChunk>
+auto evaluate(const params_t<NetworkType> &params,
+              const unsigned sample_count,
+              FillChunk &&fill_chunk,
+              unsigned threads = 0) -> metrics_t<NetworkType>
+{
+	static_assert(NetworkType::output_shape::dim == 1, "only classifiers can be evaluated");
+
+	const unsigned chunk_count = (sample_count + Chunk - 1) / Chunk;
+
+	metrics_t<NetworkType> total;
+	std::mutex total_mutex;
+
+	_for_each_chunk(chunk_count, threads, [&](const auto &next)
+	{
+		arena scratch(evaluate_arena_size_v<Chunk, NetworkType>);
+		auto &work = make_workspace<Chunk, NetworkType, false>(scratch);
+		auto &expectation = scratch.make<output_t<Chunk, NetworkType>>();
+
+		metrics_t<NetworkType> local;
+
+		for (std::size_t chunk; (chunk = next()) < chunk_count; )
+		{
+			const unsigned first = static_cast<unsigned>(chunk) * Chunk;
+			const unsigned count = std::min(Chunk, sample_count - first);
+
+			fill_chunk(first, count, work.input(), expectation);
+			local.add(forward(work, params, count), expectation, count);
+		}
+
+		std::lock_guard<std::mutex> lock(total_mutex);
+		total += local;
+	});
+
+	return total;
+}
+
+} // nn
@@ -1,4 +1,11 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
 #include <type_traits>
+#include <vector>
 
 #include "tensor.hpp"
 #include "util.hpp"
@@ -19,21 +26,105 @@ constexpr bool is_type_complete_v<T, std::void_t<decltype(sizeof(T))>> = true;
 // -----------------------------------------------------------------------------
 
 template<typename LayerType>
-constexpr bool has_params_v = is_type_complete_v<LayerType::params_t>;
+constexpr bool has_params_v = is_type_complete_v<typename LayerType::params_t>;
 
 template<typename LayerType, typename = void>
 constexpr unsigned layer_param_count_v = 0;
 
 template<typename LayerType>
-constexpr unsigned layer_param_count_v<LayerType, std::enable_if_t<has_params_v<LayerType>>> = sizeof(LayerType::params_t) / sizeof(float);
+constexpr unsigned layer_param_count_v<LayerType, std::enable_if_t<has_params_v<LayerType>>> = sizeof(typename LayerType::params_t) / sizeof(float);
 
 // -----------------------------------------------------------------------------
 
 template<typename NetworkType, typename = void>
-constexpr unsigned param_count_v = layer_param_count_v<NetworkType::layer>;
+constexpr std::uint64_t _param_count_v = layer_param_count_v<typename NetworkType::layer>;
+
+template<typename NetworkType>
+constexpr std::uint64_t _param_count_v<NetworkType, std::enable_if_t<!NetworkType::is_final_layer>> = layer_param_count_v<typename NetworkType::layer> + _param_count_v<typename NetworkType::next_network_t>;
+
+// summed wide so that a network too big for the unsigned counts (params_t has
+// one more than this) stops here rather than wrapping round to something small
+template<typename NetworkType>
+struct _param_count
+{
+	static_assert(_param_count_v<NetworkType> < (std::uint64_t(1) << 32) - 1, "the network has more params than an unsigned can count");
+	static constexpr unsigned value = static_cast<unsigned>(_param_count_v<NetworkType>);
+};
+
+template<typename NetworkType>
+constexpr unsigned param_count_v = _param_count<NetworkType>::value;
+
+// the network's shape as text, the input's size, every layer's output size
+// and the param count, like 784-300-300-100-100-10-10:266610. two networks
+// with the same signature are alike enough to be tuned alike, see tuning.hpp
+template <typename NetworkType>
+std::string _layer_sizes()
+{
+	std::string sizes = "-" + std::to_string(NetworkType::layer::output_shape::count);
+	if constexpr(!NetworkType::is_final_layer)
+		sizes += _layer_sizes<typename NetworkType::next_network_t>();
+	return sizes;
+}
+
+template <typename NetworkType>
+std::string signature()
+{
+	return std::to_string(NetworkType::input_shape::count) + _layer_sizes<NetworkType>() + ":" + std::to_string(param_count_v<NetworkType>);
+}
+
+// -----------------------------------------------------------------------------
+
+// a layer that needs something kept per sample from its forward to its
+// backward (dropout's mask, a recurrent layer's activations at every
+// timestep) says so with a complete state_t, which gets passed to forward and
+// backward in training. if the state's random the layer also has
+// sample(state, random), which makes it before each training forward. outside
+// of training there's no state, and the layer's forward without one is called
+// instead. layers without state_t, or with it left incomplete, have no state.
+
+template<typename LayerType, typename = void>
+constexpr bool has_state_v = false;
+
+template<typename LayerType>
+constexpr bool has_state_v<LayerType, std::void_t<decltype(sizeof(typename LayerType::state_t))>> = true;
+
+template<typename LayerType, typename = void>
+constexpr bool has_sample_v = false;
+
+template<typename LayerType>
+constexpr bool has_sample_v<LayerType, std::void_t<decltype(&LayerType::sample)>> = true;
+
+struct no_state {};
+
+// a batch's worth of a layer's state
+template <unsigned N, typename LayerType, typename = void>
+struct layer_states
+{
+	using type = no_state;
+};
+
+template <unsigned N, typename LayerType>
+struct layer_states<N, LayerType, std::enable_if_t<has_state_v<LayerType>>>
+{
+	using type = std::array<typename LayerType::state_t, N>;
+};
+
+template <unsigned N, typename LayerType>
+using layer_states_t = typename layer_states<N, LayerType>::type;
+
+// whether any layer has state, i.e. training needs the training forward
+template<typename NetworkType, typename = void>
+constexpr bool is_stateful_v = has_state_v<typename NetworkType::layer>;
+
+template<typename NetworkType>
+constexpr bool is_stateful_v<NetworkType, std::enable_if_t<!NetworkType::is_final_layer>> = has_state_v<typename NetworkType::layer> || is_stateful_v<typename NetworkType::next_network_t>;
+
+// whether any layer samples its state, i.e. training needs random numbers
+template<typename NetworkType, typename = void>
+constexpr bool is_stochastic_v = has_sample_v<typename NetworkType::layer>;
 
 template<typename NetworkType>
-constexpr unsigned param_count_v<NetworkType, std::enable_if_t<!NetworkType::is_final_layer>> = layer_param_count_v<NetworkType::layer> + param_count_v<NetworkType::next_network_t>;
+constexpr bool is_stochastic_v<NetworkType, std::enable_if_t<!NetworkType::is_final_layer>> = has_sample_v<typename NetworkType::layer> || is_stochastic_v<typename NetworkType::next_network_t>;
 
 // -----------------------------------------------------------------------------
 
@@ -51,6 +142,7 @@ struct network_t<InputShape, LayerType>
 {
 	static constexpr bool is_final_layer = true;
 
+	using input_shape = InputShape;
 	using layer = LayerType<InputShape>;
 
 	using output_shape = typename layer::output_shape;
@@ -66,6 +158,7 @@ struct network_t<InputShape, LayerType, NextLayerType, RestLayerTypes...>
 {
 	static constexpr bool is_final_layer = false;
 
+	using input_shape = InputShape;
 	using layer = LayerType<InputShape>;
 
 	using next_network_t = network_t<typename layer::output_shape, NextLayerType, RestLayerTypes...>;
@@ -88,6 +181,8 @@ struct forward_t<N, network_t<InputShape, LayerType>>
 	vector_of<N, InputShape> input;
 	vector_of<N, typename LayerType<InputShape>::output_shape> output;
 
+	layer_states_t<N, LayerType<InputShape>> state;
+
 	auto &get_next() { return output; }
 	const auto &get_next() const { return output; }
 
@@ -106,6 +201,8 @@ struct forward_t<N, network_t<InputShape, LayerType, NextLayerType, RestLayerTyp
 {
 	vector_of<N, InputShape> input;
 
+	layer_states_t<N, LayerType<InputShape>> state;
+
 	forward_t<N, network_t<typename LayerType<InputShape>::output_shape, NextLayerType, RestLayerTypes...>> next;
 
 	auto &get_next() { return next.input; }
@@ -123,39 +220,154 @@ using output_t = vector_of<N, typename NetworkType::output_shape>;
 template <typename NetworkType>
 using params_t = vector<param_count_v<NetworkType> + 1>;
 
+// what a batch's expectation is, which is just what the network should have
+// output unless the cost function wants something else, in which case it has
+// an expectation_shape<OutputShape> (see cost_functions::distillation).
+// CostFunctionType can be void, for the default.
+template <typename CostFunctionType, typename OutputShape, typename = void>
+struct _expectation_shape
+{
+	using type = OutputShape;
+};
+
+template <typename CostFunctionType, typename OutputShape>
+struct _expectation_shape<CostFunctionType, OutputShape, std::void_t<typename CostFunctionType::template expectation_shape<OutputShape>>>
+{
+	using type = typename CostFunctionType::template expectation_shape<OutputShape>;
+};
+
+template <unsigned N, typename CostFunctionType, typename NetworkType>
+using expectation_t = vector_of<N, typename _expectation_shape<CostFunctionType, typename NetworkType::output_shape>::type>;
+
 // -----------------------------------------------------------------------------
 
-// params should randomise themselves, as suitable param ranges will vary
+// params should randomise themselves, as suitable param ranges will vary.
+// every layer gets its own stream of the seed, so a layer's params don't
+// change when the layers before it do. the streams from params_stream up are
+// the params', use the ones below for anything else off the same seed.
+constexpr std::uint64_t params_stream = 1ull << 48;
+
 template <typename NetworkType>
-void randomise_params(params_t<NetworkType> &params)
+void _randomise_params(params_t<NetworkType> &params, const std::uint64_t seed, const unsigned layer)
 {
-	if constexpr(has_params_v<NetworkType::layer>)
-		reinterpret_cast<typename NetworkType::layer::params_t &>(params).randomise();
+	if constexpr(has_params_v<typename NetworkType::layer>)
+	{
+		philox random(seed, params_stream + layer);
+		reinterpret_cast<typename NetworkType::layer::params_t &>(params).randomise(random);
+	}
 	if constexpr(!NetworkType::is_final_layer)
-		randomise_params<NetworkType::next_network_t>(params.offset<layer_param_count_v<NetworkType::layer>>());
+		_randomise_params<typename NetworkType::next_network_t>(params.template offset<layer_param_count_v<typename NetworkType::layer>>(), seed, layer + 1);
+}
+
+template <typename NetworkType>
+void randomise_params(params_t<NetworkType> &params, const std::uint64_t seed = philox::default_seed)
+{
+	_randomise_params<NetworkType>(params, seed, 0);
 }
 
 // -----------------------------------------------------------------------------
 
+// runs a single layer (the first layer of NetworkType) over a batch. forward
+// and backward are built out of these so that anything else that walks a
+// network (see plan.hpp) calls the layers in exactly the same way. forward
+// can be told to only do the first count samples, for a batch that isn't full.
+// layers with state run their inference forward unless there's a generator
+// to sample their state with.
+
+template <typename NetworkType, unsigned N>
+void forward_layer(const vector_of<N, typename NetworkType::input_shape> &input,
+                   vector_of<N, typename NetworkType::layer::output_shape> &output,
+                   const params_t<NetworkType> &params,
+                   const unsigned count = N)
+{
+	using layer = typename NetworkType::layer;
+
+	if constexpr(has_params_v<layer>)
+	{
+		const auto &layer_params = reinterpret_cast<const typename layer::params_t &>(params);
+
+		for (unsigned n = 0; n < count; n++)
+			layer::forward(input[n], output[n], layer_params);
+	}
+	else
+	{
+		for (unsigned n = 0; n < count; n++)
+			layer::forward(input[n], output[n]);
+	}
+}
+
+template <typename NetworkType, unsigned N>
+void forward_layer(const vector_of<N, typename NetworkType::input_shape> &input,
+                   vector_of<N, typename NetworkType::layer::output_shape> &output,
+                   layer_states_t<N, typename NetworkType::layer> &states,
+                   const params_t<NetworkType> &params,
+                   philox &random,
+                   const unsigned count = N)
+{
+	using layer = typename NetworkType::layer;
+
+	if constexpr(!has_state_v<layer>)
+	{
+		forward_layer<NetworkType, N>(input, output, params, count);
+	}
+	else
+	{
+		if constexpr(has_sample_v<layer>)
+		{
+			for (unsigned n = 0; n < count; n++)
+				layer::sample(states[n], random);
+		}
+
+		if constexpr(has_params_v<layer>)
+		{
+			const auto &layer_params = reinterpret_cast<const typename layer::params_t &>(params);
+
+			for (unsigned n = 0; n < count; n++)
+				layer::forward(input[n], output[n], states[n], layer_params);
+		}
+		else
+		{
+			for (unsigned n = 0; n < count; n++)
+				layer::forward(input[n], output[n], states[n]);
+		}
+	}
+}
+
+// the inference pass. a stateful network with no random layers (a recurrent
+// one) gets the training pass instead, which comes out the same but leaves
+// its state for backward. a network with random layers has to be given a
+// generator, or run through an inference workspace (plan.hpp), since without
+// one backward would go by whatever state the last training pass left.
 template <unsigned N, typename NetworkType>
 auto forward(forward_t<N, NetworkType> &fwd,
              const params_t<NetworkType> &params) -> const output_t<N, NetworkType> &
 {
-	if constexpr(has_params_v<NetworkType::layer>)
-	{
-		const auto &layer_params = reinterpret_cast<const NetworkType::layer::params_t &>(params);
+	static_assert(!is_stochastic_v<NetworkType>, "the network has random layers, run it with forward(fwd, params, random)");
 
-		auto &output = fwd.get_next();
-		for (unsigned n = 0; n < N; n++)
-			NetworkType::layer::forward(fwd.input[n], output[n], layer_params);
+	if constexpr(is_stateful_v<NetworkType>)
+	{
+		philox unused;
+		return forward(fwd, params, unused);
 	}
 	else
 	{
-		auto &output = fwd.get_next();
-		for (unsigned n = 0; n < N; n++)
-			NetworkType::layer::forward(fwd.input[n], output[n]);
+		forward_layer<NetworkType, N>(fwd.input, fwd.get_next(), params);
+
+		if constexpr(NetworkType::is_final_layer)
+			return fwd.output;
+		else
+			return forward(fwd.next, params.template offset<layer_param_count_v<typename NetworkType::layer>>());
 	}
+}
 
+// the training pass, which backward has to come after if the network's
+// stateful. it's the same as the inference pass if it isn't.
+template <unsigned N, typename NetworkType>
+auto forward(forward_t<N, NetworkType> &fwd,
+             const params_t<NetworkType> &params,
+             philox &random) -> const output_t<N, NetworkType> &
+{
+	forward_layer<NetworkType, N>(fwd.input, fwd.get_next(), fwd.state, params, random);
 
 	if constexpr(NetworkType::is_final_layer)
 	{
@@ -163,14 +375,14 @@ auto forward(forward_t<N, NetworkType> &fwd,
 	}
 	else
 	{
-		return forward(fwd.next, params.offset<layer_param_count_v<NetworkType::layer>>());
+		return forward(fwd.next, params.template offset<layer_param_count_v<typename NetworkType::layer>>(), random);
 	}
 }
 
 // -----------------------------------------------------------------------------
 
-template <typename CostFunctionType, unsigned N, unsigned... Sizes>
-float cost(const tensor<shape_t<N, Sizes...>> &expectation,
+template <typename CostFunctionType, unsigned N, unsigned... ExpectationSizes, unsigned... Sizes>
+float cost(const tensor<shape_t<N, ExpectationSizes...>> &expectation,
            const tensor<shape_t<N, Sizes...>> &prediction)
 {
 	float value = 0.0;
@@ -180,7 +392,7 @@ float cost(const tensor<shape_t<N, Sizes...>> &expectation,
 }
 
 template <typename CostFunctionType, unsigned N, typename NetworkType>
-float cost(const output_t<N, NetworkType> &expectation,
+float cost(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
            forward_t<N, NetworkType> &fwd,
            const params_t<NetworkType> &params)
 {
@@ -189,73 +401,338 @@ float cost(const output_t<N, NetworkType> &expectation,
 
 // -----------------------------------------------------------------------------
 
-template <typename CostFunctionType, size_t N, typename NetworkType>
-auto backward(const output_t<N, NetworkType> &expectation,
-              const forward_t<N, NetworkType> &fwd,
-              const params_t<NetworkType> &params,
-              forward_t<N, NetworkType> &delta_fwd,
-              params_t<NetworkType> &delta_params) -> decltype(delta_params)
+// a cost function can name a final layer it knows how to differentiate through
+// itself (softmax_cross_entropy does this for softmax), in which case backward
+// gets the derivative with respect to that layer's input straight from the
+// cost function, and the layer's own backward is never called
+
+template <typename CostFunctionType, typename NetworkType, typename = void>
+constexpr bool is_fused_v = false;
+
+template <typename CostFunctionType, typename NetworkType>
+constexpr bool is_fused_v<CostFunctionType, NetworkType, std::void_t<typename CostFunctionType::template fused_layer<typename NetworkType::input_shape>>> =
+	std::is_same_v<typename CostFunctionType::template fused_layer<typename NetworkType::input_shape>, typename NetworkType::layer>;
+
+// -----------------------------------------------------------------------------
+
+// the derivative of the cost with respect to the final layer's output, or for
+// a fused cost function with respect to its input, in which case this returns
+// true and the final layer's backward shouldn't be called. if cost_value isn't
+// null it gets the batch's cost.
+template <typename CostFunctionType, typename NetworkType, unsigned N>
+bool output_delta(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                  const vector_of<N, typename NetworkType::input_shape> &input,
+                  const output_t<N, NetworkType> &output,
+                  vector_of<N, typename NetworkType::input_shape> &delta_input,
+                  output_t<N, NetworkType> &delta_output,
+                  float *cost_value)
 {
-	if constexpr(NetworkType::is_final_layer)
+	static_assert(NetworkType::is_final_layer);
+
+	if constexpr(is_fused_v<CostFunctionType, NetworkType>)
 	{
+		using logits_t = vector<NetworkType::input_shape::count>;
+
+		float value = 0.0f;
 		for (unsigned n = 0; n < N; n++)
-			CostFunctionType::derivative(expectation[n], fwd.output[n], delta_fwd.output[n]);
+		{
+			value += CostFunctionType::cost_and_derivative(
+				expectation[n],
+				reinterpret_cast<const logits_t &>(input[n]),
+				reinterpret_cast<logits_t &>(delta_input[n])
+			);
+		}
+
+		if (cost_value)
+			*cost_value = value / N;
+
+		return true;
 	}
 	else
 	{
-		backward<CostFunctionType>(
-			expectation,
-			fwd.next,
-			params.offset<layer_param_count_v<NetworkType::layer>>(),
-			delta_fwd.next,
-			delta_params.offset<layer_param_count_v<NetworkType::layer>>()
-		);
+		for (unsigned n = 0; n < N; n++)
+			CostFunctionType::derivative(expectation[n], output[n], delta_output[n]);
+
+		if (cost_value)
+			*cost_value = cost<CostFunctionType>(expectation, output);
+
+		return false;
 	}
+}
 
-	const auto &output = fwd.get_next();
-	const auto &delta_output = delta_fwd.get_next();
+// one sample's state out of a batch's, or no_state for a layer without any
+template <typename NetworkType, unsigned N>
+auto &sample_state(layer_states_t<N, typename NetworkType::layer> &states, const unsigned n)
+{
+	if constexpr(has_state_v<typename NetworkType::layer>)
+		return states[n];
+	else
+		return states;
+}
 
-	if constexpr(has_params_v<NetworkType::layer>)
-	{
-		auto &this_delta_params = delta_params.truncate<layer_param_count_v<NetworkType::layer>>();
+template <typename NetworkType, unsigned N>
+const auto &sample_state(const layer_states_t<N, typename NetworkType::layer> &states, const unsigned n)
+{
+	return sample_state<NetworkType, N>(const_cast<layer_states_t<N, typename NetworkType::layer> &>(states), n);
+}
 
-		this_delta_params.zero();
+// a single sample through the layer's backward, which ADDS the layer's
+// gradient to delta_params like the layers themselves do. delta_params only
+// has to start with the layer's slice, it needn't be laid out like params
+// after that (see sparse_gradient_t)
+template <typename NetworkType, typename State, unsigned DeltaSize>
+void backward_sample(const tensor<typename NetworkType::input_shape> &input,
+                     const tensor<typename NetworkType::layer::output_shape> &output,
+                     const State &state,
+                     const params_t<NetworkType> &params,
+                     tensor<typename NetworkType::input_shape> &delta_input,
+                     const tensor<typename NetworkType::layer::output_shape> &delta_output,
+                     vector<DeltaSize> &delta_params)
+{
+	using layer = typename NetworkType::layer;
 
-		for (unsigned n = 0; n < N; n++)
-		{
-			NetworkType::layer::backward(
-				fwd.input[n],
-				output[n],
-				reinterpret_cast<const NetworkType::layer::params_t &>(params),
-				delta_fwd.input[n],
-				delta_output[n],
-				reinterpret_cast<typename NetworkType::layer::params_t &>(delta_params)
-			);
-		}
+	if constexpr(has_params_v<layer>)
+	{
+		const auto &layer_params = reinterpret_cast<const typename layer::params_t &>(params);
+		auto &layer_delta_params = reinterpret_cast<typename layer::params_t &>(delta_params);
 
-		this_delta_params /= N;
+		if constexpr(has_state_v<layer>)
+			layer::backward(input, output, state, layer_params, delta_input, delta_output, layer_delta_params);
+		else
+			layer::backward(input, output, layer_params, delta_input, delta_output, layer_delta_params);
 	}
 	else
 	{
-		for (unsigned n = 0; n < N; n++)
+		if constexpr(has_state_v<layer>)
+			layer::backward(input, output, state, delta_input, delta_output);
+		else
+			layer::backward(input, output, delta_input, delta_output);
+	}
+}
+
+// a sparse layer (layers::embedding) has its params in rows of row_size, row
+// r starting at r * row_size, and each sample only uses the rows its input
+// picks out (rows_per_sample of them at most), so only they get any gradient.
+// rows(input, rows) appends the rows one sample uses, and
+// backward_rows(input, delta_input, delta_output, rows, gradient) is its
+// backward into a compact gradient, row k of which is rows[k]'s.
+template <typename LayerType, typename = void>
+constexpr bool is_sparse_v = false;
+
+template <typename LayerType>
+constexpr bool is_sparse_v<LayerType, std::void_t<decltype(LayerType::row_size)>> = true;
+
+// the rows of a network's first layer (a sparse one) a batch uses, each of
+// them once, in order
+template <typename NetworkType, unsigned N>
+void used_rows(const vector_of<N, typename NetworkType::input_shape> &input, std::vector<unsigned> &rows)
+{
+	rows.clear();
+	for (unsigned n = 0; n < N; n++)
+		NetworkType::layer::rows(input[n], rows);
+
+	std::sort(rows.begin(), rows.end());
+	rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+}
+
+// how backward fills in delta_params
+enum class gradient_mode
+{
+	// each layer's slice is overwritten with its gradient averaged over the
+	// batch
+	overwrite,
+
+	// the gradient summed over the batch is added to what's there, for
+	// micro-batches, see accumulate_backward
+	accumulate
+};
+
+// the backward counterpart to forward_layer, filling in the layer's slice of
+// delta_params as mode says
+template <typename NetworkType, unsigned N, unsigned DeltaSize>
+void backward_layer(const vector_of<N, typename NetworkType::input_shape> &input,
+                    const vector_of<N, typename NetworkType::layer::output_shape> &output,
+                    const layer_states_t<N, typename NetworkType::layer> &states,
+                    const params_t<NetworkType> &params,
+                    vector_of<N, typename NetworkType::input_shape> &delta_input,
+                    const vector_of<N, typename NetworkType::layer::output_shape> &delta_output,
+                    vector<DeltaSize> &delta_params,
+                    const gradient_mode mode = gradient_mode::overwrite)
+{
+	using layer = typename NetworkType::layer;
+
+	auto &this_delta_params = delta_params.template truncate<layer_param_count_v<layer>>();
+
+	if constexpr(has_params_v<layer>)
+	{
+		if (mode != gradient_mode::accumulate)
+			this_delta_params.zero();
+	}
+
+	for (unsigned n = 0; n < N; n++)
+		backward_sample<NetworkType>(input[n], output[n], sample_state<NetworkType, N>(states, n), params, delta_input[n], delta_output[n], delta_params);
+
+	if constexpr(has_params_v<layer>)
+	{
+		if (mode != gradient_mode::accumulate)
+			this_delta_params /= N;
+	}
+}
+
+// a sparse layer's backward into a compact gradient: the first rows.size()
+// rows of it, row k being the gradient of rows[k] (the rows the batch used,
+// see used_rows) averaged over the batch. the rest is left as it was.
+template <typename NetworkType, unsigned N, unsigned GradientSize>
+void sparse_backward_layer(const vector_of<N, typename NetworkType::input_shape> &input,
+                           vector_of<N, typename NetworkType::input_shape> &delta_input,
+                           const vector_of<N, typename NetworkType::layer::output_shape> &delta_output,
+                           const std::vector<unsigned> &rows,
+                           vector<GradientSize> &gradient)
+{
+	using layer = typename NetworkType::layer;
+
+	float *values = gradient.data();
+	const std::size_t count = rows.size() * layer::row_size;
+
+	std::fill_n(values, count, 0.0f);
+
+	for (unsigned n = 0; n < N; n++)
+		layer::backward_rows(input[n], delta_input[n], delta_output[n], rows, values);
+
+	for (std::size_t i = 0; i < count; i++)
+		values[i] /= N;
+}
+
+// -----------------------------------------------------------------------------
+
+// backward finishes the layers' slices of delta_params from the last layer to
+// the first, and can say so as it goes: pass a hook and it's called with a
+// layer_gradient as soon as each layer's slice is final (after the average
+// over the batch, or the sum when accumulating). that way an update, or sending the gradient off to be
+// reduced, can get going on the last layers while the earlier ones are still
+// running backward. it's called for every layer, params or not, in order from
+// the last layer to the first.
+struct layer_gradient
+{
+	unsigned layer;		// counting from 0 at the input
+	unsigned offset;	// where its slice starts in delta_params
+	unsigned count;		// how many params it has, which can be 0
+};
+
+struct no_layer_hook
+{
+	void operator()(const layer_gradient &) const {}
+};
+
+// does the work of backward, and if cost_value isn't null also works out the
+// batch's cost along the way. layer and offset are where NetworkType sits in
+// the whole network, for the hook.
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady>
+void _backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+               const forward_t<N, NetworkType> &fwd,
+               const params_t<NetworkType> &params,
+               forward_t<N, NetworkType> &delta_fwd,
+               params_t<NetworkType> &delta_params,
+               float *cost_value,
+               LayerReady &on_layer_ready,
+               const gradient_mode mode = gradient_mode::overwrite,
+               const unsigned layer = 0,
+               const unsigned offset = 0)
+{
+	constexpr unsigned param_count = layer_param_count_v<typename NetworkType::layer>;
+
+	if constexpr(NetworkType::is_final_layer)
+	{
+		if (output_delta<CostFunctionType, NetworkType, N>(expectation, fwd.input, fwd.output, delta_fwd.input, delta_fwd.output, cost_value))
 		{
-			NetworkType::layer::backward(
-				fwd.input[n],
-				output[n],
-				delta_fwd.input[n],
-				delta_output[n]
-			);
+			on_layer_ready(layer_gradient{ layer, offset, param_count });
+			return;
 		}
 	}
+	else
+	{
+		_backward<CostFunctionType>(
+			expectation,
+			fwd.next,
+			params.template offset<layer_param_count_v<typename NetworkType::layer>>(),
+			delta_fwd.next,
+			delta_params.template offset<layer_param_count_v<typename NetworkType::layer>>(),
+			cost_value,
+			on_layer_ready,
+			mode,
+			layer + 1,
+			offset + param_count
+		);
+	}
+
+	backward_layer<NetworkType, N>(fwd.input, fwd.get_next(), fwd.state, params, delta_fwd.input, delta_fwd.get_next(), delta_params, mode);
+
+	on_layer_ready(layer_gradient{ layer, offset, param_count });
+}
 
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+auto backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+              const forward_t<N, NetworkType> &fwd,
+              const params_t<NetworkType> &params,
+              forward_t<N, NetworkType> &delta_fwd,
+              params_t<NetworkType> &delta_params,
+              LayerReady &&on_layer_ready = LayerReady()) -> decltype(delta_params)
+{
+	_backward<CostFunctionType>(expectation, fwd, params, delta_fwd, delta_params, nullptr, on_layer_ready);
 	return delta_params;
 }
 
+// backward, but also returns the batch's cost. for a fused cost function the
+// cost comes out of the same pass as the gradient, so this is cheaper than
+// calling cost and backward separately
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+float cost_and_backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                        const forward_t<N, NetworkType> &fwd,
+                        const params_t<NetworkType> &params,
+                        forward_t<N, NetworkType> &delta_fwd,
+                        params_t<NetworkType> &delta_params,
+                        LayerReady &&on_layer_ready = LayerReady())
+{
+	float value = 0.0f;
+	_backward<CostFunctionType>(expectation, fwd, params, delta_fwd, delta_params, &value, on_layer_ready);
+	return value;
+}
+
+// for a bigger batch than there's room for in one forward_t: backward over
+// several micro-batches in a row, each one ADDING its gradient to
+// delta_params, which needs zeroing before the first. the gradient's summed
+// rather than averaged, so divide delta_params by the samples in all of them
+// before using it, e.g. to step 4 micro-batches of 64 as a batch of 256:
+//
+//     gradient = 0.0f;
+//     for (unsigned k = 0; k < 4; k++)
+//     {
+//         ... the k'th 64 samples in and forward ...
+//         cost += accumulate_backward<Cost>(expectation, fwd, params, delta_fwd, gradient);
+//     }
+//     gradient /= 256;
+//
+// returns the micro-batch's mean cost. train_step_accumulated (arena.hpp)
+// does all that.
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+float accumulate_backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                          const forward_t<N, NetworkType> &fwd,
+                          const params_t<NetworkType> &params,
+                          forward_t<N, NetworkType> &delta_fwd,
+                          params_t<NetworkType> &delta_params,
+                          LayerReady &&on_layer_ready = LayerReady())
+{
+	float value = 0.0f;
+	_backward<CostFunctionType>(expectation, fwd, params, delta_fwd, delta_params, &value, on_layer_ready, gradient_mode::accumulate);
+	return value;
+}
+
 // -----------------------------------------------------------------------------
 
-// don't call this on big networks. just dont.
-template <typename CostFunctionType, size_t N, typename NetworkType>
-auto numerical_gradient(const output_t<N, NetworkType> &expectation,
+// don't call this on big networks. just dont. check_gradient (see
+// gradient_check.hpp) is for those.
+template <typename CostFunctionType, unsigned N, typename NetworkType>
+auto numerical_gradient(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
                         forward_t<N, NetworkType> &fwd,
                         params_t<NetworkType> &params,
                         params_t<NetworkType> &delta_params) -> decltype(delta_params)
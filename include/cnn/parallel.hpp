@@ -0,0 +1,525 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include "arena.hpp"
+
+// multithreaded data parallel training that knows about sockets.
+//
+// every worker thread is pinned to a core and trains on its own shard of the
+// batch out of its own arena. each numa node gets its own copy of the params
+// to read from and its own gradient to reduce into, so the only traffic
+// between sockets is one read of the master params and one slice of the
+// reduce per step:
+//
+//     1. each node copies the master params into its replica
+//     2. each worker does forward/backward on its shard against its replica
+//     3. each node sums its workers' gradients into the node gradient, every
+//        worker on the node taking a slice of each layer. this starts on a
+//        layer as soon as every worker on the node has finished its backward,
+//        so the first worker done gets going on the last layers while the
+//        others catch up
+//     4. all of the workers sum a slice each of the node gradients into the
+//        master gradient, which is then handed to update on the calling thread
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// which cpus belong to which numa node
+struct numa_topology
+{
+	std::vector<std::vector<unsigned>> nodes;
+
+	unsigned cpu_count() const
+	{
+		unsigned count = 0;
+		for (const auto &node : nodes)
+			count += static_cast<unsigned>(node.size());
+		return count;
+	}
+
+	// on linux this reads /sys, anywhere else (or if that fails) it's one
+	// node with every cpu on it
+	static numa_topology detect()
+	{
+		numa_topology topology;
+
+#if defined(__linux__)
+		for (unsigned node = 0; ; node++)
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+			FILE *file = fopen(path, "r");
+			if (!file)
+				break;
+
+			std::vector<unsigned> cpus;
+
+			// a list of ranges, like "0-7,16-23"
+			unsigned first, last;
+			while (fscanf(file, "%u", &first) == 1)
+			{
+				last = first;
+				if (fscanf(file, "-%u", &last) != 1)
+					last = first;
+				for (unsigned cpu = first; cpu <= last; cpu++)
+					cpus.push_back(cpu);
+				if (fgetc(file) != ',')
+					break;
+			}
+
+			fclose(file);
+
+			if (!cpus.empty())
+				topology.nodes.push_back(std::move(cpus));
+		}
+#endif
+
+		if (topology.nodes.empty())
+		{
+			const unsigned count = std::max(1u, std::thread::hardware_concurrency());
+
+			topology.nodes.emplace_back();
+			for (unsigned cpu = 0; cpu < count; cpu++)
+				topology.nodes[0].push_back(cpu);
+		}
+
+		return topology;
+	}
+};
+
+inline bool pin_current_thread(const unsigned cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+	return 0 != SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+
+// std::barrier is c++20
+class thread_barrier
+{
+public:
+	explicit thread_barrier(const unsigned count) : count(count) {}
+
+	void arrive_and_wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		const unsigned this_generation = generation;
+		if (++waiting == count)
+		{
+			waiting = 0;
+			generation++;
+			condition.notify_all();
+		}
+		else
+		{
+			condition.wait(lock, [&] { return generation != this_generation; });
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	unsigned count, waiting = 0, generation = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+// the pool behind the evaluating and checking helpers (metrics.hpp,
+// gradient_check.hpp, distillation.hpp): worker(next) runs on threads threads
+// (0 for every cpu, and never more than there are items), and next() hands
+// out the items 0 to count - 1 between them, each of them once, then count
+// when they've all gone. a worker sets up its own scratch, takes items until
+// there are none left, and hands back whatever it added up. if one throws,
+// the rest stop taking items and the first exception is rethrown once
+// they've all finished.
+template <typename Worker>
+void _for_each_chunk(const std::size_t count, unsigned threads, Worker &&worker)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, count)));
+
+	std::atomic<std::size_t> next_item{ 0 };
+	std::mutex error_mutex;
+	std::exception_ptr error;
+
+	const auto next = [&]() -> std::size_t
+	{
+		const std::size_t item = next_item++;
+		return item < count ? item : count;
+	};
+
+	const auto run = [&]
+	{
+		try
+		{
+			worker(next);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (!error)
+				error = std::current_exception();
+
+			// nobody else needs to bother
+			next_item = count;
+		}
+	};
+
+	std::vector<std::thread> helpers;
+	for (unsigned t = 1; t < threads; t++)
+		helpers.emplace_back(run);
+
+	run();
+
+	for (auto &h : helpers)
+		h.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+// -----------------------------------------------------------------------------
+
+// WorkerBatch samples per worker per step, so a step trains on
+// WorkerBatch * worker_count() samples
+template <typename CostFunctionType, unsigned WorkerBatch, typename NetworkType>
+class numa_trainer
+{
+public:
+	using params_type = params_t<NetworkType>;
+	using input_type = vector_of<WorkerBatch, typename NetworkType::input_shape>;
+	using expectation_type = expectation_t<WorkerBatch, CostFunctionType, NetworkType>;
+
+	// thread_count = 0 uses as many as the tuning cache says, or if it doesn't
+	// say, every cpu, one worker pinned to each. seed is for stochastic
+	// layers, every worker gets its own stream of it.
+	explicit numa_trainer(const unsigned thread_count = 0,
+                          const bool huge_pages = false,
+                          const numa_topology &topology = numa_topology::detect(),
+                          const std::uint64_t seed = philox::default_seed)
+	{
+		const unsigned cpu_count = topology.cpu_count();
+		const unsigned wanted = thread_count == 0 ? tuning::threads(tuning_name()) : thread_count;
+		const unsigned count = wanted == 0 ? cpu_count : std::min(wanted, cpu_count);
+
+		// fill the first node before spilling onto the next, so that small
+		// thread counts don't pay for the interconnect
+		for (unsigned node = 0; node < topology.nodes.size() && workers.size() < count; node++)
+		{
+			nodes.emplace_back();
+			for (const unsigned cpu : topology.nodes[node])
+			{
+				if (workers.size() == count)
+					break;
+
+				nodes.back().workers.push_back(static_cast<unsigned>(workers.size()));
+				workers.push_back(std::make_unique<worker>(worker{ cpu, static_cast<unsigned>(nodes.size() - 1), {}, {}, philox(seed, workers.size()) }));
+			}
+		}
+
+		sync = std::make_unique<thread_barrier>(count + 1);
+		phase = std::make_unique<thread_barrier>(count);
+
+		for (unsigned w = 0; w < count; w++)
+			workers[w]->thread = std::thread([this, w, huge_pages] { run(w, huge_pages); });
+
+		// wait for every worker to have made its arena
+		sync->arrive_and_wait();
+
+		// one of them couldn't, so there's no trainer and no destructor to
+		// send them home
+		if (error)
+		{
+			stopping = true;
+			sync->arrive_and_wait();
+
+			for (auto &w : workers)
+				w->thread.join();
+
+			std::rethrow_exception(error);
+		}
+	}
+
+	// what the tuning cache knows this network and batch by
+	static std::string tuning_name()
+	{
+		return signature<NetworkType>() + "/" + std::to_string(WorkerBatch);
+	}
+
+	numa_trainer(const numa_trainer &) = delete;
+	numa_trainer &operator=(const numa_trainer &) = delete;
+
+	~numa_trainer()
+	{
+		stopping = true;
+		sync->arrive_and_wait();
+
+		for (auto &w : workers)
+			w->thread.join();
+	}
+
+	unsigned worker_count() const { return static_cast<unsigned>(workers.size()); }
+	unsigned node_count() const { return static_cast<unsigned>(nodes.size()); }
+
+	// fill_shard(worker, input, expectation) is called on every worker thread
+	// at once to fill in that worker's shard of the batch, and
+	// update(gradient) on this thread once the gradient's been averaged over
+	// every shard. returns the cost averaged over every shard. if a worker
+	// throws, the step still runs to the end on the others, then the first
+	// exception is rethrown here without calling update, and the trainer can
+	// carry on with the next step.
+	template <typename FillShard, typename Update>
+	float step(params_type &params, FillShard &&fill_shard, Update &&update)
+	{
+		master_params = &params;
+		fill = [&](const unsigned w, input_type &input, expectation_type &expectation) { fill_shard(w, input, expectation); };
+
+		sync->arrive_and_wait(); // go
+		sync->arrive_and_wait(); // done
+
+		if (error)
+			std::rethrow_exception(std::exchange(error, nullptr));
+
+		float value = 0.0f;
+		for (auto &w : workers)
+			value += w->cost;
+
+		update(*master_gradient);
+
+		return value / worker_count();
+	}
+
+private:
+	static constexpr unsigned layer_count = layer_count_v<NetworkType>;
+
+	struct node_t
+	{
+		std::vector<unsigned> workers;
+		params_type *params = nullptr;
+		params_type *gradient = nullptr;
+
+		// how many times each layer's backward has finished on this node, ever
+		std::unique_ptr<std::atomic<unsigned>[]> layers_ready{ new std::atomic<unsigned>[layer_count]() };
+	};
+
+	struct worker
+	{
+		unsigned cpu, node;
+
+		std::thread thread;
+		std::unique_ptr<nn::arena> scratch;
+		philox random;
+
+		params_type *gradient = nullptr;
+		float cost = 0.0f;
+	};
+
+	// splits count things up between parts, returning part i's range
+	static void slice(const unsigned count, const unsigned parts, const unsigned i, unsigned &begin, unsigned &end)
+	{
+		begin = static_cast<unsigned>(static_cast<unsigned long long>(count) * i / parts);
+		end = static_cast<unsigned>(static_cast<unsigned long long>(count) * (i + 1) / parts);
+	}
+
+	void run(const unsigned w, const bool huge_pages)
+	{
+		worker &self = *workers[w];
+		node_t &node = nodes[self.node];
+
+		const bool is_node_leader = node.workers.front() == w;
+		const bool is_leader = w == 0;
+
+		pin_current_thread(self.cpu);
+
+		// made on this thread after pinning, so it's all local
+		const std::size_t size = step_arena_size_v<WorkerBatch, NetworkType, CostFunctionType>
+			+ (is_node_leader ? 2 * sizeof(params_type) : 0)
+			+ (is_leader ? sizeof(params_type) : 0)
+			+ 4 * arena::default_alignment;
+
+		try
+		{
+			self.scratch = std::make_unique<nn::arena>(size, huge_pages);
+		}
+		catch (...)
+		{
+			// the constructor sends everyone home straight after this
+			keep_error();
+			sync->arrive_and_wait();
+			sync->arrive_and_wait();
+			return;
+		}
+
+		nn::arena &scratch = *self.scratch;
+
+		if (is_node_leader)
+		{
+			node.params = &scratch.make<params_type>();
+			node.gradient = &scratch.make<params_type>();
+		}
+
+		// the padding at the end of params_t that backward never writes, and
+		// so isn't reduced, is left at 0 for update
+		if (is_leader)
+		{
+			master_gradient = &scratch.make<params_type>();
+			*master_gradient = 0.0f;
+		}
+
+		const std::size_t base = scratch.mark();
+
+		constexpr unsigned param_count = param_offsets_v<NetworkType>.back();
+
+		const unsigned node_size = static_cast<unsigned>(node.workers.size());
+		const unsigned node_rank = static_cast<unsigned>(std::find(node.workers.begin(), node.workers.end(), w) - node.workers.begin());
+
+		sync->arrive_and_wait();
+
+		for (unsigned steps = 1; ; steps++)
+		{
+			sync->arrive_and_wait();
+			if (stopping)
+				return;
+
+			unsigned begin, end;
+
+			// 1. pull the master params into this node's replica
+			slice(param_count, node_size, node_rank, begin, end);
+			std::copy(master_params->data() + begin, master_params->data() + end, node.params->data() + begin);
+
+			phase->arrive_and_wait();
+
+			// 2. this worker's shard
+			scratch.rewind(base);
+
+			auto &work = make_workspace<WorkerBatch, NetworkType>(scratch);
+			auto &expectation = scratch.make<expectation_type>();
+			self.gradient = &scratch.make<params_type>();
+
+			// backward marks the layers ready last first, so everything below
+			// this one still needs marking if it throws part way
+			unsigned unmarked = layer_count;
+
+			try
+			{
+				fill(w, work.input(), expectation);
+
+				forward(work, *node.params, self.random);
+				self.cost = cost_and_backward<CostFunctionType>(expectation, work, *node.params, *self.gradient,
+					[&](const layer_gradient &ready)
+					{
+						node.layers_ready[ready.layer].fetch_add(1, std::memory_order_release);
+						unmarked = ready.layer;
+					});
+			}
+			catch (...)
+			{
+				// the rest of the step still has to happen, or the others would
+				// wait on this worker forever. what it reduces is thrown away.
+				keep_error();
+
+				for (unsigned layer = 0; layer < unmarked; layer++)
+					node.layers_ready[layer].fetch_add(1, std::memory_order_release);
+			}
+
+			// 3. reduce this node's workers a layer at a time, last layer first,
+			// each worker summing a slice of the layer across all of them
+			for (unsigned layer = layer_count; layer-- > 0; )
+			{
+				while (node.layers_ready[layer].load(std::memory_order_acquire) < steps * node_size)
+					std::this_thread::yield();
+
+				const unsigned offset = param_offsets_v<NetworkType>[layer];
+				slice(param_offsets_v<NetworkType>[layer + 1] - offset, node_size, node_rank, begin, end);
+
+				for (unsigned i = offset + begin; i < offset + end; i++)
+				{
+					float sum = 0.0f;
+					for (const unsigned other : node.workers)
+						sum += workers[other]->gradient->data()[i];
+					node.gradient->data()[i] = sum;
+				}
+			}
+
+			phase->arrive_and_wait();
+
+			// 4. reduce across the nodes, this time with every worker taking a
+			// slice, averaging over every shard as it goes
+			slice(param_count, worker_count(), w, begin, end);
+
+			const float scale = 1.0f / worker_count();
+			for (unsigned i = begin; i < end; i++)
+			{
+				float sum = 0.0f;
+				for (const node_t &other : nodes)
+					sum += other.gradient->data()[i];
+				master_gradient->data()[i] = sum * scale;
+			}
+
+			sync->arrive_and_wait();
+		}
+	}
+
+	// the first one a worker threw, for step (or the constructor) to rethrow
+	void keep_error()
+	{
+		std::lock_guard<std::mutex> lock(error_mutex);
+		if (!error)
+			error = std::current_exception();
+	}
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::vector<node_t> nodes;
+
+	std::unique_ptr<thread_barrier> sync, phase;
+	std::atomic<bool> stopping{ false };
+
+	params_type *master_params = nullptr;
+	params_type *master_gradient = nullptr;
+
+	std::mutex error_mutex;
+	std::exception_ptr error;
+
+	// type erased so that step can take any old lambda
+	std::function<void(unsigned, input_type &, expectation_type &)> fill;
+};
+
+} // nn
@@ -0,0 +1,644 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "network.hpp"
+
+// forward_t nests a buffer for every layer's input, and training needs a
+// second one for the deltas, so a step holds twice every activation in the
+// network. most of those are dead most of the time though: a delta is only
+// needed by the next layer down, and outside of training an activation is
+// only needed by the next layer up.
+//
+// plan_t works out at compile time when each buffer is first written and last
+// read over a forward (and backward) pass, and packs them into one block,
+// letting buffers that are never alive at the same time share memory.
+// workspace_t is that block, and nn::forward/nn::backward have overloads for
+// it that work just like the forward_t ones.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+template <typename NetworkType, typename = void>
+constexpr unsigned layer_count_v = 1;
+
+template <typename NetworkType>
+constexpr unsigned layer_count_v<NetworkType, std::enable_if_t<!NetworkType::is_final_layer>> = 1 + layer_count_v<typename NetworkType::next_network_t>;
+
+// the network starting at layer I
+template <typename NetworkType, unsigned I>
+struct network_at
+{
+	using type = typename network_at<typename NetworkType::next_network_t, I - 1>::type;
+};
+
+template <typename NetworkType>
+struct network_at<NetworkType, 0>
+{
+	using type = NetworkType;
+};
+
+template <typename NetworkType, unsigned I>
+using network_at_t = typename network_at<NetworkType, I>::type;
+
+// the shape going into layer I, where I == layer count is the network's output
+template <typename NetworkType, unsigned I, typename = void>
+struct activation_shape
+{
+	using type = typename network_at_t<NetworkType, I>::input_shape;
+};
+
+template <typename NetworkType, unsigned I>
+struct activation_shape<NetworkType, I, std::enable_if_t<I == layer_count_v<NetworkType>>>
+{
+	using type = typename NetworkType::output_shape;
+};
+
+template <typename NetworkType, unsigned I>
+using activation_shape_t = typename activation_shape<NetworkType, I>::type;
+
+// where layer I's params start in a params_t
+template <typename NetworkType, unsigned I>
+constexpr unsigned param_offset_v = layer_param_count_v<typename network_at_t<NetworkType, I - 1>::layer> + param_offset_v<NetworkType, I - 1>;
+
+template <typename NetworkType>
+constexpr unsigned param_offset_v<NetworkType, 0> = 0;
+
+template <typename NetworkType, std::size_t... Is>
+constexpr std::array<unsigned, sizeof...(Is)> _param_offsets(std::index_sequence<Is...>)
+{
+	return { param_offset_v<NetworkType, Is>... };
+}
+
+// param_offset_v for every layer, then where the last layer's params end
+template <typename NetworkType>
+constexpr auto param_offsets_v = _param_offsets<NetworkType>(std::make_index_sequence<layer_count_v<NetworkType> + 1>());
+
+// roughly what a layer costs per sample, in floating point operations: a
+// multiply and an add for every param, which is about right for a fully
+// connected layer, and one more for every output. a layer that uses its
+// params more than once per sample says what it costs with a static
+// constexpr flops of its own.
+template <typename LayerType, typename = void>
+constexpr std::size_t layer_flops_v = 2 * std::size_t(layer_param_count_v<LayerType>) + LayerType::output_shape::count;
+
+template <typename LayerType>
+constexpr std::size_t layer_flops_v<LayerType, std::void_t<decltype(LayerType::flops)>> = LayerType::flops;
+
+template <typename NetworkType, unsigned First, std::size_t... Is>
+constexpr std::size_t _flops(std::index_sequence<Is...>)
+{
+	return (std::size_t(0) + ... + layer_flops_v<typename network_at_t<NetworkType, First + Is>::layer>);
+}
+
+// layers First to Last - 1's flops per sample, the whole network's by default
+template <typename NetworkType, unsigned First = 0, unsigned Last = layer_count_v<NetworkType>>
+constexpr std::size_t flops_v = _flops<NetworkType, First>(std::make_index_sequence<Last - First>());
+
+// a sparse layer's row_size (see is_sparse_v), 0 for a dense one
+template <typename LayerType, typename = void>
+constexpr unsigned layer_row_size_v = 0;
+
+template <typename LayerType>
+constexpr unsigned layer_row_size_v<LayerType, std::enable_if_t<is_sparse_v<LayerType>>> = LayerType::row_size;
+
+template <typename NetworkType, std::size_t... Is>
+constexpr std::array<unsigned, sizeof...(Is)> _row_sizes(std::index_sequence<Is...>)
+{
+	return { layer_row_size_v<typename network_at_t<NetworkType, Is>::layer>... };
+}
+
+// layer_row_size_v for every layer
+template <typename NetworkType>
+constexpr auto row_sizes_v = _row_sizes<NetworkType>(std::make_index_sequence<layer_count_v<NetworkType>>());
+
+// how much of a sparse gradient (see sparse_backward) a layer has for a batch
+// of N: all of a dense layer's params, and for a sparse layer a row for every
+// row the batch could use, or the whole table if that's fewer
+template <unsigned N, typename LayerType, typename = void>
+constexpr unsigned sparse_param_count_v = layer_param_count_v<LayerType>;
+
+template <unsigned N, typename LayerType>
+constexpr unsigned sparse_param_count_v<N, LayerType, std::enable_if_t<is_sparse_v<LayerType>>> = static_cast<unsigned>(
+	std::min<std::uint64_t>(std::uint64_t(N) * LayerType::rows_per_sample, layer_param_count_v<LayerType> / LayerType::row_size) * LayerType::row_size);
+
+// where layer I's slice starts in a sparse gradient
+template <unsigned N, typename NetworkType, unsigned I>
+constexpr unsigned sparse_offset_v = sparse_param_count_v<N, typename network_at_t<NetworkType, I - 1>::layer> + sparse_offset_v<N, NetworkType, I - 1>;
+
+template <unsigned N, typename NetworkType>
+constexpr unsigned sparse_offset_v<N, NetworkType, 0> = 0;
+
+template <unsigned N, typename NetworkType, std::size_t... Is>
+constexpr std::array<unsigned, sizeof...(Is)> _sparse_offsets(std::index_sequence<Is...>)
+{
+	return { sparse_offset_v<N, NetworkType, Is>... };
+}
+
+// sparse_offset_v for every layer, then where the last layer's slice ends
+template <unsigned N, typename NetworkType>
+constexpr auto sparse_offsets_v = _sparse_offsets<N, NetworkType>(std::make_index_sequence<layer_count_v<NetworkType> + 1>());
+
+// the gradient sparse_backward fills in, which for a network with a big
+// embedding is a fraction of a params_t: the table's part only has room for
+// the rows a batch can use. with no sparse layers it's just a params_t.
+template <unsigned N, typename NetworkType>
+using sparse_gradient_t = vector<sparse_offset_v<N, NetworkType, layer_count_v<NetworkType>> + 1>;
+
+// -----------------------------------------------------------------------------
+
+// a buffer is alive from the step it's written in to the last step it's read
+// in, inclusive, so a layer's input and output can never share
+struct buffer_lifetime
+{
+	std::size_t size;
+	int first, last;
+};
+
+template <std::size_t Count>
+struct layout_t
+{
+	std::array<std::size_t, Count> offsets;
+	std::size_t size;
+};
+
+// greedy first fit, biggest buffers first, which is about as good as it gets
+// for the handful of buffers a network has
+template <std::size_t Count>
+constexpr layout_t<Count> pack_buffers(const std::array<buffer_lifetime, Count> &buffers, const std::size_t alignment)
+{
+	std::array<std::size_t, Count> order{};
+	for (std::size_t i = 0; i < Count; i++)
+		order[i] = i;
+
+	for (std::size_t i = 0; i < Count; i++)
+		for (std::size_t j = i + 1; j < Count; j++)
+			if (buffers[order[j]].size > buffers[order[i]].size)
+			{
+				const std::size_t t = order[i];
+				order[i] = order[j];
+				order[j] = t;
+			}
+
+	layout_t<Count> layout{};
+	std::array<bool, Count> placed{};
+
+	for (std::size_t i = 0; i < Count; i++)
+	{
+		const buffer_lifetime &buffer = buffers[order[i]];
+
+		// keep bumping past anything that's alive at the same time and in the
+		// way until there's a gap
+		std::size_t offset = 0;
+		for (bool moved = true; moved; )
+		{
+			moved = false;
+			for (std::size_t j = 0; j < Count; j++)
+			{
+				if (!placed[j] || buffers[j].first > buffer.last || buffer.first > buffers[j].last)
+					continue;
+
+				const std::size_t other = layout.offsets[j];
+				if (offset < other + buffers[j].size && other < offset + buffer.size)
+				{
+					offset = (other + buffers[j].size + alignment - 1) / alignment * alignment;
+					moved = true;
+				}
+			}
+		}
+
+		layout.offsets[order[i]] = offset;
+		placed[order[i]] = true;
+
+		if (offset + buffer.size > layout.size)
+			layout.size = offset + buffer.size;
+	}
+
+	layout.size = (layout.size + alignment - 1) / alignment * alignment;
+	return layout;
+}
+
+// -----------------------------------------------------------------------------
+
+template <unsigned N, typename NetworkType>
+struct plan_t
+{
+	static constexpr std::size_t alignment = 64;
+
+	static constexpr unsigned layer_count = layer_count_v<NetworkType>;
+
+	// activation I is the input to layer I, activation layer_count is the
+	// output. same again for the deltas.
+	template <unsigned I>
+	static constexpr std::size_t activation_size = sizeof(vector_of<N, activation_shape_t<NetworkType, I>>);
+
+	// layer I's state, if it has any
+	template <unsigned I, typename Layer = typename network_at_t<NetworkType, I>::layer>
+	static constexpr std::size_t state_size = has_state_v<Layer> ? sizeof(layer_states_t<N, Layer>) : 0;
+
+	// steps are: layer I's forward at I, the cost at L, and layer I's backward
+	// at 2L - I. buffers 0 to L are the activations, L+1 to 2L+1 the deltas and
+	// 2L+2 on the layers' states
+	template <std::size_t... Is>
+	static constexpr auto training_lifetimes(std::index_sequence<Is...>)
+	{
+		constexpr int L = layer_count;
+
+		// read by its own layer's backward, and as the output of the layer
+		// below's. the input's been sat there since before the start.
+		const std::array<buffer_lifetime, L + 1> activations = {
+			buffer_lifetime{ activation_size<Is>, Is == 0 ? -1 : int(Is) - 1, 2 * L - int(Is) + (Is == 0 ? 0 : 1) }...
+		};
+
+		// written by layer I's backward, read by layer I-1's. the output's
+		// delta comes from the cost, and a fused cost function writes the final
+		// layer's input delta at the same time.
+		const std::array<buffer_lifetime, L + 1> deltas = {
+			buffer_lifetime{ activation_size<Is>, int(Is) >= L - 1 ? L : 2 * L - int(Is), Is == 0 ? 2 * L : 2 * L - int(Is) + 1 }...
+		};
+
+		// made by layer I's forward, read by its backward. the last Is is
+		// the output, which isn't a layer.
+		const std::array<buffer_lifetime, L + 1> states = {
+			buffer_lifetime{ int(Is) < L ? state_size<(Is < L ? Is : 0)> : 0, int(Is), 2 * L - int(Is) }...
+		};
+
+		std::array<buffer_lifetime, 3 * L + 2> lifetimes{};
+		for (int i = 0; i <= L; i++)
+		{
+			lifetimes[i] = activations[i];
+			lifetimes[L + 1 + i] = deltas[i];
+		}
+		for (int i = 0; i < L; i++)
+			lifetimes[2 * L + 2 + i] = states[i];
+		return lifetimes;
+	}
+
+	// just the forward pass, each activation only lives for two layers. the
+	// input is kept for the whole pass in both plans so that it can be filled
+	// once and run over and over, same as with a forward_t.
+	template <std::size_t... Is>
+	static constexpr auto inference_lifetimes(std::index_sequence<Is...>)
+	{
+		return std::array<buffer_lifetime, layer_count + 1>{
+			buffer_lifetime{ activation_size<Is>, int(Is) - 1, Is == 0 ? int(layer_count) : int(Is) }...
+		};
+	}
+
+	static constexpr auto training = pack_buffers(training_lifetimes(std::make_index_sequence<layer_count + 1>()), alignment);
+	static constexpr auto inference = pack_buffers(inference_lifetimes(std::make_index_sequence<layer_count + 1>()), alignment);
+
+	// what a forward_t and a delta forward_t would have cost between them
+	template <std::size_t... Is>
+	static constexpr std::size_t unplanned_size(std::index_sequence<Is...>)
+	{
+		return 2 * (activation_size<Is> + ...);
+	}
+
+	static constexpr std::size_t training_size = training.size;
+	static constexpr std::size_t inference_size = inference.size;
+	static constexpr std::size_t forward_t_size = unplanned_size(std::make_index_sequence<layer_count + 1>());
+};
+
+// -----------------------------------------------------------------------------
+
+// the planned stand-in for a forward_t (and its delta forward_t, if Training).
+// like forward_t this IS the data, so keep it off the stack.
+template <unsigned N, typename NetworkType, bool Training = true>
+struct workspace_t
+{
+	using plan = plan_t<N, NetworkType>;
+
+	static constexpr unsigned layer_count = plan::layer_count;
+	static constexpr bool is_training = Training;
+	static constexpr std::size_t size = Training ? plan::training_size : plan::inference_size;
+
+	template <unsigned I>
+	auto &activation()
+	{
+		static_assert(I <= layer_count);
+		constexpr std::size_t offset = Training ? plan::training.offsets[I] : plan::inference.offsets[I];
+		return *reinterpret_cast<vector_of<N, activation_shape_t<NetworkType, I>> *>(storage + offset);
+	}
+
+	template <unsigned I>
+	const auto &activation() const
+	{
+		return const_cast<workspace_t *>(this)->template activation<I>();
+	}
+
+	template <unsigned I>
+	auto &delta()
+	{
+		static_assert(Training, "there are no deltas in an inference workspace");
+		static_assert(I <= layer_count);
+		constexpr std::size_t offset = plan::training.offsets[layer_count + 1 + I];
+		return *reinterpret_cast<vector_of<N, activation_shape_t<NetworkType, I>> *>(storage + offset);
+	}
+
+	template <unsigned I>
+	auto &state()
+	{
+		static_assert(Training, "layers have no state outside of training");
+		static_assert(I < layer_count);
+		constexpr std::size_t offset = plan::training.offsets[2 * layer_count + 2 + I];
+		return *reinterpret_cast<layer_states_t<N, typename network_at_t<NetworkType, I>::layer> *>(storage + offset);
+	}
+
+	template <unsigned I>
+	const auto &state() const
+	{
+		return const_cast<workspace_t *>(this)->template state<I>();
+	}
+
+	auto &input() { return activation<0>(); }
+	const auto &input() const { return activation<0>(); }
+
+	auto &get_output() { return activation<layer_count>(); }
+	const auto &get_output() const { return activation<layer_count>(); }
+
+	alignas(plan::alignment) unsigned char storage[size];
+};
+
+// -----------------------------------------------------------------------------
+
+// part of the inference pass, layers First to Last - 1, for running a network
+// a piece at a time (see cascade.hpp). activation<First> has to be filled in,
+// and activation<Last> is what comes out. the pieces have to go in order, the
+// plan reuses a layer's buffers once the layers after it are done with them.
+template <unsigned First, unsigned Last, unsigned N, typename NetworkType, bool Training>
+void forward_layers(workspace_t<N, NetworkType, Training> &work,
+                    const params_t<NetworkType> &params,
+                    const unsigned count = N)
+{
+	static_assert(First <= Last && Last <= layer_count_v<NetworkType>);
+	static_assert(!Training || !is_stateful_v<NetworkType>, "the network has layers with state, train it with forward(work, params, random)");
+
+	if constexpr(First < Last)
+	{
+		forward_layer<network_at_t<NetworkType, First>, N>(
+			work.template activation<First>(),
+			work.template activation<First + 1>(),
+			params.template offset<param_offset_v<NetworkType, First>>(),
+			count
+		);
+
+		forward_layers<First + 1, Last>(work, params, count);
+	}
+}
+
+template <unsigned I, unsigned N, typename NetworkType>
+void _forward(workspace_t<N, NetworkType, true> &work,
+              const params_t<NetworkType> &params,
+              philox &random)
+{
+	using layer_network = network_at_t<NetworkType, I>;
+
+	forward_layer<layer_network, N>(
+		work.template activation<I>(),
+		work.template activation<I + 1>(),
+		work.template state<I>(),
+		params.template offset<param_offset_v<NetworkType, I>>(),
+		random
+	);
+
+	if constexpr(!layer_network::is_final_layer)
+		_forward<I + 1>(work, params, random);
+}
+
+// the inference pass. only the first count samples are run if given, the rest
+// of the output is left as it was. a training workspace of a network with
+// stateful layers wants the training pass below.
+template <unsigned N, typename NetworkType, bool Training>
+auto forward(workspace_t<N, NetworkType, Training> &work,
+             const params_t<NetworkType> &params,
+             const unsigned count = N) -> const output_t<N, NetworkType> &
+{
+	static_assert(!Training || !is_stateful_v<NetworkType>, "the network has layers with state, train it with forward(work, params, random)");
+
+	forward_layers<0, layer_count_v<NetworkType>>(work, params, count);
+	return work.get_output();
+}
+
+// the training pass, which keeps the stateful layers' state and samples it
+// for the random ones
+template <unsigned N, typename NetworkType>
+auto forward(workspace_t<N, NetworkType, true> &work,
+             const params_t<NetworkType> &params,
+             philox &random) -> const output_t<N, NetworkType> &
+{
+	_forward<0>(work, params, random);
+	return work.get_output();
+}
+
+// -----------------------------------------------------------------------------
+
+// which params a sparse gradient has, and where they are in it: all of a
+// dense layer's, and the rows of a sparse layer the batch used. sparse_backward
+// collects them, and an update goes over them with for_each_range:
+//
+//     thread_local nn::sparse_rows<MyNetwork> rows;
+//     auto &gradient = scratch.make<nn::sparse_gradient_t<N, MyNetwork>>();
+//
+//     forward(work, params);
+//     sparse_backward<Cost>(expectation, work, params, gradient, rows);
+//
+//     rows.for_each_range([&](unsigned first, unsigned from, unsigned count)
+//     {
+//         ... params[first + i] against gradient[from + i] ...
+//     });
+//
+// keep one from step to step, it holds on to its vectors so as not to
+// allocate every time.
+template <typename NetworkType>
+class sparse_rows
+{
+public:
+	static constexpr unsigned layer_count = layer_count_v<NetworkType>;
+
+	// it takes a training workspace only, an inference one reuses the input's
+	// memory for later layers, so by the end of forward the ids are gone
+	template <unsigned N>
+	void collect(const workspace_t<N, NetworkType, true> &work)
+	{
+		gradient_offsets = sparse_offsets_v<N, NetworkType>;
+		_collect(work, std::make_index_sequence<layer_count>());
+	}
+
+	// f(first, from, count) for each run of count params with a gradient,
+	// in order: params first onwards, whose gradient is from onwards
+	template <typename F>
+	void for_each_range(F &&f) const
+	{
+		constexpr auto offsets = param_offsets_v<NetworkType>;
+		constexpr auto row_sizes = row_sizes_v<NetworkType>;
+
+		for (unsigned l = 0; l < layer_count; l++)
+		{
+			if (row_sizes[l] == 0)
+			{
+				if (offsets[l + 1] > offsets[l])
+					f(offsets[l], gradient_offsets[l], offsets[l + 1] - offsets[l]);
+				continue;
+			}
+
+			for (unsigned k = 0; k < rows[l].size(); k++)
+				f(offsets[l] + rows[l][k] * row_sizes[l], gradient_offsets[l] + k * row_sizes[l], row_sizes[l]);
+		}
+	}
+
+	// the rows of layer l the batch used, sorted, nothing for a dense layer
+	const std::vector<unsigned> &layer_rows(const unsigned l) const
+	{
+		return rows[l];
+	}
+
+private:
+	std::array<std::vector<unsigned>, layer_count> rows;
+	std::array<unsigned, layer_count + 1> gradient_offsets{};
+
+	template <unsigned N, std::size_t... Is>
+	void _collect(const workspace_t<N, NetworkType, true> &work, std::index_sequence<Is...>)
+	{
+		(_collect_layer<Is>(work), ...);
+	}
+
+	template <unsigned I, unsigned N>
+	void _collect_layer(const workspace_t<N, NetworkType, true> &work)
+	{
+		using layer_network = network_at_t<NetworkType, I>;
+
+		if constexpr(is_sparse_v<typename layer_network::layer>)
+			used_rows<layer_network, N>(work.template activation<I>(), rows[I]);
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+// Sparse is sparse_backward's, where delta_params is a sparse_gradient_t and
+// rows says which rows of the sparse layers it has
+template <typename CostFunctionType, unsigned I, bool Sparse = false, unsigned N, typename NetworkType, unsigned DeltaSize, typename LayerReady>
+void _backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+               workspace_t<N, NetworkType, true> &work,
+               const params_t<NetworkType> &params,
+               vector<DeltaSize> &delta_params,
+               float *cost_value,
+               LayerReady &on_layer_ready,
+               const gradient_mode mode = gradient_mode::overwrite,
+               const sparse_rows<NetworkType> *rows = nullptr)
+{
+	using layer_network = network_at_t<NetworkType, I>;
+	using layer = typename layer_network::layer;
+
+	constexpr unsigned param_offset = param_offset_v<NetworkType, I>;
+	constexpr unsigned delta_offset = Sparse ? sparse_offset_v<N, NetworkType, I> : param_offset;
+	constexpr layer_gradient ready{ I, delta_offset, Sparse ? sparse_param_count_v<N, layer> : layer_param_count_v<layer> };
+
+	if constexpr(layer_network::is_final_layer)
+	{
+		if (output_delta<CostFunctionType, layer_network, N>(
+				expectation,
+				work.template activation<I>(),
+				work.template activation<I + 1>(),
+				work.template delta<I>(),
+				work.template delta<I + 1>(),
+				cost_value))
+		{
+			on_layer_ready(ready);
+			return;
+		}
+	}
+	else
+	{
+		_backward<CostFunctionType, I + 1, Sparse>(expectation, work, params, delta_params, cost_value, on_layer_ready, mode, rows);
+	}
+
+	if constexpr(Sparse && is_sparse_v<layer>)
+	{
+		sparse_backward_layer<layer_network, N>(
+			work.template activation<I>(),
+			work.template delta<I>(),
+			work.template delta<I + 1>(),
+			rows->layer_rows(I),
+			delta_params.template offset<delta_offset>()
+		);
+	}
+	else
+	{
+		backward_layer<layer_network, N>(
+			work.template activation<I>(),
+			work.template activation<I + 1>(),
+			work.template state<I>(),
+			params.template offset<param_offset>(),
+			work.template delta<I>(),
+			work.template delta<I + 1>(),
+			delta_params.template offset<delta_offset>(),
+			mode
+		);
+	}
+
+	on_layer_ready(ready);
+}
+
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+auto backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+              workspace_t<N, NetworkType, true> &work,
+              const params_t<NetworkType> &params,
+              params_t<NetworkType> &delta_params,
+              LayerReady &&on_layer_ready = LayerReady()) -> decltype(delta_params)
+{
+	_backward<CostFunctionType, 0>(expectation, work, params, delta_params, nullptr, on_layer_ready);
+	return delta_params;
+}
+
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+float cost_and_backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                        workspace_t<N, NetworkType, true> &work,
+                        const params_t<NetworkType> &params,
+                        params_t<NetworkType> &delta_params,
+                        LayerReady &&on_layer_ready = LayerReady())
+{
+	float value = 0.0f;
+	_backward<CostFunctionType, 0>(expectation, work, params, delta_params, &value, on_layer_ready);
+	return value;
+}
+
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+float accumulate_backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                          workspace_t<N, NetworkType, true> &work,
+                          const params_t<NetworkType> &params,
+                          params_t<NetworkType> &delta_params,
+                          LayerReady &&on_layer_ready = LayerReady())
+{
+	float value = 0.0f;
+	_backward<CostFunctionType, 0>(expectation, work, params, delta_params, &value, on_layer_ready, gradient_mode::accumulate);
+	return value;
+}
+
+// cost_and_backward into a sparse_gradient_t, so that a step with a big
+// embedding only costs, and only needs the memory for, the rows it touches.
+// rows is filled in with which rows those are, for the update to go by (see
+// sparse_rows), and the hook's layer_gradient offsets are into gradient.
+template <typename CostFunctionType, unsigned N, typename NetworkType, typename LayerReady = no_layer_hook>
+float sparse_backward(const expectation_t<N, CostFunctionType, NetworkType> &expectation,
+                      workspace_t<N, NetworkType, true> &work,
+                      const params_t<NetworkType> &params,
+                      sparse_gradient_t<N, NetworkType> &gradient,
+                      sparse_rows<NetworkType> &rows,
+                      LayerReady &&on_layer_ready = LayerReady())
+{
+	rows.collect(work);
+
+	float value = 0.0f;
+	_backward<CostFunctionType, 0, true>(expectation, work, params, gradient, &value, on_layer_ready, gradient_mode::overwrite, &rows);
+	return value;
+}
+
+} // nn
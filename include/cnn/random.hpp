@@ -0,0 +1,298 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "tensor.hpp"
+#include "fast_math.hpp"
+
+// random numbers for param init, shuffling, minibatches and dropout.
+//
+// philox (Salmon et al, "Parallel random numbers: as easy as 1, 2, 3") is a
+// counter based generator: the numbers are a keyed hash of their position, so
+// there's no state to share between threads, and any position can be jumped
+// straight to. a generator is a seed, a stream and a position, and two
+// generators with the same seed and different streams never overlap.
+//
+// that's how results stay the same whatever the thread count: give each layer
+// or each piece of work its own stream (or the same stream, seeked to where
+// its piece starts) rather than giving each thread a generator, and it doesn't
+// matter which thread ends up doing it.
+//
+// nothing is seeded from the clock. the same seed gives the same run.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+class philox
+{
+public:
+	// a UniformRandomBitGenerator, so std::shuffle and the std distributions
+	// take one too
+	using result_type = std::uint32_t;
+
+	static constexpr std::uint64_t default_seed = 0x853c49e6748fea9bull;
+
+	// values come in blocks of 4, one block per counter step
+	static constexpr unsigned block_size = 4;
+
+	explicit philox(const std::uint64_t seed = default_seed, const std::uint64_t stream = 0)
+		: seed(seed), stream_(stream)
+	{
+	}
+
+	// another generator on the same seed that never overlaps this one
+	philox stream(const std::uint64_t id) const { return philox(seed, id); }
+
+	std::uint64_t get_seed() const { return seed; }
+	std::uint64_t get_stream() const { return stream_; }
+
+	// jumps to the start of block, so that a generator seeked to n / block_size
+	// carries on exactly where one that'd already made n values would
+	void seek(const std::uint64_t block)
+	{
+		position = block;
+		buffered = 0;
+	}
+
+	// the block the next bulk fill starts at
+	std::uint64_t tell() const { return position; }
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()()
+	{
+		if (buffered == 0)
+		{
+			_block(key(), counter(position++), buffer);
+			buffered = block_size;
+		}
+		return buffer[block_size - buffered--];
+	}
+
+	// [0, 1)
+	float uniform() { return _uniform((*this)()); }
+
+	// wastes the rest of a block, fill_normal is the way to get lots
+	float normal()
+	{
+		float value;
+		fill_normal(&value, 1);
+		return value;
+	}
+
+	// [0, n), without the bias of (*this)() % n
+	unsigned below(const unsigned n)
+	{
+		// lemire's multiply and reject
+		std::uint64_t m = static_cast<std::uint64_t>((*this)()) * n;
+		if (static_cast<std::uint32_t>(m) < n)
+		{
+			const std::uint32_t threshold = (0u - n) % n;
+			while (static_cast<std::uint32_t>(m) < threshold)
+				m = static_cast<std::uint64_t>((*this)()) * n;
+		}
+		return static_cast<unsigned>(m >> 32);
+	}
+
+	// the bulk fills work straight from the counter a chunk of blocks at a time,
+	// in loops that vectorise, and always start on a fresh block. anything left
+	// over from operator() is dropped.
+
+	void fill_uniform(float *values, const std::size_t count, const float lower = 0.0f, const float upper = 1.0f)
+	{
+		_fill(values, count, [=](const std::uint32_t *bits, float *out, const unsigned n)
+		{
+			for (unsigned i = 0; i < n; i++)
+				out[i] = lower + (upper - lower) * _uniform(bits[i]);
+		});
+	}
+
+	// box-muller, a pair of normals from each pair of values
+	void fill_normal(float *values, const std::size_t count, const float mean = 0.0f, const float deviation = 1.0f)
+	{
+		_fill(values, count, [=](const std::uint32_t *bits, float *out, const unsigned n)
+		{
+			for (unsigned i = 0; i < n; i += 2)
+			{
+				// (0, 1] so the log is finite
+				const float u = 1.0f - _uniform(bits[i]);
+				const float r = deviation * std::sqrt(-2.0f * math::log(u));
+
+				float s, c;
+				_sincos_turns(_uniform(bits[i + 1]), s, c);
+
+				out[i] = mean + r * c;
+				out[i + 1] = mean + r * s;
+			}
+		});
+	}
+
+	// count bits, each set with probability p, packed 32 to a word from the
+	// lowest bit up. every word takes 8 blocks, and the bits past count in the
+	// last word are clear.
+	void fill_bits(std::uint32_t *words, const std::size_t count, const float p)
+	{
+		// compared against the top 24 bits, like _uniform
+		const std::uint32_t threshold = static_cast<std::uint32_t>(static_cast<double>(p) * (1u << 24) + 0.5);
+
+		for (std::size_t first = 0; first < count; first += chunk_size)
+		{
+			const unsigned n = static_cast<unsigned>(count - first < chunk_size ? count - first : chunk_size);
+
+			const unsigned word_count = (n + 31) / 32;
+
+			std::uint32_t bits[chunk_size];
+			_blocks(bits, word_count * 32 / block_size);
+
+			for (unsigned w = 0; w < word_count; w++)
+			{
+				std::uint32_t word = 0;
+				for (unsigned b = 0; b < 32; b++)
+					word |= static_cast<std::uint32_t>((bits[w * 32 + b] >> 8) < threshold) << b;
+
+				const unsigned valid = n - w * 32;
+				if (valid < 32)
+					word &= (1u << valid) - 1;
+
+				words[first / 32 + w] = word;
+			}
+		}
+	}
+
+	template <typename Shape>
+	void fill_normal(tensor<Shape> &values, const float mean = 0.0f, const float deviation = 1.0f)
+	{
+		fill_normal(reinterpret_cast<float *>(&values), Shape::count, mean, deviation);
+	}
+
+	template <typename Shape>
+	void fill_uniform(tensor<Shape> &values, const float lower = 0.0f, const float upper = 1.0f)
+	{
+		fill_uniform(reinterpret_cast<float *>(&values), Shape::count, lower, upper);
+	}
+
+private:
+	// values per chunk in the bulk fills, a multiple of 32 so that fill_bits'
+	// words never straddle two chunks
+	static constexpr unsigned chunk_size = 64 * block_size;
+
+	struct key_t { std::uint32_t k0, k1; };
+	struct counter_t { std::uint32_t c0, c1, c2, c3; };
+
+	key_t key() const
+	{
+		return { static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32) };
+	}
+
+	counter_t counter(const std::uint64_t block) const
+	{
+		return {
+			static_cast<std::uint32_t>(block), static_cast<std::uint32_t>(block >> 32),
+			static_cast<std::uint32_t>(stream_), static_cast<std::uint32_t>(stream_ >> 32)
+		};
+	}
+
+	// philox4x32-10
+	static void _block(key_t k, counter_t c, std::uint32_t (&out)[block_size])
+	{
+		for (unsigned round = 0; round < 10; round++)
+		{
+			const std::uint64_t p0 = static_cast<std::uint64_t>(0xD2511F53u) * c.c0;
+			const std::uint64_t p1 = static_cast<std::uint64_t>(0xCD9E8D57u) * c.c2;
+
+			c = {
+				static_cast<std::uint32_t>(p1 >> 32) ^ c.c1 ^ k.k0,
+				static_cast<std::uint32_t>(p1),
+				static_cast<std::uint32_t>(p0 >> 32) ^ c.c3 ^ k.k1,
+				static_cast<std::uint32_t>(p0)
+			};
+
+			k.k0 += 0x9E3779B9u;
+			k.k1 += 0xBB67AE85u;
+		}
+
+		out[0] = c.c0;
+		out[1] = c.c1;
+		out[2] = c.c2;
+		out[3] = c.c3;
+	}
+
+	// the next count blocks, into bits
+	void _blocks(std::uint32_t *bits, const unsigned count)
+	{
+		const key_t k = key();
+		for (unsigned b = 0; b < count; b++)
+		{
+			std::uint32_t block[block_size];
+			_block(k, counter(position + b), block);
+			for (unsigned i = 0; i < block_size; i++)
+				bits[b * block_size + i] = block[i];
+		}
+
+		position += count;
+		buffered = 0;
+	}
+
+	template <typename Transform>
+	void _fill(float *values, const std::size_t count, Transform transform)
+	{
+		for (std::size_t first = 0; first < count; first += chunk_size)
+		{
+			const unsigned n = static_cast<unsigned>(count - first < chunk_size ? count - first : chunk_size);
+			const unsigned blocks = (n + block_size - 1) / block_size;
+
+			std::uint32_t bits[chunk_size];
+			_blocks(bits, blocks);
+
+			// a whole number of blocks, then keep what was asked for
+			float out[chunk_size];
+			transform(bits, out, blocks * block_size);
+			for (unsigned i = 0; i < n; i++)
+				values[first + i] = out[i];
+		}
+	}
+
+	// the top 24 bits, so every value is exactly representable
+	static float _uniform(const std::uint32_t bits)
+	{
+		return static_cast<float>(bits >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// sin and cos of 2 pi t for t in [0, 1), branch free. t is split into a
+	// quarter turn and what's left, in [-1/8, 1/8) of a turn, where short
+	// polynomials are good to a few ulp.
+	static void _sincos_turns(const float t, float &s, float &c)
+	{
+		const float quarters = 4.0f * t;
+		const float q = static_cast<float>(static_cast<int>(quarters + 0.5f));
+		const float x = (quarters - q) * 1.57079632679f;
+		const float x2 = x * x;
+
+		const float sx = x * (1.0f + x2 * (-1.66666667e-1f + x2 * (8.33333333e-3f + x2 * (-1.98412698e-4f + x2 * 2.75573192e-6f))));
+		const float cx = 1.0f + x2 * (-0.5f + x2 * (4.16666667e-2f + x2 * (-1.38888889e-3f + x2 * 2.48015873e-5f)));
+
+		// rotate by q quarter turns
+		const int quadrant = static_cast<int>(q) & 3;
+		const bool swap = quadrant & 1;
+		const float sign_s = (quadrant == 2 || quadrant == 3) ? -1.0f : 1.0f;
+		const float sign_c = (quadrant == 1 || quadrant == 2) ? -1.0f : 1.0f;
+
+		s = sign_s * (swap ? cx : sx);
+		c = sign_c * (swap ? sx : cx);
+	}
+
+	std::uint64_t seed;
+	std::uint64_t stream_;
+	std::uint64_t position = 0;
+
+	std::uint32_t buffer[block_size];
+	unsigned buffered = 0;
+};
+
+} // nn
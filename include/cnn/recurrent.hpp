@@ -0,0 +1,500 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+
+#include "tensor.hpp"
+#include "math.hpp"
+#include "fast_math.hpp"
+#include "random.hpp"
+#include "util.hpp"
+
+// recurrent layers, for inputs that are sequences. the input's first dimension
+// is time and the rest of it is one timestep, so shape_t<T, D> is T timesteps
+// of D values. the output is the hidden state after the last timestep, or the
+// hidden state at every timestep (shape_t<T, Hidden>) to go into another
+// recurrent layer.
+//
+// the sequence length and the hidden size are both template params, so the
+// activations backprop through time needs are a fixed size too, and live in
+// the layer's state_t (see network.hpp) in the workspace like any other
+// buffer. the input's part of every gate at every timestep is one matrix
+// product up front, and each timestep after that is one more product, of the
+// hidden state with the recurrent weights of all the gates side by side.
+
+namespace nn
+{
+
+namespace layers
+{
+
+// -----------------------------------------------------------------------------
+
+// timesteps at a time the inference forward works out the input's part of the
+// gates for. it has no state to put all of them in.
+constexpr unsigned recurrent_chunk = 8;
+
+// what lstm and gru have in common, Gates being how many of the hidden size
+// the gates take up between them
+template <typename InputShape, unsigned HiddenSize, bool AllTimesteps, unsigned Gates>
+struct _recurrent
+{
+	static_assert(InputShape::dim > 1, "the input to a recurrent layer is a sequence, timesteps first");
+
+	static constexpr unsigned input_size = InputShape::next_shape::count;
+	static constexpr unsigned timesteps = InputShape::count / input_size;
+	static constexpr unsigned gate_count = Gates * HiddenSize;
+
+	// the weights are used once a timestep, see layer_flops_v
+	static constexpr std::size_t flops = std::size_t(timesteps) * 2 * (input_size + HiddenSize + 1) * gate_count;
+
+	using output_shape = std::conditional_t<AllTimesteps, shape_t<timesteps, HiddenSize>, shape_t<HiddenSize>>;
+
+	using sequence_t = matrix<timesteps, input_size>;
+	using hidden_t = vector<HiddenSize>;
+	using gates_t = vector<gate_count>;
+
+	static const sequence_t &_sequence(const tensor<InputShape> &input)
+	{
+		return reinterpret_cast<const sequence_t &>(input);
+	}
+
+	static sequence_t &_sequence(tensor<InputShape> &input)
+	{
+		return reinterpret_cast<sequence_t &>(input);
+	}
+
+	// x * weight + bias for Rows timesteps of input at once
+	template <unsigned Rows>
+	static void _project(const float *input,
+                         float *gates,
+                         const matrix<input_size, gate_count> &weight,
+                         const gates_t &bias)
+	{
+		auto &z = *reinterpret_cast<matrix<Rows, gate_count> *>(gates);
+
+		math::product(z, *reinterpret_cast<const matrix<Rows, input_size> *>(input), weight);
+		for (unsigned t = 0; t < Rows; t++)
+			z[t] += bias;
+	}
+
+	// the same for the timesteps from first on, up to a chunk of them
+	static unsigned _project_chunk(const sequence_t &input,
+                                   const unsigned first,
+                                   matrix<std::min(timesteps, recurrent_chunk), gate_count> &gates,
+                                   const matrix<input_size, gate_count> &weight,
+                                   const gates_t &bias)
+	{
+		constexpr unsigned chunk = std::min(timesteps, recurrent_chunk);
+
+		const float *in = reinterpret_cast<const float *>(&input) + first * input_size;
+		float *out = reinterpret_cast<float *>(&gates);
+
+		if (first + chunk <= timesteps)
+		{
+			_project<chunk>(in, out, weight, bias);
+			return chunk;
+		}
+
+		if constexpr(timesteps % chunk != 0)
+			_project<timesteps % chunk>(in, out, weight, bias);
+		return timesteps % chunk;
+	}
+
+	static void _output(const hidden_t &hidden, const unsigned t, tensor<output_shape> &output)
+	{
+		if constexpr(AllTimesteps)
+			output[t] = hidden;
+		else if (t == timesteps - 1)
+			output = hidden;
+	}
+
+	// the output's delta for the hidden state at timestep t
+	static void _delta_output(const tensor<output_shape> &delta_output, const unsigned t, hidden_t &delta_hidden)
+	{
+		if constexpr(AllTimesteps)
+			delta_hidden += delta_output[t];
+		else if (t == timesteps - 1)
+			delta_hidden += delta_output;
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+// long short-term memory (Hochreiter & Schmidhuber), with the gates laid out
+// input, forget, output, candidate so that the first three are one run of
+// logistics
+template <unsigned HiddenSize, bool AllTimesteps = false>
+struct lstm
+{
+	template <typename InputShape>
+	struct type : _recurrent<InputShape, HiddenSize, AllTimesteps, 4>
+	{
+		using base = _recurrent<InputShape, HiddenSize, AllTimesteps, 4>;
+
+		using typename base::output_shape;
+		using typename base::hidden_t;
+		using typename base::gates_t;
+
+		using base::input_size;
+		using base::timesteps;
+		using base::gate_count;
+
+		static constexpr unsigned input_gate = 0;
+		static constexpr unsigned forget_gate = HiddenSize;
+		static constexpr unsigned output_gate = 2 * HiddenSize;
+		static constexpr unsigned candidate = 3 * HiddenSize;
+
+		struct params_t
+		{
+			matrix<input_size, gate_count> input_weight;
+			matrix<HiddenSize, gate_count> recurrent_weight;
+			gates_t bias;
+
+			void randomise(philox &random)
+			{
+				nn::util::randomise(input_weight, random) /= input_size;
+				nn::util::randomise(recurrent_weight, random) /= HiddenSize;
+
+				// the forget gate starts out mostly open, so that to begin
+				// with the cell remembers rather than forgets
+				bias.zero();
+				for (unsigned h = 0; h < HiddenSize; h++)
+					bias[forget_gate + h] = 1.0f;
+			}
+		};
+
+		// every timestep's gates (after their non-linearities), cell and
+		// hidden state, for backprop through time
+		struct state_t
+		{
+			matrix<timesteps, gate_count> gates;
+			matrix<timesteps, HiddenSize> cell;
+			matrix<timesteps, HiddenSize> hidden;
+		};
+
+		// one timestep. gates comes in as the input's part of them and goes
+		// out as the gates. there's no hidden state or cell before the first
+		// timestep.
+		static void _step(gates_t &gates,
+                          const hidden_t *hidden_before,
+                          const hidden_t *cell_before,
+                          hidden_t &cell,
+                          hidden_t &hidden,
+                          const params_t &params)
+		{
+			if (hidden_before)
+			{
+				gates_t recurrent;
+				gates += math::product(recurrent, *hidden_before, params.recurrent_weight);
+			}
+
+			float *z = gates.data();
+			for (unsigned g = 0; g < candidate; g++)
+				z[g] = math::logistic(z[g]);
+			for (unsigned g = candidate; g < gate_count; g++)
+				z[g] = math::tanh(z[g]);
+
+			for (unsigned h = 0; h < HiddenSize; h++)
+			{
+				const float c = z[input_gate + h] * z[candidate + h] + (cell_before ? z[forget_gate + h] * (*cell_before)[h] : 0.0f);
+
+				cell[h] = c;
+				hidden[h] = z[output_gate + h] * math::tanh(c);
+			}
+		}
+
+		// outside of training
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            const params_t &params)
+		{
+			matrix<std::min(timesteps, recurrent_chunk), gate_count> gates;
+			hidden_t cell[2], hidden[2];
+
+			for (unsigned first = 0; first < timesteps; )
+			{
+				const unsigned rows = base::_project_chunk(base::_sequence(input), first, gates, params.input_weight, params.bias);
+
+				for (unsigned r = 0; r < rows; r++)
+				{
+					const unsigned t = first + r;
+					const unsigned now = t % 2, before = 1 - now;
+
+					_step(gates[r], t ? &hidden[before] : nullptr, t ? &cell[before] : nullptr, cell[now], hidden[now], params);
+					base::_output(hidden[now], t, output);
+				}
+
+				first += rows;
+			}
+		}
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            state_t &state,
+                            const params_t &params)
+		{
+			base::template _project<timesteps>(reinterpret_cast<const float *>(&input), reinterpret_cast<float *>(&state.gates), params.input_weight, params.bias);
+
+			for (unsigned t = 0; t < timesteps; t++)
+			{
+				_step(state.gates[t], t ? &state.hidden[t - 1] : nullptr, t ? &state.cell[t - 1] : nullptr, state.cell[t], state.hidden[t], params);
+				base::_output(state.hidden[t], t, output);
+			}
+		}
+
+		static void backward(const tensor<InputShape> &input,
+                             const tensor<output_shape> &output,
+                             const state_t &state,
+                             const params_t &params,
+                             tensor<InputShape> &delta_input,
+                             const tensor<output_shape> &delta_output,
+                             params_t &delta_params)
+		{
+			// ADDING to delta_params, same as fully_connected
+			const auto &x = base::_sequence(input);
+			auto &delta_x = base::_sequence(delta_input);
+
+			// from the timestep after
+			hidden_t delta_hidden, delta_cell;
+			delta_hidden.zero();
+			delta_cell.zero();
+
+			gates_t delta_gates;
+
+			for (unsigned t = timesteps; t-- > 0; )
+			{
+				base::_delta_output(delta_output, t, delta_hidden);
+
+				const float *z = state.gates[t].data();
+				float *dz = delta_gates.data();
+
+				for (unsigned h = 0; h < HiddenSize; h++)
+				{
+					const float i = z[input_gate + h], f = z[forget_gate + h], o = z[output_gate + h], g = z[candidate + h];
+					const float c_before = t ? state.cell[t - 1][h] : 0.0f;
+					const float tc = math::tanh(state.cell[t][h]);
+
+					const float dc = delta_cell[h] + delta_hidden[h] * o * (1.0f - tc * tc);
+
+					dz[input_gate + h] = dc * g * i * (1.0f - i);
+					dz[forget_gate + h] = dc * c_before * f * (1.0f - f);
+					dz[output_gate + h] = delta_hidden[h] * tc * o * (1.0f - o);
+					dz[candidate + h] = dc * i * (1.0f - g * g);
+
+					delta_cell[h] = dc * f;
+				}
+
+				delta_params.bias += delta_gates;
+				math::add_outer(delta_params.input_weight, x[t], delta_gates);
+				math::product(delta_x[t], params.input_weight, delta_gates);
+
+				if (t > 0)
+				{
+					math::add_outer(delta_params.recurrent_weight, state.hidden[t - 1], delta_gates);
+					math::product(delta_hidden, params.recurrent_weight, delta_gates);
+				}
+			}
+		}
+	};
+};
+
+// -----------------------------------------------------------------------------
+
+// gated recurrent unit (Cho et al), the variant with the reset gate applied
+// after the recurrent product so that all three gates' recurrent products are
+// one product. gates are laid out reset, update, candidate.
+template <unsigned HiddenSize, bool AllTimesteps = false>
+struct gru
+{
+	template <typename InputShape>
+	struct type : _recurrent<InputShape, HiddenSize, AllTimesteps, 3>
+	{
+		using base = _recurrent<InputShape, HiddenSize, AllTimesteps, 3>;
+
+		using typename base::output_shape;
+		using typename base::hidden_t;
+		using typename base::gates_t;
+
+		using base::input_size;
+		using base::timesteps;
+		using base::gate_count;
+
+		static constexpr unsigned reset_gate = 0;
+		static constexpr unsigned update_gate = HiddenSize;
+		static constexpr unsigned candidate = 2 * HiddenSize;
+
+		struct params_t
+		{
+			matrix<input_size, gate_count> input_weight;
+			matrix<HiddenSize, gate_count> recurrent_weight;
+			gates_t bias;
+
+			// the candidate's recurrent part has a bias of its own, as it's
+			// reset along with the product
+			hidden_t recurrent_bias;
+
+			void randomise(philox &random)
+			{
+				nn::util::randomise(input_weight, random) /= input_size;
+				nn::util::randomise(recurrent_weight, random) /= HiddenSize;
+
+				bias.zero();
+				recurrent_bias.zero();
+			}
+		};
+
+		// every timestep's gates (after their non-linearities), the
+		// candidate's recurrent part (before the reset gate) and hidden state,
+		// for backprop through time
+		struct state_t
+		{
+			matrix<timesteps, gate_count> gates;
+			matrix<timesteps, HiddenSize> recurrent;
+			matrix<timesteps, HiddenSize> hidden;
+		};
+
+		// one timestep. gates comes in as the input's part of them and goes
+		// out as the gates. there's no hidden state before the first timestep.
+		static void _step(gates_t &gates,
+                          const hidden_t *hidden_before,
+                          hidden_t &recurrent,
+                          hidden_t &hidden,
+                          const params_t &params)
+		{
+			float *z = gates.data();
+
+			if (hidden_before)
+			{
+				gates_t product;
+				math::product(product, *hidden_before, params.recurrent_weight);
+
+				for (unsigned g = 0; g < candidate; g++)
+					z[g] += product[g];
+				for (unsigned h = 0; h < HiddenSize; h++)
+					recurrent[h] = product[candidate + h] + params.recurrent_bias[h];
+			}
+			else
+			{
+				recurrent = params.recurrent_bias;
+			}
+
+			for (unsigned g = 0; g < candidate; g++)
+				z[g] = math::logistic(z[g]);
+
+			for (unsigned h = 0; h < HiddenSize; h++)
+			{
+				const float n = z[candidate + h] = math::tanh(z[candidate + h] + z[reset_gate + h] * recurrent[h]);
+				const float u = z[update_gate + h];
+
+				hidden[h] = (1.0f - u) * n + (hidden_before ? u * (*hidden_before)[h] : 0.0f);
+			}
+		}
+
+		// outside of training
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            const params_t &params)
+		{
+			matrix<std::min(timesteps, recurrent_chunk), gate_count> gates;
+			hidden_t recurrent, hidden[2];
+
+			for (unsigned first = 0; first < timesteps; )
+			{
+				const unsigned rows = base::_project_chunk(base::_sequence(input), first, gates, params.input_weight, params.bias);
+
+				for (unsigned r = 0; r < rows; r++)
+				{
+					const unsigned t = first + r;
+					const unsigned now = t % 2, before = 1 - now;
+
+					_step(gates[r], t ? &hidden[before] : nullptr, recurrent, hidden[now], params);
+					base::_output(hidden[now], t, output);
+				}
+
+				first += rows;
+			}
+		}
+
+		static void forward(const tensor<InputShape> &input,
+                            tensor<output_shape> &output,
+                            state_t &state,
+                            const params_t &params)
+		{
+			base::template _project<timesteps>(reinterpret_cast<const float *>(&input), reinterpret_cast<float *>(&state.gates), params.input_weight, params.bias);
+
+			for (unsigned t = 0; t < timesteps; t++)
+			{
+				_step(state.gates[t], t ? &state.hidden[t - 1] : nullptr, state.recurrent[t], state.hidden[t], params);
+				base::_output(state.hidden[t], t, output);
+			}
+		}
+
+		static void backward(const tensor<InputShape> &input,
+                             const tensor<output_shape> &output,
+                             const state_t &state,
+                             const params_t &params,
+                             tensor<InputShape> &delta_input,
+                             const tensor<output_shape> &delta_output,
+                             params_t &delta_params)
+		{
+			// ADDING to delta_params, same as fully_connected
+			const auto &x = base::_sequence(input);
+			auto &delta_x = base::_sequence(delta_input);
+
+			// from the timestep after
+			hidden_t delta_hidden;
+			delta_hidden.zero();
+
+			// the gates' deltas on the input's side and on the recurrent
+			// side, which only differ by the reset gate on the candidate
+			gates_t delta_gates, delta_recurrent;
+
+			for (unsigned t = timesteps; t-- > 0; )
+			{
+				base::_delta_output(delta_output, t, delta_hidden);
+
+				const float *z = state.gates[t].data();
+				float *dz = delta_gates.data();
+				float *dr = delta_recurrent.data();
+
+				for (unsigned h = 0; h < HiddenSize; h++)
+				{
+					const float r = z[reset_gate + h], u = z[update_gate + h], n = z[candidate + h];
+					const float h_before = t ? state.hidden[t - 1][h] : 0.0f;
+					const float dh = delta_hidden[h];
+
+					const float dn = dh * (1.0f - u) * (1.0f - n * n);
+
+					dz[reset_gate + h] = dr[reset_gate + h] = dn * state.recurrent[t][h] * r * (1.0f - r);
+					dz[update_gate + h] = dr[update_gate + h] = dh * (h_before - n) * u * (1.0f - u);
+					dz[candidate + h] = dn;
+					dr[candidate + h] = dn * r;
+
+					// the part that skips the gates
+					delta_hidden[h] = dh * u;
+				}
+
+				delta_params.bias += delta_gates;
+				math::add_outer(delta_params.input_weight, x[t], delta_gates);
+				math::product(delta_x[t], params.input_weight, delta_gates);
+
+				for (unsigned h = 0; h < HiddenSize; h++)
+					delta_params.recurrent_bias[h] += dr[candidate + h];
+
+				if (t > 0)
+				{
+					hidden_t through_gates;
+
+					math::add_outer(delta_params.recurrent_weight, state.hidden[t - 1], delta_recurrent);
+					delta_hidden += math::product(through_gates, params.recurrent_weight, delta_recurrent);
+				}
+			}
+		}
+	};
+};
+
+} // layers
+
+} // nn
@@ -0,0 +1,560 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "arena.hpp"
+#include "versioned.hpp"
+
+// scoring one sample at a time wastes most of what a batched forward pass is
+// good for, so the inference server queues up requests as they come in and
+// runs them through forward in batches. a worker takes a batch as soon as
+// there's MaxBatch requests waiting, or once the oldest one has waited
+// max_wait, whichever comes first, which caps the latency batching adds.
+//
+// requests come in through submit, or over a unix socket with
+// socket_front_end and inference_client.
+//
+// the params live in a versioned_params, so new ones can be loaded into a
+// running server with get_params().load(...) and every batch after that uses
+// them, without the server stopping or a request waiting on the load.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// lock free latency histogram, log scale with 8 buckets per power of two, so
+// percentiles come out to within 1/16th either way
+class latency_histogram
+{
+public:
+	void record(const std::uint64_t nanoseconds)
+	{
+		counts[bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::uint64_t count() const
+	{
+		std::uint64_t total = 0;
+		for (const auto &c : counts)
+			total += c.load(std::memory_order_relaxed);
+		return total;
+	}
+
+	// in nanoseconds, p from 0 to 1
+	double percentile(const double p) const
+	{
+		const std::uint64_t total = count();
+		if (total == 0)
+			return 0.0;
+
+		const std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(p * total + 0.5));
+
+		std::uint64_t seen = 0;
+		for (unsigned b = 0; b < bucket_count; b++)
+		{
+			seen += counts[b].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				return static_cast<double>(bucket_middle(b));
+		}
+
+		return static_cast<double>(bucket_middle(bucket_count - 1));
+	}
+
+	void reset()
+	{
+		for (auto &c : counts)
+			c.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	// 0 to 15 get a bucket each, then 8 per power of two
+	static constexpr unsigned bucket_count = 16 + 60 * 8;
+
+	static unsigned bucket(const std::uint64_t value)
+	{
+		if (value < 16)
+			return static_cast<unsigned>(value);
+
+		unsigned e = 0;
+		for (std::uint64_t v = value; v > 1; v >>= 1)
+			e++;
+
+		return 16 + (e - 4) * 8 + static_cast<unsigned>((value >> (e - 3)) & 7);
+	}
+
+	static std::uint64_t bucket_middle(const unsigned b)
+	{
+		if (b < 16)
+			return b;
+
+		const unsigned e = (b - 16) / 8 + 4;
+		const std::uint64_t width = std::uint64_t(1) << (e - 3);
+		return (8 + (b - 16) % 8) * width + width / 2;
+	}
+
+	std::array<std::atomic<std::uint64_t>, bucket_count> counts{};
+};
+
+// -----------------------------------------------------------------------------
+
+struct server_stats
+{
+	std::uint64_t requests;
+	std::uint64_t batches;
+	double mean_batch_size;
+
+	// from submit to the result being handed back, in microseconds
+	double p50_latency;
+	double p99_latency;
+
+	// since the server started or the stats were last reset
+	double requests_per_second;
+};
+
+template <typename NetworkType, unsigned MaxBatch>
+class inference_server
+{
+public:
+	using input_type = tensor<typename NetworkType::input_shape>;
+	using output_type = tensor<typename NetworkType::output_shape>;
+
+	// called on a worker thread, so keep it quick
+	using callback_type = std::function<void(const output_type &)>;
+
+	struct options
+	{
+		std::chrono::microseconds max_wait{ 500 };
+		unsigned workers = 1;
+	};
+
+	// serves a copy of params
+	explicit inference_server(const params_t<NetworkType> &params, const options &opts = options())
+		: owned_params(std::make_unique<versioned_params<NetworkType>>(params)), params(*owned_params), max_wait(opts.max_wait), started(clock::now())
+	{
+		start(opts);
+	}
+
+	// params has to outlive the server
+	explicit inference_server(versioned_params<NetworkType> &params, const options &opts = options())
+		: params(params), max_wait(opts.max_wait), started(clock::now())
+	{
+		start(opts);
+	}
+
+	inference_server(const inference_server &) = delete;
+	inference_server &operator=(const inference_server &) = delete;
+
+	// anything still queued gets run before this returns
+	~inference_server()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		condition.notify_all();
+
+		for (auto &w : workers)
+			w.join();
+	}
+
+	void submit(const input_type &input, callback_type done)
+	{
+		std::size_t waiting;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(request{ input, std::move(done), clock::now() });
+			waiting = queue.size();
+		}
+
+		// the first one starts a worker's clock, and a full batch needn't wait
+		if (waiting == 1 || waiting >= MaxBatch)
+			condition.notify_all();
+	}
+
+	std::future<output_type> submit(const input_type &input)
+	{
+		auto result = std::make_shared<std::promise<output_type>>();
+		auto future = result->get_future();
+
+		submit(input, [result](const output_type &output) { result->set_value(output); });
+
+		return future;
+	}
+
+	versioned_params<NetworkType> &get_params() { return params; }
+
+	server_stats stats() const
+	{
+		const double seconds = std::chrono::duration<double>(clock::now() - started.load()).count();
+
+		server_stats s;
+		s.requests = requests.load();
+		s.batches = batches.load();
+		s.mean_batch_size = s.batches ? static_cast<double>(s.requests) / s.batches : 0.0;
+		s.p50_latency = latency.percentile(0.50) / 1000.0;
+		s.p99_latency = latency.percentile(0.99) / 1000.0;
+		s.requests_per_second = seconds > 0.0 ? s.requests / seconds : 0.0;
+		return s;
+	}
+
+	void reset_stats()
+	{
+		requests = 0;
+		batches = 0;
+		latency.reset();
+		started = clock::now();
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct request
+	{
+		input_type input;
+		callback_type done;
+		clock::time_point submitted;
+	};
+
+	void start(const options &opts)
+	{
+		for (unsigned w = 0; w < std::max(1u, opts.workers); w++)
+			workers.emplace_back([this] { run(); });
+	}
+
+	void run()
+	{
+		// each worker runs its batches in its own workspace
+		arena scratch(sizeof(workspace_t<MaxBatch, NetworkType, false>) + arena::default_alignment);
+		auto &work = make_workspace<MaxBatch, NetworkType, false>(scratch);
+
+		auto reader = params.make_reader();
+
+		std::vector<request> batch;
+		batch.reserve(MaxBatch);
+
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				condition.wait(lock, [&] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+
+				// hang on for a full batch until the oldest request's waited long enough
+				const clock::time_point deadline = queue.front().submitted + max_wait;
+				condition.wait_until(lock, deadline, [&] { return stopping || queue.size() >= MaxBatch; });
+
+				// another worker might have had them
+				if (queue.empty())
+					continue;
+
+				const std::size_t count = std::min<std::size_t>(queue.size(), MaxBatch);
+				for (std::size_t n = 0; n < count; n++)
+				{
+					batch.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+
+				if (!queue.empty())
+					condition.notify_all();
+			}
+
+			const unsigned count = static_cast<unsigned>(batch.size());
+
+			auto &input = work.input();
+			for (unsigned n = 0; n < count; n++)
+				input[n] = batch[n].input;
+
+			{
+				// the whole batch runs on one version of the params
+				const auto snapshot = reader.acquire();
+				forward(work, *snapshot, count);
+			}
+
+			const auto &output = work.get_output();
+
+			for (unsigned n = 0; n < count; n++)
+			{
+				batch[n].done(output[n]);
+				latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - batch[n].submitted).count()));
+			}
+
+			requests += count;
+			batches++;
+
+			batch.clear();
+		}
+	}
+
+	std::unique_ptr<versioned_params<NetworkType>> owned_params;
+	versioned_params<NetworkType> &params;
+	const clock::duration max_wait;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<request> queue;
+	bool stopping = false;
+
+	std::vector<std::thread> workers;
+
+	std::atomic<std::uint64_t> requests{ 0 };
+	std::atomic<std::uint64_t> batches{ 0 };
+	latency_histogram latency;
+	std::atomic<clock::time_point> started;
+};
+
+// -----------------------------------------------------------------------------
+
+#if defined(__unix__)
+
+// a request is a 4 byte tag of the client's choosing followed by the input's
+// floats, and the response is the same tag followed by the output's floats.
+// a client can have as many requests going at once as it likes, and they can
+// come back in any order.
+
+inline bool _write_all(const int fd, const void *data, const std::size_t size)
+{
+	for (std::size_t done = 0; done < size; )
+	{
+		const ssize_t n = ::send(fd, static_cast<const char *>(data) + done, size - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+inline bool _read_all(const int fd, void *data, const std::size_t size)
+{
+	for (std::size_t done = 0; done < size; )
+	{
+		const ssize_t n = ::recv(fd, static_cast<char *>(data) + done, size - done, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+inline sockaddr_un _unix_address(const std::string &path)
+{
+	sockaddr_un address{};
+	if (path.size() >= sizeof(address.sun_path))
+		throw std::invalid_argument("unix socket path too long: " + path);
+
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return address;
+}
+
+// serves a server over a unix socket at path, a thread per connection
+template <typename ServerType>
+class socket_front_end
+{
+public:
+	using input_type = typename ServerType::input_type;
+	using output_type = typename ServerType::output_type;
+
+	socket_front_end(ServerType &server, std::string path)
+		: server(server), path(std::move(path))
+	{
+		const sockaddr_un address = _unix_address(this->path);
+		::unlink(this->path.c_str());
+
+		listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listener < 0)
+			throw std::system_error(errno, std::generic_category(), "socket");
+
+		if (::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0 || ::listen(listener, 64) < 0)
+		{
+			const int error = errno;
+			::close(listener);
+			throw std::system_error(error, std::generic_category(), "couldn't listen on " + this->path);
+		}
+
+		acceptor = std::thread([this] { accept_loop(); });
+	}
+
+	socket_front_end(const socket_front_end &) = delete;
+	socket_front_end &operator=(const socket_front_end &) = delete;
+
+	~socket_front_end()
+	{
+		// wakes up accept and every reader
+		::shutdown(listener, SHUT_RDWR);
+		acceptor.join();
+		::close(listener);
+
+		for (auto &s : sessions)
+			::shutdown(s.link->fd, SHUT_RDWR);
+		for (auto &s : sessions)
+			s.reader.join();
+
+		::unlink(path.c_str());
+	}
+
+private:
+	struct connection
+	{
+		explicit connection(const int fd) : fd(fd) {}
+		~connection() { ::close(fd); }
+
+		const int fd;
+		std::mutex write_mutex;
+	};
+
+	struct session
+	{
+		std::shared_ptr<connection> link;
+		std::thread reader;
+		std::atomic<bool> finished{ false };
+	};
+
+	void accept_loop()
+	{
+		for (;;)
+		{
+			const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				return;
+			}
+
+			// tidy up after anyone who's hung up since last time
+			for (auto s = sessions.begin(); s != sessions.end(); )
+			{
+				if (s->finished)
+				{
+					s->reader.join();
+					s = sessions.erase(s);
+				}
+				else
+				{
+					++s;
+				}
+			}
+
+			session &s = sessions.emplace_back();
+			s.link = std::make_shared<connection>(fd);
+			s.reader = std::thread([this, &s] { read_loop(s.link); s.finished = true; });
+		}
+	}
+
+	// responses are written from whichever worker ran the batch, and the
+	// connection lives until the last of them is done with it
+	void read_loop(const std::shared_ptr<connection> c)
+	{
+		std::uint32_t tag;
+		input_type input;
+
+		while (_read_all(c->fd, &tag, sizeof(tag)) && _read_all(c->fd, &input, sizeof(input)))
+		{
+			server.submit(input, [c, tag](const output_type &output)
+			{
+				std::lock_guard<std::mutex> lock(c->write_mutex);
+				if (_write_all(c->fd, &tag, sizeof(tag)))
+					_write_all(c->fd, &output, sizeof(output));
+			});
+		}
+	}
+
+	ServerType &server;
+	std::string path;
+	int listener = -1;
+
+	std::thread acceptor;
+
+	// only touched by the acceptor, until it's been joined
+	std::list<session> sessions;
+};
+
+// the other end of a socket_front_end. not thread safe, use one per thread.
+template <typename NetworkType>
+class inference_client
+{
+public:
+	using input_type = tensor<typename NetworkType::input_shape>;
+	using output_type = tensor<typename NetworkType::output_shape>;
+
+	explicit inference_client(const std::string &path)
+	{
+		const sockaddr_un address = _unix_address(path);
+
+		fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw std::system_error(errno, std::generic_category(), "socket");
+
+		if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0)
+		{
+			const int error = errno;
+			::close(fd);
+			throw std::system_error(error, std::generic_category(), "couldn't connect to " + path);
+		}
+	}
+
+	inference_client(const inference_client &) = delete;
+	inference_client &operator=(const inference_client &) = delete;
+
+	~inference_client()
+	{
+		::close(fd);
+	}
+
+	// false if the server's gone
+	bool send(const std::uint32_t tag, const input_type &input)
+	{
+		return _write_all(fd, &tag, sizeof(tag)) && _write_all(fd, &input, sizeof(input));
+	}
+
+	// blocks for the next response, whichever request it's for
+	bool receive(std::uint32_t &tag, output_type &output)
+	{
+		return _read_all(fd, &tag, sizeof(tag)) && _read_all(fd, &output, sizeof(output));
+	}
+
+	// one request, start to finish
+	bool score(const input_type &input, output_type &output)
+	{
+		std::uint32_t tag;
+		return send(0, input) && receive(tag, output);
+	}
+
+private:
+	int fd = -1;
+};
+
+#endif
+
+} // nn
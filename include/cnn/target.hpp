@@ -0,0 +1,42 @@
+#pragma once
+
+// the hot kernels (the products in math.hpp and the activation loops) are
+// marked NN_KERNEL. with NN_MULTIVERSION defined, gcc and clang compile a
+// copy of each of them per instruction set below, and when the program loads
+// it picks the best one the cpu has, so one binary is as quick on every box
+// as one built with -march for it:
+//
+//     default          x86-64, sse2
+//     arch=x86-64-v2   sse4.2
+//     arch=x86-64-v3   avx2 and fma
+//     arch=x86-64-v4   avx-512
+//
+// the levels (gcc 11 and clang 12 on) rather than cpu names, because naming a
+// cpu tunes for it too, and with gcc 12 the haswell tuned products came out
+// half as slow again as plain avx2. the levels get generic tuning.
+//
+// the build should leave -ffp-contract off (the cmake build does), so that
+// none of them fuse multiplies into adds that the others don't, and every copy
+// comes up with exactly the same numbers.
+//
+// it's x86-64 linux only, the picking is done by the loader (ifunc). anywhere
+// else, or without NN_MULTIVERSION, NN_KERNEL is nothing and you get whatever
+// the compiler was told to target.
+
+#if defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define NN_HAS_TARGET_CLONES 1
+#endif
+#endif
+
+// the helpers the kernels call have to be inlined into every copy, or they're
+// only compiled the once, for the default target, and that's where the loops
+// are. NN_KERNEL_INLINE makes sure of it.
+
+#if defined(NN_MULTIVERSION) && defined(NN_HAS_TARGET_CLONES) && defined(__x86_64__) && defined(__linux__)
+#define NN_KERNEL __attribute__((target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")))
+#define NN_KERNEL_INLINE __attribute__((always_inline)) inline
+#else
+#define NN_KERNEL
+#define NN_KERNEL_INLINE inline
+#endif
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// how the kernels are tiled, per matrix shape, and how many threads to train
+// with. the best block of columns for a vector * matrix (which is most of
+// forward and backward) depends on the shape, the caches of the machine it's
+// running on and what the compiler made of each size, so rather than one
+// size for everything, each shape can have its own, picked by timing them all
+// (see autotune.hpp) and kept in a tuning cache file:
+//
+//     # nn tuning cache
+//     host Intel(R) Xeon(R) Platinum 8375C CPU @ 2.90GHz
+//     vec_mat 784 300 32
+//     vec_mat 300 100 128
+//     threads 784-300-300-100-100-10-10:266610/64 8
+//
+// load it at startup, before the first forward pass:
+//
+//     nn::tuning::load();
+//
+// and every product runs with whatever block was found best for its shape,
+// or the default if there's nothing for it. a cache made on another kind of cpu
+// isn't loaded, that's what the host line is for, so one file per machine
+// type can sit on a shared disk (point NN_TUNING_CACHE at it).
+//
+// the block size only changes the order things are loaded in, never the
+// order anything is added up in, so every size gets exactly the same numbers.
+
+namespace nn
+{
+
+namespace tuning
+{
+
+// -----------------------------------------------------------------------------
+
+// what there is to pick from, and what it always was
+constexpr unsigned blocks[] = { 16, 32, 64, 128 };
+constexpr unsigned default_block = 64;
+
+// one vector * matrix kernel, rows * cols being the matrix's shape
+struct kernel
+{
+	unsigned rows, cols;
+	std::atomic<unsigned> block;
+
+	// nanoseconds per call with the given block size, the best of however
+	// many calls fit in seconds
+	double (*time)(unsigned block, double seconds);
+
+	kernel(const unsigned rows, const unsigned cols, double (*time)(unsigned, double))
+		: rows(rows), cols(cols), block(default_block), time(time)
+	{
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+using _shape = std::pair<unsigned, unsigned>;
+
+struct _registry
+{
+	std::mutex mutex;
+
+	// every kernel that's been run, in a deque so that they never move and
+	// each can hang on to its own
+	std::deque<kernel> kernels;
+
+	// everything in the cache, including shapes nothing here has run yet
+	std::map<_shape, unsigned> blocks;
+	std::map<std::string, unsigned> threads;
+};
+
+inline _registry &_get_registry()
+{
+	static _registry registry;
+	return registry;
+}
+
+inline bool _is_block(const unsigned block)
+{
+	return std::find(std::begin(blocks), std::end(blocks), block) != std::end(blocks);
+}
+
+inline kernel &_register(const unsigned rows, const unsigned cols, double (*time)(unsigned, double))
+{
+	_registry &registry = _get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	kernel &k = registry.kernels.emplace_back(rows, cols, time);
+
+	const auto cached = registry.blocks.find({ rows, cols });
+	if (cached != registry.blocks.end())
+		k.block = cached->second;
+
+	return k;
+}
+
+// the block size for a kernel. the first call registers it, after that it's
+// one relaxed load
+template <unsigned Rows, unsigned Cols>
+unsigned block(double (*time)(unsigned, double))
+{
+	static kernel &k = _register(Rows, Cols, time);
+	return k.block.load(std::memory_order_relaxed);
+}
+
+// kernels registered so far, for the autotuner
+template <typename F>
+void for_each_kernel(F &&f)
+{
+	_registry &registry = _get_registry();
+
+	// not under the lock, f is going to want to run kernels (which might be
+	// registering themselves)
+	std::vector<kernel *> kernels;
+	{
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (kernel &k : registry.kernels)
+			kernels.push_back(&k);
+	}
+
+	for (kernel *k : kernels)
+		f(*k);
+}
+
+// calls f over and over for about seconds, nanoseconds per call for the
+// quickest run of them
+template <typename F>
+double time_calls(F &&f, const double seconds)
+{
+	using clock = std::chrono::steady_clock;
+
+	// a first go to warm the caches up, and to see how many calls make a run
+	// worth timing
+	unsigned calls = 1;
+	for (;;)
+	{
+		const auto start = clock::now();
+		for (unsigned c = 0; c < calls; c++)
+			f();
+		if (clock::now() - start > std::chrono::microseconds(200) || calls >= (1u << 24))
+			break;
+		calls *= 2;
+	}
+
+	double best = 1e300;
+	const auto end = clock::now() + std::chrono::duration<double>(seconds);
+	do
+	{
+		const auto start = clock::now();
+		for (unsigned c = 0; c < calls; c++)
+			f();
+		best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start).count() / calls);
+	}
+	while (clock::now() < end);
+
+	return best;
+}
+
+// -----------------------------------------------------------------------------
+
+// the cpu's model name, what a cache is good for
+inline std::string host()
+{
+	std::string name = "unknown";
+
+#if defined(__linux__)
+	if (FILE *file = fopen("/proc/cpuinfo", "r"))
+	{
+		char line[512];
+		while (fgets(line, sizeof(line), file))
+		{
+			if (strncmp(line, "model name", 10) != 0)
+				continue;
+
+			const char *value = strchr(line, ':');
+			if (!value)
+				continue;
+
+			name = value + 1;
+			name.erase(0, name.find_first_not_of(" \t"));
+			name.erase(name.find_last_not_of(" \t\r\n") + 1);
+			break;
+		}
+		fclose(file);
+	}
+#endif
+
+	return name;
+}
+
+// $NN_TUNING_CACHE, or nn_tuning.txt in the working directory
+inline std::string default_path()
+{
+	const char *path = getenv("NN_TUNING_CACHE");
+	return path && *path ? path : "nn_tuning.txt";
+}
+
+// reads a cache. false if there isn't one or it's for another kind of cpu, in
+// which case everything stays as it was
+inline bool load(const std::string &path = default_path())
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+
+	std::map<_shape, unsigned> blocks;
+	std::map<std::string, unsigned> threads;
+	bool right_host = false;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[512];
+		unsigned rows, cols, value;
+
+		if (strncmp(line, "host ", 5) == 0)
+		{
+			std::string recorded = line + 5;
+			recorded.erase(recorded.find_last_not_of(" \t\r\n") + 1);
+			right_host = recorded == host();
+		}
+		else if (sscanf(line, "vec_mat %u %u %u", &rows, &cols, &value) == 3)
+		{
+			if (_is_block(value))
+				blocks[{ rows, cols }] = value;
+		}
+		else if (sscanf(line, "threads %511s %u", name, &value) == 2)
+		{
+			threads[name] = value;
+		}
+	}
+
+	fclose(file);
+
+	if (!right_host)
+		return false;
+
+	_registry &registry = _get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	for (const auto &[key, value] : blocks)
+		registry.blocks[key] = value;
+	for (const auto &[key, value] : threads)
+		registry.threads[key] = value;
+
+	for (kernel &k : registry.kernels)
+	{
+		const auto cached = registry.blocks.find({ k.rows, k.cols });
+		if (cached != registry.blocks.end())
+			k.block = cached->second;
+	}
+
+	return true;
+}
+
+// writes everything loaded or tuned so far, for this host
+inline bool save(const std::string &path = default_path())
+{
+	_registry &registry = _get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	for (const kernel &k : registry.kernels)
+		registry.blocks[{ k.rows, k.cols }] = k.block;
+
+	// written to the side and renamed over, so a half written cache is never
+	// loaded
+	const std::string temporary = path + ".tmp";
+
+	FILE *file = fopen(temporary.c_str(), "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "# nn tuning cache\n");
+	fprintf(file, "host %s\n", host().c_str());
+
+	for (const auto &[key, value] : registry.blocks)
+		fprintf(file, "vec_mat %u %u %u\n", key.first, key.second, value);
+	for (const auto &[key, value] : registry.threads)
+		fprintf(file, "threads %s %u\n", key.c_str(), value);
+
+	const bool written = fclose(file) == 0;
+
+	remove(path.c_str());
+	return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// thread counts are kept by a name for what's being trained, see autotune.hpp.
+// 0 if there's nothing for it
+inline unsigned threads(const std::string &name)
+{
+	_registry &registry = _get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	const auto cached = registry.threads.find(name);
+	return cached == registry.threads.end() ? 0 : cached->second;
+}
+
+inline void set_threads(const std::string &name, const unsigned count)
+{
+	_registry &registry = _get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	registry.threads[name] = count;
+}
+
+} // tuning
+
+} // nn
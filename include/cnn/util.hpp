@@ -1,9 +1,11 @@
-#include <random>
-#include <chrono>
+#pragma once
+
 #include <array>
+#include <cstdio>
 
 #include "tensor.hpp"
 #include "math.hpp"
+#include "random.hpp"
 
 namespace nn
 {
@@ -11,39 +13,15 @@ namespace nn
 namespace util
 {
 
-// i do NOT wanna have to write this anywhere else
-
-float randn()
-{
-	static std::default_random_engine generator(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count()));
-	static std::normal_distribution<float> distribution;
-
-	return distribution(generator);
-}
+// everything random takes its generator, see random.hpp
 
-template <typename T>
-T rand(const T lower, const T upper)
+template <typename Shape>
+auto randomise(tensor<Shape> &values, philox &random) -> decltype(values)
 {
-	static std::default_random_engine generator(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count()));
-	static std::uniform_int_distribution<T> distribution;
-
-	return distribution(generator, std::uniform_int_distribution<T>::param_type(lower, upper - 1));
-}
-
-template <unsigned N>
-auto randomise(vector<N> &values) -> decltype(values)
-{
-	for (float &v : values)
-		v = randn();
+	random.fill_normal(values);
 	return values;
 }
 
-template <typename Shape, typename = std::enable_if_t<Shape::dim != 1>>
-auto randomise(tensor<Shape> &values) -> decltype(values)
-{
-	return randomise(values.unravel()), values;
-}
-
 template <unsigned N, unsigned M>
 auto normalise(matrix<N, M> &values) -> decltype(values)
 {
@@ -99,60 +77,52 @@ auto expectation_from_labels(const LabelType (&labels)[N], matrix<N, M> &expecta
 }
 
 template <unsigned N>
-auto shuffle(unsigned (&indices)[N]) -> decltype(indices)
+auto shuffle(unsigned (&indices)[N], philox &random) -> decltype(indices)
 {
 	for (unsigned n = 0; n+1 < N; n++)
 	{
-		unsigned ix = rand(n, N);
+		unsigned ix = n + random.below(N - n);
 		if (ix != n)
 			std::swap(indices[n], indices[ix]);
 	}
 	return indices;
 }
 
-/*
-
-
-
-template <typename LabelType, typename T, unsigned N, unsigned M>
-void confusion(T (&conf)[M][M], const std::array<LabelType, N> &expected_labels, const std::array<LabelType, N> &predicted_labels)
-{
-	for (unsigned n = 0; n < N; n++)
-		conf[expected_labels[n]][predicted_labels[n]]++;
-}
-
-template <typename LabelType, unsigned N>
-float accuracy(std::array<LabelType, N> &expected_labels, std::array<LabelType, N> &predicted_labels)
-{
-	int correct = 0;
-	for (unsigned n = 0; n < N; n++)
-		if (expected_labels[n] == predicted_labels[n])
-			correct++;
-	return static_cast<double>(correct) / N;
-}
-*/
+// accuracy, confusion matrices and the like are in metrics.hpp
 
 template <unsigned DataSetSize, unsigned BatchSize, typename InputShape, typename OutputShape>
 void generate_minibatch(
 	const vector_of<DataSetSize, InputShape> &input,
 	const vector_of<DataSetSize, OutputShape> &output,
 	vector_of<BatchSize, InputShape> &batch_input,
-	vector_of<BatchSize, OutputShape> &batch_output)
+	vector_of<BatchSize, OutputShape> &batch_output,
+	philox &random)
 {
 	for (unsigned n = 0; n < BatchSize; n++)
 	{
-		unsigned index = rand<unsigned>(0, DataSetSize);
+		unsigned index = random.below(DataSetSize);
 		batch_input[n] = input[index];
 		batch_output[n] = output[index];
 	}
 }
 
+// fopen, or fopen_s on msvc so that it doesn't complain. null if it can't
+inline FILE *open_file(const char *filename, const char *mode)
+{
+#if defined(_MSC_VER)
+	FILE *file;
+	return fopen_s(&file, filename, mode) == 0 ? file : nullptr;
+#else
+	return fopen(filename, mode);
+#endif
+}
+
 template <unsigned N>
 bool load(const char *filename, vector<N> &values)
 {
-	FILE *file;
+	FILE *file = open_file(filename, "rb");
 
-	if (0 != fopen_s(&file, filename, "rb"))
+	if (!file)
 		return false;
 
 	fread(values.data(), sizeof(float), N, file);
@@ -165,9 +135,9 @@ bool load(const char *filename, vector<N> &values)
 template <unsigned N>
 bool save(const char *filename, const vector<N> &values)
 {
-	FILE *file;
+	FILE *file = open_file(filename, "wb");
 
-	if (0 != fopen_s(&file, filename, "wb"))
+	if (!file)
 		return false;
 
 	fwrite(values.data(), sizeof(float), N, file);
@@ -0,0 +1,389 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "network.hpp"
+
+// swapping a model's params out from under a live server. readers (e.g. the
+// inference server's workers) take a snapshot of whichever params are current
+// without taking a lock, a loader publishes new params whenever it likes, and
+// the old ones are freed once nobody's snapshot still points at them.
+//
+// reclaiming is epoch based: every reader has a slot that it writes the
+// current epoch to before it looks at the params, and clears when it's done.
+// publishing moves the epoch on, so a retired version can go as soon as every
+// busy reader announced a later epoch than the one it was retired in, since
+// they all started after it stopped being current. the freeing (a munmap, or
+// a params sized delete) is only ever done by publish and reclaim, never by a
+// reader, so that it doesn't land on whichever request happened to finish
+// last; a loader that publishes rarely can call reclaim in between.
+//
+// params files are mapped rather than read where possible, and their pages
+// faulted in by the loader, so that neither the load nor the first batches
+// after the swap stall a reader. write a new file and rename it over the old
+// one rather than writing in place: a mapped file that's changed in place
+// changes under the readers.
+
+namespace nn
+{
+
+// -----------------------------------------------------------------------------
+
+// one immutable set of params, either mapped from a file saved with
+// util::save or a copy on the heap
+template <typename NetworkType>
+class params_version
+{
+public:
+	using params_type = params_t<NetworkType>;
+
+	params_version(const params_version &) = delete;
+	params_version &operator=(const params_version &) = delete;
+
+	~params_version()
+	{
+		if (!mapped)
+			return;
+
+#if defined(_WIN32)
+		UnmapViewOfFile(mapped);
+#elif defined(__unix__)
+		munmap(const_cast<void *>(mapped), sizeof(params_type));
+#endif
+	}
+
+	static std::unique_ptr<params_version> copy(const params_type &params)
+	{
+		std::unique_ptr<params_version> version(new params_version());
+		version->owned = std::make_unique<params_type>(params);
+		version->params = version->owned.get();
+		return version;
+	}
+
+	// null if the file can't be opened or is the wrong size for NetworkType
+	static std::unique_ptr<params_version> map(const char *filename)
+	{
+		std::unique_ptr<params_version> version(new params_version());
+
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return nullptr;
+
+		LARGE_INTEGER size;
+		HANDLE mapping = nullptr;
+		if (GetFileSizeEx(file, &size) && size.QuadPart == sizeof(params_type))
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (mapping)
+		{
+			version->mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(params_type));
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+
+		if (!version->mapped)
+			return nullptr;
+#elif defined(__unix__)
+		const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return nullptr;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size == static_cast<off_t>(sizeof(params_type)))
+		{
+			void *p = mmap(nullptr, sizeof(params_type), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+				version->mapped = p;
+		}
+		close(fd);
+
+		if (!version->mapped)
+			return nullptr;
+#else
+		// nothing to map with, read it instead
+		version->owned = std::make_unique<params_type>();
+		if (!util::load(filename, *version->owned))
+			return nullptr;
+		version->params = version->owned.get();
+		return version;
+#endif
+
+		version->params = static_cast<const params_type *>(version->mapped);
+
+		// fault it all in now, rather than on whichever reader gets there first
+		volatile float sink = 0.0f;
+		const float *values = version->params->data();
+		for (std::size_t i = 0; i < param_count_v<NetworkType>; i += 4096 / sizeof(float))
+			sink = sink + values[i];
+
+		return version;
+	}
+
+	const params_type &get() const { return *params; }
+
+	bool is_mapped() const { return mapped != nullptr; }
+
+	// set when it's published, counting up from 1
+	std::uint64_t number() const { return number_; }
+
+private:
+	template <typename> friend class versioned_params;
+
+	params_version() = default;
+
+	const params_type *params = nullptr;
+	std::unique_ptr<params_type> owned;
+	const void *mapped = nullptr;
+	std::uint64_t number_ = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename NetworkType>
+class versioned_params
+{
+public:
+	using params_type = params_t<NetworkType>;
+	using version_type = params_version<NetworkType>;
+
+	static constexpr unsigned default_max_readers = 64;
+
+	explicit versioned_params(std::unique_ptr<version_type> initial, const unsigned max_readers = default_max_readers)
+		: slots(max_readers)
+	{
+		publish(std::move(initial));
+	}
+
+	explicit versioned_params(const params_type &initial, const unsigned max_readers = default_max_readers)
+		: versioned_params(version_type::copy(initial), max_readers)
+	{
+	}
+
+	versioned_params(const versioned_params &) = delete;
+	versioned_params &operator=(const versioned_params &) = delete;
+
+	// every reader has to be gone by now
+	~versioned_params()
+	{
+		delete current.load();
+		for (auto &r : retired)
+			delete r.version;
+	}
+
+	// a snapshot pins whichever version was current when it was taken, for as
+	// long as it's alive
+	class snapshot
+	{
+	public:
+		snapshot(snapshot &&other) noexcept : owner(other.owner), slot(other.slot), version(other.version)
+		{
+			other.owner = nullptr;
+		}
+
+		snapshot(const snapshot &) = delete;
+		snapshot &operator=(const snapshot &) = delete;
+		snapshot &operator=(snapshot &&) = delete;
+
+		~snapshot()
+		{
+			if (owner)
+				owner->release(slot);
+		}
+
+		const params_type &operator*() const { return version->get(); }
+		const params_type *operator->() const { return &version->get(); }
+
+		std::uint64_t number() const { return version->number(); }
+
+	private:
+		friend class versioned_params;
+
+		snapshot(versioned_params *owner, const unsigned slot, const version_type *version)
+			: owner(owner), slot(slot), version(version) {}
+
+		versioned_params *owner;
+		unsigned slot;
+		const version_type *version;
+	};
+
+	// a reader thread's claim on a slot. make one per thread and keep it,
+	// it's acquire that's meant to be cheap, not this.
+	class reader
+	{
+	public:
+		reader(reader &&other) noexcept : owner(other.owner), slot(other.slot)
+		{
+			other.owner = nullptr;
+		}
+
+		reader(const reader &) = delete;
+		reader &operator=(const reader &) = delete;
+		reader &operator=(reader &&) = delete;
+
+		~reader()
+		{
+			if (owner)
+				owner->slots[slot].claimed.store(false, std::memory_order_release);
+		}
+
+		// one at a time per reader
+		snapshot acquire()
+		{
+			return owner->acquire(slot);
+		}
+
+	private:
+		friend class versioned_params;
+
+		reader(versioned_params *owner, const unsigned slot) : owner(owner), slot(slot) {}
+
+		versioned_params *owner;
+		unsigned slot;
+	};
+
+	// throws std::length_error if there are already max_readers readers
+	reader make_reader()
+	{
+		for (unsigned s = 0; s < slots.size(); s++)
+		{
+			bool expected = false;
+			if (slots[s].claimed.compare_exchange_strong(expected, true, std::memory_order_acquire))
+				return reader(this, s);
+		}
+
+		throw std::length_error("out of reader slots");
+	}
+
+	// swaps in the new version, and frees any old ones that nobody's using.
+	// readers never wait on this.
+	void publish(std::unique_ptr<version_type> next)
+	{
+		std::lock_guard<std::mutex> lock(publish_mutex);
+
+		next->number_ = ++published;
+
+		version_type *previous = current.exchange(next.release());
+
+		if (previous)
+		{
+			// anyone who announces a later epoch than this sees the new version
+			retired.push_back(retired_version{ previous, epoch.fetch_add(1) });
+		}
+
+		collect();
+	}
+
+	// maps filename and publishes it, false if it couldn't be loaded
+	bool load(const char *filename)
+	{
+		auto next = version_type::map(filename);
+		if (!next)
+			return false;
+
+		publish(std::move(next));
+		return true;
+	}
+
+	// frees any old versions that nobody's using any more, and says how many
+	// are still waiting. for the loader, or a thread of its own, not a reader.
+	std::size_t reclaim()
+	{
+		std::lock_guard<std::mutex> lock(publish_mutex);
+		collect();
+		return retired.size();
+	}
+
+	std::uint64_t current_number() const { return current.load()->number(); }
+
+	// how many old versions are still waiting on a reader to finish with them
+	std::size_t retired_count()
+	{
+		std::lock_guard<std::mutex> lock(publish_mutex);
+		return retired.size();
+	}
+
+private:
+	struct slot_t
+	{
+		std::atomic<bool> claimed{ false };
+		std::atomic<std::uint64_t> announced{ 0 }; // 0 when not reading
+
+		// one slot per cache line, readers hammer these
+		char padding[64 - sizeof(std::atomic<bool>) - sizeof(std::atomic<std::uint64_t>)];
+	};
+
+	struct retired_version
+	{
+		version_type *version;
+		std::uint64_t epoch;
+	};
+
+	snapshot acquire(const unsigned slot)
+	{
+		// announce first and then look, so that a publish that misses the
+		// announcement must have swapped before the look
+		slots[slot].announced.store(epoch.load());
+		const version_type *version = current.load();
+		return snapshot(this, slot, version);
+	}
+
+	void release(const unsigned slot)
+	{
+		slots[slot].announced.store(0, std::memory_order_release);
+	}
+
+	// publish_mutex held
+	void collect()
+	{
+		std::uint64_t oldest = UINT64_MAX;
+		for (const slot_t &s : slots)
+		{
+			const std::uint64_t announced = s.announced.load();
+			if (announced != 0 && announced < oldest)
+				oldest = announced;
+		}
+
+		for (auto r = retired.begin(); r != retired.end(); )
+		{
+			if (r->epoch < oldest)
+			{
+				delete r->version;
+				r = retired.erase(r);
+			}
+			else
+			{
+				++r;
+			}
+		}
+	}
+
+	std::atomic<version_type *> current{ nullptr };
+	std::atomic<std::uint64_t> epoch{ 1 };
+
+	std::vector<slot_t> slots;
+
+	std::mutex publish_mutex;
+	std::vector<retired_version> retired;
+	std::uint64_t published = 0;
+};
+
+} // nn
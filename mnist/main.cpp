@@ -1,13 +1,25 @@
 #include "cnn/cnn.hpp"
+#include "cnn/arena.hpp"
+#include "cnn/async.hpp"
+#include "cnn/autotune.hpp"
+#include "cnn/learning_rate.hpp"
+#include "cnn/metrics.hpp"
 #include "mnist.hpp"
 
 #include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
 
 constexpr unsigned NUM_TRAINING_SAMPLES = 60'000;
 constexpr unsigned NUM_TEST_SAMPLES = 10'000;
 constexpr unsigned BATCH_SIZE = 100;
+constexpr unsigned TEST_CHUNK_SIZE = 250;
 constexpr unsigned NUM_CLASSES = 10;
 constexpr unsigned IMAGE_SIZE = 28;
+constexpr unsigned EPOCHS = 10;
 
 static_assert(NUM_TRAINING_SAMPLES % BATCH_SIZE == 0, "batch size must perfectly divisible by the number of training samples");
 
@@ -47,34 +59,48 @@ struct program
 	vector_of<NUM_TRAINING_SAMPLES, InputShape> training_images;
 	vector_of<NUM_TRAINING_SAMPLES, OutputShape> training_expectation;
 
-	vector_of<NUM_TEST_SAMPLES, OutputShape> test_expectation;
+	nn::params_t<MyNetwork> params, velocity;
 
-	vector_of<BATCH_SIZE, OutputShape> batch_expectation;
+	// what the end of an epoch tests and checkpoints, while training carries
+	// on with params
+	nn::params_t<MyNetwork> snapshot;
 
-	nn::params_t<MyNetwork> params, gradient, velocity;
-	nn::forward_t<BATCH_SIZE, MyNetwork> fwd, delta_fwd;
+	// everything a training step needs besides the params
+	nn::arena scratch{ nn::step_arena_size_v<BATCH_SIZE, MyNetwork> };
 
-	nn::forward_t<NUM_TEST_SAMPLES, MyNetwork> test_fwd;
+	std::mutex log_mutex;
+	std::unique_ptr<FILE, int (*)(FILE *)> log_file{ nullptr, fclose };
+
+	// last, so that it's the first thing to go and finishes off its tasks
+	// while everything they use is still there
+	nn::executor background{ 2 };
+
+	nn::task<bool> load_training_data();
+	nn::task<bool> load_test_data();
+
+	nn::task<nn::metrics_t<MyNetwork>> evaluate();
+	nn::task<> checkpoint(unsigned epoch);
+	nn::task<> log(std::string line);
+
+	nn::task<> end_of_epoch(unsigned epoch);
 
 	int run(int argc, const char *argv[]);
 };
 
-int program::run(const int argc, const char *argv[])
+nn::task<bool> program::load_training_data()
 {
-	// LOAD TRAINING DATA
-
-	if (!load_idx("data\\train-labels.idx1-ubyte", raw_training_labels))
+	if (!load_idx("data/train-labels.idx1-ubyte", raw_training_labels))
 	{
 		puts("failed to load label file");
-		return 1;
+		co_return false;
 	}
 
 	nn::util::expectation_from_labels(raw_training_labels, training_expectation);
 
-	if (!load_idx("data\\train-images.idx3-ubyte", raw_training_images))
+	if (!load_idx("data/train-images.idx3-ubyte", raw_training_images))
 	{
 		puts("failed to load image file");
-		return 1;
+		co_return false;
 	}
 
 	for (unsigned n = 0; n < NUM_TRAINING_SAMPLES; n++)
@@ -84,88 +110,205 @@ int program::run(const int argc, const char *argv[])
 				training_images[n][i][j] = static_cast<float>(raw_training_images[n][i][j]) / 255.0f;
 	}
 
-	// LOAD TEST DATA
+	co_return true;
+}
 
-	if (!load_idx("data\\t10k-labels.idx1-ubyte", raw_test_labels))
+nn::task<bool> program::load_test_data()
+{
+	if (!load_idx("data/t10k-labels.idx1-ubyte", raw_test_labels))
 	{
 		puts("failed to load label file");
-		return 1;
+		co_return false;
 	}
 
-	nn::util::expectation_from_labels(raw_test_labels, test_expectation);
-
-	if (!load_idx("data\\t10k-images.idx3-ubyte", raw_test_images))
+	// left as bytes, evaluate converts them a chunk at a time
+	if (!load_idx("data/t10k-images.idx3-ubyte", raw_test_images))
 	{
 		puts("failed to load image file");
-		return 1;
+		co_return false;
 	}
 
-	auto &test_images = test_fwd.input;
+	co_return true;
+}
 
-	for (unsigned n = 0; n < NUM_TEST_SAMPLES; n++)
+// how the snapshot does on the test set, on half the cpus so that training
+// still gets a look in
+nn::task<nn::metrics_t<MyNetwork>> program::evaluate()
+{
+	const auto fill_chunk = [&](const unsigned first, const unsigned count, auto &images, auto &expectation)
 	{
-		for (unsigned i = 0; i < IMAGE_SIZE; i++)
-			for (unsigned j = 0; j < IMAGE_SIZE; j++)
-				test_images[n][i][j] = static_cast<float>(raw_test_images[n][i][j]) / 255.0f;
+		for (unsigned n = 0; n < count; n++)
+		{
+			for (unsigned i = 0; i < IMAGE_SIZE; i++)
+				for (unsigned j = 0; j < IMAGE_SIZE; j++)
+					images[n][i][j] = static_cast<float>(raw_test_images[first + n][i][j]) / 255.0f;
+
+			nn::util::expectation_from_label(raw_test_labels[first + n], expectation[n]);
+		}
+	};
+
+	const unsigned threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+	co_return nn::evaluate<TEST_CHUNK_SIZE, MyNetwork>(snapshot, NUM_TEST_SAMPLES, fill_chunk, threads);
+}
+
+nn::task<> program::checkpoint(const unsigned epoch)
+{
+	// written to the side and renamed over, so there's always a whole checkpoint
+	const std::string name = "checkpoint.dat";
+	const std::string temporary = name + ".tmp";
+
+	if (!nn::util::save(temporary.c_str(), snapshot))
+	{
+		co_await log("failed to write checkpoint for epoch #" + std::to_string(epoch));
+		co_return;
 	}
 
-	// DO STUFF
+	remove(name.c_str());
+	rename(temporary.c_str(), name.c_str());
+}
+
+nn::task<> program::log(const std::string line)
+{
+	std::lock_guard<std::mutex> lock(log_mutex);
+
+	puts(line.c_str());
+	if (log_file)
+	{
+		fprintf(log_file.get(), "%s\n", line.c_str());
+		fflush(log_file.get());
+	}
+
+	co_return;
+}
+
+nn::task<> program::end_of_epoch(const unsigned epoch)
+{
+	// both only read the snapshot, so they can go side by side
+	auto saved = background.spawn(checkpoint(epoch));
+	const auto result = co_await evaluate();
+	co_await saved;
+
+	char line[128];
+	snprintf(line, sizeof(line), "epoch #%u test accuracy: %.3f, top-3: %.3f, log-loss: %.4f",
+		epoch, 100.0f * result.accuracy(), 100.0f * result.top_k(3), result.log_loss());
+	co_await log(line);
+
+	if (epoch + 1 < EPOCHS)
+		co_return;
+
+	for (unsigned c = 0; c < NUM_CLASSES; c++)
+	{
+		snprintf(line, sizeof(line), "  class %u precision: %.3f, recall: %.3f",
+			c, 100.0f * result.precision(c), 100.0f * result.recall(c));
+		co_await log(line);
+	}
+}
+
+// times the kernels for MyNetwork and saves the best to the tuning cache
+static int tune()
+{
+	nn::autotune_options options;
+	options.threads = false; // it trains on this thread
+
+	const auto result = nn::autotune<nn::cost_functions::softmax_cross_entropy, BATCH_SIZE, MyNetwork>(options);
+
+	for (const auto &k : result.kernels)
+		printf("vec_mat %u x %u: block %u, %.0f ns (%.0f ns with the default)\n", k.rows, k.cols, k.block, k.time, k.default_time);
+
+	if (!nn::tuning::save())
+	{
+		printf("couldn't write %s\n", nn::tuning::default_path().c_str());
+		return 1;
+	}
+
+	printf("saved to %s\n", nn::tuning::default_path().c_str());
+	return 0;
+}
+
+int program::run(const int argc, const char *argv[])
+{
+	// whatever's been tuned for this machine, see --tune
+	nn::tuning::load();
+
+	if (argc > 1 && strcmp(argv[1], "--tune") == 0)
+		return tune();
+
+	log_file.reset(fopen("training.log", "w"));
+
+	// LOAD DATA
+
+	auto training_loaded = background.spawn(load_training_data());
+	auto test_loaded = background.spawn(load_test_data());
 
 	for (unsigned ix = 0; ix < NUM_TRAINING_SAMPLES; ix++)
 		shuffled_indices[ix] = ix;
 
-	auto &batch_images = fwd.input;
+	// the same seed gives the same run
+	const std::uint64_t seed = argc > 1 ? strtoull(argv[1], nullptr, 0) : nn::philox::default_seed;
+	nn::philox shuffling(seed), dropout = shuffling.stream(1);
+	background.spawn(log("seed " + std::to_string(seed)));
 
-	nn::randomise_params<MyNetwork>(params);
+	nn::randomise_params<MyNetwork>(params, seed);
 	velocity = 0.0f;
 
-	const float decay = 0.9f;
-	const float learning_rate = 0.1f;
+	if (!training_loaded.get() || !test_loaded.get())
+		return 1;
+
+	// DO STUFF
+
+	// a tenth of the way warming up, then down along a cosine. the rate is
+	// LARS's, per layer relative to the size of its params. scale it with the
+	// batch size.
+	constexpr unsigned steps = EPOCHS * (NUM_TRAINING_SAMPLES / BATCH_SIZE);
+	const nn::warmup<nn::cosine_decay> schedule{ steps / 10, { 3.0f, steps } };
+
+	unsigned step = 0;
+
+	nn::async_result<> last_epoch;
 
-	for (unsigned epoch = 0; epoch < 10; epoch++)
+	for (unsigned epoch = 0; epoch < EPOCHS; epoch++)
 	{
-		printf("starting training epoch #%u...", epoch);
+		nn::util::shuffle(shuffled_indices, shuffling);
 
-		nn::util::shuffle(shuffled_indices);
+		float cost = 0.0f;
 
 		unsigned ix = 0;
 		for (unsigned iteration = 0; iteration < NUM_TRAINING_SAMPLES / BATCH_SIZE; iteration++)
 		{
-			for (unsigned n = 0; n < BATCH_SIZE; n++)
+			const auto fill_batch = [&](auto &batch_images, auto &batch_expectation)
 			{
-				batch_images[n] = training_images[shuffled_indices[ix]];
-				batch_expectation[n] = training_expectation[shuffled_indices[ix]];
-				ix++;
-			}
-
-			const auto &batch_prediction = nn::forward(fwd, params);
-
-			const float j = nn::cost<nn::cost_functions::cross_entropy>(batch_expectation, batch_prediction);
-
-			nn::backward<nn::cost_functions::cross_entropy>(batch_expectation, fwd, params, delta_fwd, gradient);
-
-			velocity *= decay;
-			gradient *= learning_rate;
-			velocity -= gradient;
+				for (unsigned n = 0; n < BATCH_SIZE; n++)
+				{
+					batch_images[n] = training_images[shuffled_indices[ix]];
+					batch_expectation[n] = training_expectation[shuffled_indices[ix]];
+					ix++;
+				}
+			};
+
+			const auto update = [&](auto &gradient)
+			{
+				nn::lars_update<MyNetwork>(params, velocity, gradient, schedule(step++));
+			};
 
-			params += velocity;
+			cost += nn::train_step<nn::cost_functions::softmax_cross_entropy, BATCH_SIZE, MyNetwork>(scratch, params, dropout, fill_batch, update);
 		}
 
-		// test set
-		{
-			const auto &prediction = nn::forward(test_fwd, params);
+		char line[64];
+		snprintf(line, sizeof(line), "epoch #%u training cost: %.4f", epoch, cost / (NUM_TRAINING_SAMPLES / BATCH_SIZE));
+		background.spawn(log(line));
 
-			unsigned correct = 0;
-			for (unsigned n = 0; n < NUM_TEST_SAMPLES; n++)
-			{
-				if (nn::util::classify(prediction[n]) == nn::util::classify(test_expectation[n]))
-					correct++;
-			}
+		// the last epoch's test and checkpoint are still reading the snapshot,
+		// but they've had a whole epoch to get done
+		if (last_epoch.valid())
+			last_epoch.get();
 
-			printf("test accuracy: %.3f\n", 100.0f * static_cast<float>(correct) / NUM_TEST_SAMPLES);
-		}
+		snapshot = params;
+		last_epoch = background.spawn(end_of_epoch(epoch));
 	}
 
+	last_epoch.get();
+
 	nn::util::save("params.dat", params);
 
 	return 0;
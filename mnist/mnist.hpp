@@ -2,15 +2,20 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <type_traits>
+
+#include "cnn/util.hpp"
 
 // -----------------------------------------------------------------------------
 
 template <typename T, unsigned Size>
 bool _verify_idx_dimension(FILE* file)
 {
-	uint32_t size;
-	fread(&size, sizeof(size), 1, file);
-	if (_byteswap_ulong(size) != Size)
+	// big endian
+	uint8_t bytes[4] = {};
+	fread(bytes, sizeof(bytes), 1, file);
+	const uint32_t size = uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 | uint32_t(bytes[2]) << 8 | bytes[3];
+	if (size != Size)
 		return false;
 
 	if constexpr (std::is_array_v<T>)
@@ -24,9 +29,9 @@ bool _verify_idx_dimension(FILE* file)
 template <typename T, unsigned Size>
 bool load_idx(const char* filename, T (&data)[Size])
 {
-	FILE* file;
+	FILE* file = nn::util::open_file(filename, "rb");
 
-	if (0 != fopen_s(&file, filename, "rb"))
+	if (!file)
 		return puts("failed to open"), false;
 
 	uint32_t magic_number;